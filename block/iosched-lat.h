@@ -0,0 +1,105 @@
+/*
+ * Dispatch and completion latency histograms for the simple I/O schedulers
+ *
+ * Requests are stamped, in microseconds, in rq->elevator_private when they
+ * are added to the scheduler and in rq->elevator_private2 when they are
+ * dispatched. Latencies are counted in power-of-two microsecond buckets, by
+ * sync class and data direction, under the queue lock.
+ */
+#ifndef _IOSCHED_LAT_H
+#define _IOSCHED_LAT_H
+
+#include <linux/blkdev.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+
+/* bucket i counts latencies below 2^i usecs, the last one the rest */
+#define IOSCHED_LAT_BUCKETS	24
+
+struct iosched_lat {
+	unsigned long dispatch[2][2][IOSCHED_LAT_BUCKETS];
+	unsigned long complete[2][2][IOSCHED_LAT_BUCKETS];
+};
+
+static inline unsigned long iosched_lat_now(void)
+{
+	return (unsigned long) ktime_to_us(ktime_get());
+}
+
+static inline void iosched_lat_account(unsigned long *hist, unsigned long us)
+{
+	hist[min_t(unsigned int, fls_long(us), IOSCHED_LAT_BUCKETS - 1)]++;
+}
+
+static inline void iosched_lat_add(struct request *rq)
+{
+	rq->elevator_private = (void *) iosched_lat_now();
+}
+
+/* 'rq' absorbed 'next', it has been waiting since the older of the two */
+static inline void iosched_lat_merge(struct request *rq, struct request *next)
+{
+	if ((long) ((unsigned long) next->elevator_private -
+		    (unsigned long) rq->elevator_private) < 0)
+		rq->elevator_private = next->elevator_private;
+}
+
+static inline void iosched_lat_dispatch(struct iosched_lat *lat,
+					struct request *rq)
+{
+	unsigned long now = iosched_lat_now();
+
+	iosched_lat_account(lat->dispatch[rq_is_sync(rq)][rq_data_dir(rq)],
+			    now - (unsigned long) rq->elevator_private);
+	rq->elevator_private2 = (void *) now;
+}
+
+static inline void iosched_lat_complete(struct iosched_lat *lat,
+					struct request *rq)
+{
+	iosched_lat_account(lat->complete[rq_is_sync(rq)][rq_data_dir(rq)],
+			    iosched_lat_now() -
+			    (unsigned long) rq->elevator_private2);
+}
+
+/*
+ * iosched_lat_show - prints one histogram into a sysfs page: a line with
+ * the bucket limits in usecs, then one line of counts per class.
+ */
+static inline ssize_t
+iosched_lat_show(unsigned long (*hist)[2][IOSCHED_LAT_BUCKETS], char *page)
+{
+	static const char * const names[2][2] = {
+		{ "async_read", "async_write" },
+		{ "sync_read", "sync_write" },
+	};
+	ssize_t len;
+	int sync, dir, i;
+
+	len = sprintf(page, "usecs:");
+	for (i = 0; i < IOSCHED_LAT_BUCKETS - 1; i++)
+		len += sprintf(page + len, " <%lu", 1UL << i);
+	len += sprintf(page + len, " more\n");
+
+	for (sync = 1; sync >= 0; sync--) {
+		for (dir = READ; dir <= WRITE; dir++) {
+			len += sprintf(page + len, "%s:", names[sync][dir]);
+			for (i = 0; i < IOSCHED_LAT_BUCKETS; i++)
+				len += sprintf(page + len, " %lu",
+					       hist[sync][dir][i]);
+			len += sprintf(page + len, "\n");
+		}
+	}
+
+	return len;
+}
+
+/* any write to a histogram attribute clears it */
+static inline ssize_t
+iosched_lat_store(unsigned long (*hist)[2][IOSCHED_LAT_BUCKETS], size_t count)
+{
+	memset(hist, 0, sizeof(unsigned long) * 2 * 2 * IOSCHED_LAT_BUCKETS);
+	return count;
+}
+
+#endif /* _IOSCHED_LAT_H */
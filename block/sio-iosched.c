@@ -20,6 +20,8 @@
 #include <linux/init.h>
 #include <linux/version.h>
 
+#include "iosched-lat.h"
+
 enum { ASYNC, SYNC };
 
 /* Tunables */
@@ -46,6 +48,9 @@ struct sio_data {
 	int fifo_expire[2][2];
 	int fifo_batch;
 	int writes_starved;
+
+	/* Statistics */
+	struct iosched_lat lat;
 };
 
 static void
@@ -63,6 +68,8 @@ sio_merged_requests(struct request_queue *q, struct request *rq,
 		}
 	}
 
+	iosched_lat_merge(rq, next);
+
 	/* Delete next request */
 	rq_fifo_clear(next);
 }
@@ -80,6 +87,15 @@ sio_add_request(struct request_queue *q, struct request *rq)
 	 */
 	rq_set_fifo_time(rq, jiffies + sd->fifo_expire[sync][data_dir]);
 	list_add_tail(&rq->queuelist, &sd->fifo_list[sync][data_dir]);
+	iosched_lat_add(rq);
+}
+
+static void
+sio_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+
+	iosched_lat_complete(&sd->lat, rq);
 }
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,38)
@@ -173,6 +189,7 @@ sio_dispatch_request(struct sio_data *sd, struct request *rq)
 	 */
 	rq_fifo_clear(rq);
 	elv_dispatch_add_tail(rq->q, rq);
+	iosched_lat_dispatch(&sd->lat, rq);
 
 	sd->batched++;
 
@@ -265,6 +282,7 @@ sio_init_queue(struct request_queue *q)
 	sd->fifo_expire[ASYNC][READ] = async_read_expire;
 	sd->fifo_expire[ASYNC][WRITE] = async_write_expire;
 	sd->fifo_batch = fifo_batch;
+	memset(&sd->lat, 0, sizeof(sd->lat));
 
 	return sd;
 }
@@ -343,6 +361,22 @@ STORE_FUNCTION(sio_fifo_batch_store, &sd->fifo_batch, 0, INT_MAX, 0);
 STORE_FUNCTION(sio_writes_starved_store, &sd->writes_starved, 0, INT_MAX, 0);
 #undef STORE_FUNCTION
 
+#define LAT_FUNCTION(__NAME, __HIST)					\
+static ssize_t sio_##__NAME##_show(struct elevator_queue *e, char *page)	\
+{									\
+	struct sio_data *sd = e->elevator_data;				\
+	return iosched_lat_show(sd->lat.__HIST, page);			\
+}									\
+static ssize_t sio_##__NAME##_store(struct elevator_queue *e,		\
+				    const char *page, size_t count)	\
+{									\
+	struct sio_data *sd = e->elevator_data;				\
+	return iosched_lat_store(sd->lat.__HIST, count);		\
+}
+LAT_FUNCTION(dispatch_latency, dispatch);
+LAT_FUNCTION(completion_latency, complete);
+#undef LAT_FUNCTION
+
 #define DD_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, sio_##name##_show, \
 				      sio_##name##_store)
@@ -354,6 +388,8 @@ static struct elv_fs_entry sio_attrs[] = {
 	DD_ATTR(async_write_expire),
 	DD_ATTR(fifo_batch),
 	DD_ATTR(writes_starved),
+	DD_ATTR(dispatch_latency),
+	DD_ATTR(completion_latency),
 	__ATTR_NULL
 };
 
@@ -362,6 +398,7 @@ static struct elevator_type iosched_sio = {
 		.elevator_merge_req_fn		= sio_merged_requests,
 		.elevator_dispatch_fn		= sio_dispatch_requests,
 		.elevator_add_req_fn		= sio_add_request,
+		.elevator_completed_req_fn	= sio_completed_request,
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,38)
 		.elevator_queue_empty_fn	= sio_queue_empty,
 #endif
@@ -29,6 +29,8 @@
 
 #include <asm/div64.h>
 
+#include "iosched-lat.h"
+
 enum vr_data_dir {
 ASYNC,
 SYNC,
@@ -59,6 +61,9 @@ int head_dir;
 int fifo_expire[2];
 int fifo_batch;
 int rev_penalty;
+
+/* statistics */
+struct iosched_lat lat;
 };
 
 static void vr_move_request(struct vr_data *, struct request *);
@@ -127,6 +132,13 @@ if (vd->fifo_expire[dir]) {
 rq_set_fifo_time(rq, jiffies + vd->fifo_expire[dir]);
 list_add_tail(&rq->queuelist, &vd->fifo_list[dir]);
 }
+iosched_lat_add(rq);
+}
+
+static void
+vr_completed_request(struct request_queue *q, struct request *rq)
+{
+iosched_lat_complete(&vr_get_data(q)->lat, rq);
 }
 
 /*
@@ -184,6 +196,7 @@ rq_set_fifo_time(rq, rq_fifo_time(next));
 }
 }
 
+iosched_lat_merge(rq, next);
 vr_remove_request(q, next);
 }
 
@@ -208,6 +221,7 @@ BUG_ON(vd->next_rq && vd->next_rq == vd->prev_rq);
 
 vr_remove_request(q, rq);
 elv_dispatch_add_tail(q, rq);
+iosched_lat_dispatch(&vd->lat, rq);
 vd->nbatched++;
 }
 
@@ -395,6 +409,21 @@ STORE_FUNCTION(vr_fifo_batch_store, &vd->fifo_batch, 0, INT_MAX, 0);
 STORE_FUNCTION(vr_rev_penalty_store, &vd->rev_penalty, 0, INT_MAX, 0);
 #undef STORE_FUNCTION
 
+#define LAT_FUNCTION(__NAME, __HIST) \
+static ssize_t vr_##__NAME##_show(struct elevator_queue *e, char *page) \
+{ \
+struct vr_data *vd = e->elevator_data; \
+return iosched_lat_show(vd->lat.__HIST, page); \
+} \
+static ssize_t vr_##__NAME##_store(struct elevator_queue *e, const char *page, size_t count) \
+{ \
+struct vr_data *vd = e->elevator_data; \
+return iosched_lat_store(vd->lat.__HIST, count); \
+}
+LAT_FUNCTION(dispatch_latency, dispatch);
+LAT_FUNCTION(completion_latency, complete);
+#undef LAT_FUNCTION
+
 #define DD_ATTR(name) \
 __ATTR(name, S_IRUGO|S_IWUSR, vr_##name##_show, \
 vr_##name##_store)
@@ -404,6 +433,8 @@ DD_ATTR(sync_expire),
 DD_ATTR(async_expire),
 DD_ATTR(fifo_batch),
 DD_ATTR(rev_penalty),
+DD_ATTR(dispatch_latency),
+DD_ATTR(completion_latency),
 __ATTR_NULL
 };
 
@@ -414,6 +445,7 @@ static struct elevator_type iosched_vr = {
 .elevator_merge_req_fn = vr_merged_requests,
 .elevator_dispatch_fn = vr_dispatch_requests,
 .elevator_add_req_fn = vr_add_request,
+.elevator_completed_req_fn = vr_completed_request,
 .elevator_queue_empty_fn = vr_queue_empty,
 .elevator_former_req_fn = elv_rb_former_request,
 .elevator_latter_req_fn = elv_rb_latter_request,
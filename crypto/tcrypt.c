@@ -26,6 +26,7 @@
 #include <linux/jiffies.h>
 #include <linux/timex.h>
 #include <linux/interrupt.h>
+#include <linux/vmalloc.h>
 #include "tcrypt.h"
 #include "internal.h"
 
@@ -40,6 +41,12 @@
 #define ENCRYPT 1
 #define DECRYPT 0
 
+/*
+ * Used by test_comp_speed()
+ */
+#define COMPRESS 1
+#define DECOMPRESS 0
+
 /*
  * Used by test_cipher_speed()
  */
@@ -57,7 +64,7 @@ static char *check[] = {
 	"cast6", "arc4", "michael_mic", "deflate", "crc32c", "tea", "xtea",
 	"khazad", "wp512", "wp384", "wp256", "tnepres", "xeta",  "fcrypt",
 	"camellia", "seed", "salsa20", "rmd128", "rmd160", "rmd256", "rmd320",
-	"lzo", "cts", "zlib", NULL
+	"lzo", "cts", "zlib", "lz4", "lz4hc", NULL
 };
 
 static int test_cipher_jiffies(struct blkcipher_desc *desc, int enc,
@@ -458,6 +465,192 @@ out:
 	crypto_free_hash(tfm);
 }
 
+static int test_comp_op(struct crypto_comp *tfm, int comp, const u8 *src,
+			unsigned int slen, u8 *dst, unsigned int dlen)
+{
+	if (comp)
+		return crypto_comp_compress(tfm, src, slen, dst, &dlen);
+	else
+		return crypto_comp_decompress(tfm, src, slen, dst, &dlen);
+}
+
+static int test_comp_jiffies(struct crypto_comp *tfm, int comp,
+			     const u8 *src, unsigned int slen, u8 *dst,
+			     unsigned int dlen, int blen, int sec)
+{
+	unsigned long start, end;
+	int bcount;
+	int ret;
+
+	for (start = jiffies, end = start + sec * HZ, bcount = 0;
+	     time_before(jiffies, end); bcount++) {
+		ret = test_comp_op(tfm, comp, src, slen, dst, dlen);
+		if (ret)
+			return ret;
+	}
+
+	printk("%6u opers/sec, %9lu bytes/sec\n",
+	       bcount / sec, ((long)bcount * blen) / sec);
+
+	return 0;
+}
+
+static int test_comp_cycles(struct crypto_comp *tfm, int comp,
+			    const u8 *src, unsigned int slen, u8 *dst,
+			    unsigned int dlen, int blen)
+{
+	unsigned long cycles = 0;
+	int i;
+	int ret;
+
+	local_bh_disable();
+	local_irq_disable();
+
+	/* Warm-up run. */
+	for (i = 0; i < 4; i++) {
+		ret = test_comp_op(tfm, comp, src, slen, dst, dlen);
+		if (ret)
+			goto out;
+	}
+
+	/* The real thing. */
+	for (i = 0; i < 8; i++) {
+		cycles_t start, end;
+
+		start = get_cycles();
+
+		ret = test_comp_op(tfm, comp, src, slen, dst, dlen);
+		if (ret)
+			goto out;
+
+		end = get_cycles();
+
+		cycles += end - start;
+	}
+
+out:
+	local_irq_enable();
+	local_bh_enable();
+
+	if (ret)
+		return ret;
+
+	printk("%6lu cycles/operation, %4lu cycles/byte\n",
+	       cycles / 8, cycles / (8 * blen));
+
+	return 0;
+}
+
+/*
+ * Fill @buf with text-like data: words picked by a fixed pseudo-random
+ * sequence, so results are comparable between runs and algorithms.
+ */
+static void test_comp_fill(u8 *buf, unsigned int len)
+{
+	static const char * const words[] = {
+		"the ", "kernel ", "page ", "cache ", "of ", "and ", "swap ",
+		"memory ", "0x00000000 ", "block ", "device ", "struct ",
+		"return ", "NULL; ", "\n\t", "int ", "if (", ") {\n",
+	};
+	u32 seed = 1;
+	unsigned int pos = 0;
+
+	while (pos < len) {
+		const char *w;
+		unsigned int n;
+
+		seed = seed * 1103515245 + 12345;
+		w = words[(seed >> 16) % ARRAY_SIZE(words)];
+		n = min_t(unsigned int, strlen(w), len - pos);
+		memcpy(buf + pos, w, n);
+		pos += n;
+	}
+}
+
+static void test_comp_speed(const char *algo, unsigned int sec,
+			    unsigned int *sizes)
+{
+	struct crypto_comp *tfm;
+	u8 *src, *cbuf, *dbuf;
+	unsigned int clen;
+	int i;
+	int ret;
+
+	printk(KERN_INFO "\ntesting speed of %s\n", algo);
+
+	tfm = crypto_alloc_comp(algo, 0, CRYPTO_ALG_ASYNC);
+
+	if (IS_ERR(tfm)) {
+		printk(KERN_ERR "failed to load transform for %s: %ld\n", algo,
+		       PTR_ERR(tfm));
+		return;
+	}
+
+	src = vmalloc(COMP_SPEED_MAX);
+	cbuf = vmalloc(COMP_SPEED_MAX * 2);
+	dbuf = vmalloc(COMP_SPEED_MAX);
+	if (!src || !cbuf || !dbuf) {
+		printk(KERN_ERR "tcrypt: failed to allocate buffers\n");
+		goto out;
+	}
+
+	test_comp_fill(src, COMP_SPEED_MAX);
+
+	for (i = 0; sizes[i] != 0; i++) {
+		if (sizes[i] > COMP_SPEED_MAX) {
+			printk(KERN_ERR "template (%u) too big for buffer (%u)\n",
+			       sizes[i], COMP_SPEED_MAX);
+			goto out;
+		}
+
+		clen = COMP_SPEED_MAX * 2;
+		ret = crypto_comp_compress(tfm, src, sizes[i], cbuf, &clen);
+		if (ret) {
+			printk(KERN_ERR "compression failed ret=%d\n", ret);
+			goto out;
+		}
+
+		printk(KERN_INFO "test%3u (%6u byte blocks, %6u compressed): ",
+		       i, sizes[i], clen);
+
+		printk("compress ");
+		if (sec)
+			ret = test_comp_jiffies(tfm, COMPRESS, src, sizes[i],
+						cbuf, COMP_SPEED_MAX * 2,
+						sizes[i], sec);
+		else
+			ret = test_comp_cycles(tfm, COMPRESS, src, sizes[i],
+					       cbuf, COMP_SPEED_MAX * 2,
+					       sizes[i]);
+		if (ret) {
+			printk(KERN_ERR "compression failed ret=%d\n", ret);
+			break;
+		}
+
+		printk(KERN_INFO "test%3u (%6u byte blocks, %6u compressed): ",
+		       i, sizes[i], clen);
+
+		printk("decompress ");
+		if (sec)
+			ret = test_comp_jiffies(tfm, DECOMPRESS, cbuf, clen,
+						dbuf, COMP_SPEED_MAX,
+						sizes[i], sec);
+		else
+			ret = test_comp_cycles(tfm, DECOMPRESS, cbuf, clen,
+					       dbuf, COMP_SPEED_MAX, sizes[i]);
+		if (ret) {
+			printk(KERN_ERR "decompression failed ret=%d\n", ret);
+			break;
+		}
+	}
+
+out:
+	vfree(dbuf);
+	vfree(cbuf);
+	vfree(src);
+	crypto_free_comp(tfm);
+}
+
 static void test_available(void)
 {
 	char **name = check;
@@ -683,6 +876,14 @@ static int do_test(int m)
 		ret += tcrypt_test("rfc4309(ccm(aes))");
 		break;
 
+	case 46:
+		ret += tcrypt_test("lz4");
+		break;
+
+	case 47:
+		ret += tcrypt_test("lz4hc");
+		break;
+
 	case 100:
 		ret += tcrypt_test("hmac(md5)");
 		break;
@@ -884,6 +1085,28 @@ static int do_test(int m)
 	case 399:
 		break;
 
+	case 400:
+		/* fall through */
+
+	case 401:
+		test_comp_speed("deflate", sec, comp_speed_template);
+		if (mode > 400 && mode < 500) break;
+
+	case 402:
+		test_comp_speed("lzo", sec, comp_speed_template);
+		if (mode > 400 && mode < 500) break;
+
+	case 403:
+		test_comp_speed("lz4", sec, comp_speed_template);
+		if (mode > 400 && mode < 500) break;
+
+	case 404:
+		test_comp_speed("lz4hc", sec, comp_speed_template);
+		if (mode > 400 && mode < 500) break;
+
+	case 499:
+		break;
+
 	case 1000:
 		test_available();
 		break;
@@ -83,4 +83,16 @@ static struct hash_speed generic_hash_speed_template[] = {
 	{  .blen = 0,	.plen = 0, }
 };
 
+/*
+ * Compression speed tests
+ */
+#define COMP_SPEED_MAX	65536
+
+static unsigned int comp_speed_template[] = {
+	512, 1024, 4096, 16384, COMP_SPEED_MAX,
+
+	/* End marker */
+	0
+};
+
 #endif	/* _CRYPTO_TCRYPT_H */
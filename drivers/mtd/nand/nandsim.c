@@ -41,6 +41,12 @@
 #include <linux/sched.h>
 #include <linux/fs.h>
 #include <linux/pagemap.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#define CREATE_TRACE_POINTS
+#include "nandsim_trace.h"
 
 /* Default simulator parameters values */
 #if !defined(CONFIG_NANDSIM_FIRST_ID_BYTE)  || \
@@ -92,6 +98,7 @@ static uint output_cycle   = CONFIG_NANDSIM_OUTPUT_CYCLE;
 static uint input_cycle    = CONFIG_NANDSIM_INPUT_CYCLE;
 static uint bus_width      = CONFIG_NANDSIM_BUS_WIDTH;
 static uint do_delays      = CONFIG_NANDSIM_DO_DELAYS;
+static uint bandwidth      = 0;
 static uint log            = CONFIG_NANDSIM_LOG;
 static uint dbg            = CONFIG_NANDSIM_DBG;
 static unsigned long parts[MAX_MTD_DEVICES];
@@ -116,6 +123,7 @@ module_param(output_cycle,   uint, 0400);
 module_param(input_cycle,    uint, 0400);
 module_param(bus_width,      uint, 0400);
 module_param(do_delays,      uint, 0400);
+module_param(bandwidth,      uint, 0400);
 module_param(log,            uint, 0400);
 module_param(dbg,            uint, 0400);
 module_param_array(parts, ulong, &parts_num, 0400);
@@ -138,7 +146,8 @@ MODULE_PARM_DESC(erase_delay,    "Sector erase delay (milliseconds)");
 MODULE_PARM_DESC(output_cycle,   "Word output (from flash) time (nanodeconds)");
 MODULE_PARM_DESC(input_cycle,    "Word input (to flash) time (nanodeconds)");
 MODULE_PARM_DESC(bus_width,      "Chip's bus width (8- or 16-bit)");
-MODULE_PARM_DESC(do_delays,      "Simulate NAND delays using busy-waits if not zero");
+MODULE_PARM_DESC(do_delays,      "Simulate NAND delays: 0 - off, 1 - busy-wait, 2 - sleep");
+MODULE_PARM_DESC(bandwidth,      "Data transfer ceiling in KiB/s when simulating delays (zero by default - no ceiling)");
 MODULE_PARM_DESC(log,            "Perform logging if not zero");
 MODULE_PARM_DESC(dbg,            "Output debug information if not zero");
 MODULE_PARM_DESC(parts,          "Partition sizes (in erase blocks) separated by commas");
@@ -154,7 +163,8 @@ MODULE_PARM_DESC(bitflips,       "Maximum number of random bit flips per page (z
 MODULE_PARM_DESC(gravepages,     "Pages that lose data [: maximum reads (defaults to 3)]"
 				 " separated by commas e.g. 1401:2 means page 1401"
 				 " can be read only twice before failing");
-MODULE_PARM_DESC(rptwear,        "Number of erases inbetween reporting wear, if not zero");
+MODULE_PARM_DESC(rptwear,        "Number of erases inbetween reporting wear, if not zero."
+				 " Per erase block wear is always in debugfs nandsim/wear");
 MODULE_PARM_DESC(overridesize,   "Specifies the NAND Flash size overriding the ID bytes. "
 				 "The size is specified in erase blocks and as the exponent of a power of two"
 				 " e.g. 5 means a size of 32 erase blocks");
@@ -178,11 +188,6 @@ MODULE_PARM_DESC(cache_file,     "File to use to cache nand pages instead of mem
 #define NS_INFO(args...) \
 	do { printk(KERN_INFO NS_OUTPUT_PREFIX " " args); } while(0)
 
-/* Busy-wait delay macros (microseconds, milliseconds) */
-#define NS_UDELAY(us) \
-        do { if (do_delays) udelay(us); } while(0)
-#define NS_MDELAY(us) \
-        do { if (do_delays) mdelay(us); } while(0)
 
 /* Is the nandsim structure initialized ? */
 #define NS_IS_INITIALIZED(ns) ((ns)->geom.totsz != 0)
@@ -354,6 +359,21 @@ struct nandsim {
 	void *file_buf;
 	struct page *held_pages[NS_MAX_HELD_PAGES];
 	int held_cnt;
+
+	/* Operation counters and modelled busy time (microseconds) */
+	struct nandsim_stats {
+		unsigned long reads;
+		unsigned long progs;
+		unsigned long erases;
+		unsigned long long read_bytes;
+		unsigned long long prog_bytes;
+		unsigned long long read_us;
+		unsigned long long prog_us;
+		unsigned long long erase_us;
+	} stats;
+	ktime_t bw_next;	/* when the bandwidth ceiling frees the bus */
+
+	struct dentry *dbg_dir;
 };
 
 /*
@@ -429,6 +449,7 @@ struct grave_page {
 static LIST_HEAD(grave_pages);
 
 static unsigned long *erase_block_wear = NULL;
+static unsigned long *erase_block_progs = NULL;
 static unsigned int wear_eb_count = 0;
 static unsigned long total_wear = 0;
 static unsigned int rptwear_cnt = 0;
@@ -902,14 +923,17 @@ static void free_lists(void)
 		kfree(list_entry(pos, struct grave_page, list));
 	}
 	kfree(erase_block_wear);
+	kfree(erase_block_progs);
 }
 
+/*
+ * Per erase block erase and program counters. They are kept even if wear
+ * is not reported (rptwear is zero) so that debugfs can show them.
+ */
 static int setup_wear_reporting(struct mtd_info *mtd)
 {
 	size_t mem;
 
-	if (!rptwear)
-		return 0;
 	wear_eb_count = divide(mtd->size, mtd->erasesize);
 	mem = wear_eb_count * sizeof(unsigned long);
 	if (mem / sizeof(unsigned long) != wear_eb_count) {
@@ -917,7 +941,8 @@ static int setup_wear_reporting(struct mtd_info *mtd)
 		return -ENOMEM;
 	}
 	erase_block_wear = kzalloc(mem, GFP_KERNEL);
-	if (!erase_block_wear) {
+	erase_block_progs = kzalloc(mem, GFP_KERNEL);
+	if (!erase_block_wear || !erase_block_progs) {
 		NS_ERR("Too many erase blocks for wear reporting\n");
 		return -ENOMEM;
 	}
@@ -938,6 +963,8 @@ static void update_wear(unsigned int erase_block_no)
 	erase_block_wear[erase_block_no] += 1;
 	if (erase_block_wear[erase_block_no] == 0)
 		NS_ERR("Erase counter overflow for erase block %u\n", erase_block_no);
+	if (!rptwear)
+		return;
 	rptwear_cnt += 1;
 	if (rptwear_cnt < rptwear)
 		return;
@@ -986,6 +1013,102 @@ static void update_wear(unsigned int erase_block_no)
 	NS_INFO("*** End of Wear Report ***\n");
 }
 
+/*
+ * debugfs: "wear" lists the erase and program counts of every erase block,
+ * "stats" the operation counters and the simulated time spent on them.
+ */
+static int nandsim_wear_show(struct seq_file *m, void *private)
+{
+	unsigned int i;
+
+	seq_printf(m, "block erases programs\n");
+	for (i = 0; i < wear_eb_count; ++i)
+		seq_printf(m, "%u %lu %lu\n", i, erase_block_wear[i], erase_block_progs[i]);
+	return 0;
+}
+
+static int nandsim_stats_show(struct seq_file *m, void *private)
+{
+	struct nandsim *ns = m->private;
+	unsigned long wmin = -1, wmax = 0, tot = 0;
+	unsigned int i;
+
+	for (i = 0; i < wear_eb_count; ++i) {
+		unsigned long wear = erase_block_wear[i];
+		if (wear < wmin)
+			wmin = wear;
+		if (wear > wmax)
+			wmax = wear;
+		tot += wear;
+	}
+	if (!wear_eb_count)
+		wmin = 0;
+
+	seq_printf(m, "reads:       %lu\n", ns->stats.reads);
+	seq_printf(m, "read_bytes:  %llu\n", ns->stats.read_bytes);
+	seq_printf(m, "read_us:     %llu\n", ns->stats.read_us);
+	seq_printf(m, "progs:       %lu\n", ns->stats.progs);
+	seq_printf(m, "prog_bytes:  %llu\n", ns->stats.prog_bytes);
+	seq_printf(m, "prog_us:     %llu\n", ns->stats.prog_us);
+	seq_printf(m, "erases:      %lu\n", ns->stats.erases);
+	seq_printf(m, "erase_us:    %llu\n", ns->stats.erase_us);
+	seq_printf(m, "wear_min:    %lu\n", wmin);
+	seq_printf(m, "wear_max:    %lu\n", wmax);
+	seq_printf(m, "wear_avg:    %lu\n", wear_eb_count ? tot / wear_eb_count : 0);
+	return 0;
+}
+
+static int nandsim_wear_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nandsim_wear_show, inode->i_private);
+}
+
+static int nandsim_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nandsim_stats_show, inode->i_private);
+}
+
+static const struct file_operations nandsim_wear_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nandsim_wear_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations nandsim_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nandsim_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * The simulator works without debugfs, so failing to set it up is only
+ * warned about.
+ */
+static void nandsim_debugfs_create(struct nandsim *ns)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("nandsim", NULL);
+	if (IS_ERR(dir) || !dir) {
+		NS_WARN("cannot create debugfs directory\n");
+		return;
+	}
+	ns->dbg_dir = dir;
+
+	debugfs_create_file("wear", S_IRUSR, dir, ns, &nandsim_wear_fops);
+	debugfs_create_file("stats", S_IRUSR, dir, ns, &nandsim_stats_fops);
+}
+
+static void nandsim_debugfs_remove(struct nandsim *ns)
+{
+	debugfs_remove_recursive(ns->dbg_dir);
+	ns->dbg_dir = NULL;
+}
+
 /*
  * Returns the string representation of 'state' state.
  */
@@ -1567,6 +1690,43 @@ static int prog_page(struct nandsim *ns, int num)
 	return 0;
 }
 
+/*
+ * Simulate 'us' microseconds of flash operation which moves 'bytes' over the
+ * bus, waiting longer if the bandwidth ceiling requires it.
+ *
+ * RETURNS: the simulated time in microseconds, 0 if delays are off.
+ */
+static unsigned long ns_delay(struct nandsim *ns, unsigned long us, unsigned int bytes)
+{
+	if (!do_delays)
+		return 0;
+
+	if (bandwidth && bytes) {
+		ktime_t now = ktime_get();
+		unsigned long wait;
+
+		if (ktime_to_ns(ktime_sub(ns->bw_next, now)) < 0)
+			ns->bw_next = now;
+		/* bytes * 10^6 / (bandwidth * 1024) microseconds */
+		ns->bw_next = ktime_add_us(ns->bw_next,
+				div_u64((u64)bytes * 15625, bandwidth * 16));
+		wait = ktime_us_delta(ns->bw_next, now);
+		if (wait > us)
+			us = wait;
+	}
+
+	if (do_delays == 1) {
+		mdelay(us / 1000);
+		udelay(us % 1000);
+	} else if (us >= 20000) {
+		msleep(DIV_ROUND_UP(us, 1000));
+	} else if (us) {
+		usleep_range(us, us);
+	}
+
+	return us;
+}
+
 /*
  * If state has any action bit, perform this action.
  *
@@ -1577,6 +1737,7 @@ static int do_state_action(struct nandsim *ns, uint32_t action)
 	int num;
 	int busdiv = ns->busw == 8 ? 1 : 2;
 	unsigned int erase_block_no, page_no;
+	unsigned long us;
 
 	action &= ACTION_MASK;
 
@@ -1611,8 +1772,12 @@ static int do_state_action(struct nandsim *ns, uint32_t action)
 		else
 			NS_LOG("read OOB of page %d\n", ns->regs.row);
 
-		NS_UDELAY(access_delay);
-		NS_UDELAY(input_cycle * ns->geom.pgsz / 1000 / busdiv);
+		/* Data comes out of the flash at output_cycle per word */
+		us = ns_delay(ns, access_delay + output_cycle * num / 1000 / busdiv, num);
+		ns->stats.reads++;
+		ns->stats.read_bytes += num;
+		ns->stats.read_us += us;
+		trace_nandsim_read(ns->regs.row, ns->regs.off + ns->regs.column, num, us);
 
 		break;
 
@@ -1644,11 +1809,16 @@ static int do_state_action(struct nandsim *ns, uint32_t action)
 
 		erase_sector(ns);
 
-		NS_MDELAY(erase_delay);
+		us = ns_delay(ns, erase_delay * 1000, 0);
+		ns->stats.erases++;
+		ns->stats.erase_us += us;
 
 		if (erase_block_wear)
 			update_wear(erase_block_no);
 
+		trace_nandsim_erase(erase_block_no,
+				    erase_block_wear ? erase_block_wear[erase_block_no] : 0, us);
+
 		if (erase_error(erase_block_no)) {
 			NS_WARN("simulating erase failure in erase block %u\n", erase_block_no);
 			return -1;
@@ -1682,8 +1852,14 @@ static int do_state_action(struct nandsim *ns, uint32_t action)
 			num, ns->regs.row, ns->regs.column, NS_RAW_OFFSET(ns) + ns->regs.off);
 		NS_LOG("programm page %d\n", ns->regs.row);
 
-		NS_UDELAY(programm_delay);
-		NS_UDELAY(output_cycle * ns->geom.pgsz / 1000 / busdiv);
+		/* Data goes into the flash at input_cycle per word */
+		us = ns_delay(ns, programm_delay + input_cycle * num / 1000 / busdiv, num);
+		ns->stats.progs++;
+		ns->stats.prog_bytes += num;
+		ns->stats.prog_us += us;
+		if (erase_block_progs)
+			erase_block_progs[page_no >> (ns->geom.secshift - ns->geom.pgshift)] += 1;
+		trace_nandsim_prog(page_no, ns->regs.off + ns->regs.column, num, us);
 
 		if (write_error(page_no)) {
 			NS_WARN("simulating write failure in page %u\n", page_no);
@@ -2324,6 +2500,8 @@ static int __init ns_init_module(void)
 	if ((retval = add_mtd_partitions(nsmtd, &nand->partitions[0], nand->nbparts)) != 0)
 		goto err_exit;
 
+	nandsim_debugfs_create(nand);
+
         return 0;
 
 err_exit:
@@ -2348,6 +2526,7 @@ static void __exit ns_cleanup_module(void)
 	struct nandsim *ns = (struct nandsim *)(((struct nand_chip *)nsmtd->priv)->priv);
 	int i;
 
+	nandsim_debugfs_remove(ns);
 	free_nandsim(ns);    /* Free nandsim private resources */
 	nand_release(nsmtd); /* Unregister driver */
 	for (i = 0;i < ARRAY_SIZE(ns->partitions); ++i)
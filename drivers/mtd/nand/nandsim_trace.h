@@ -0,0 +1,85 @@
+/*
+ * nandsim_trace.h - trace events for the NAND flash simulator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nandsim
+
+#if !defined(_NANDSIM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _NANDSIM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* 'us' is the modelled duration of the operation, see do_delays */
+
+TRACE_EVENT(nandsim_read,
+	TP_PROTO(unsigned int page, unsigned int off, unsigned int bytes,
+		 unsigned long us),
+	TP_ARGS(page, off, bytes, us),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, page)
+		__field(unsigned int, off)
+		__field(unsigned int, bytes)
+		__field(unsigned long, us)
+	),
+	TP_fast_assign(
+		__entry->page = page;
+		__entry->off = off;
+		__entry->bytes = bytes;
+		__entry->us = us;
+	),
+	TP_printk("page=%u off=%u bytes=%u time=%luus",
+		  __entry->page, __entry->off, __entry->bytes, __entry->us)
+);
+
+TRACE_EVENT(nandsim_prog,
+	TP_PROTO(unsigned int page, unsigned int off, unsigned int bytes,
+		 unsigned long us),
+	TP_ARGS(page, off, bytes, us),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, page)
+		__field(unsigned int, off)
+		__field(unsigned int, bytes)
+		__field(unsigned long, us)
+	),
+	TP_fast_assign(
+		__entry->page = page;
+		__entry->off = off;
+		__entry->bytes = bytes;
+		__entry->us = us;
+	),
+	TP_printk("page=%u off=%u bytes=%u time=%luus",
+		  __entry->page, __entry->off, __entry->bytes, __entry->us)
+);
+
+TRACE_EVENT(nandsim_erase,
+	TP_PROTO(unsigned int block, unsigned long erases, unsigned long us),
+	TP_ARGS(block, erases, us),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, block)
+		__field(unsigned long, erases)
+		__field(unsigned long, us)
+	),
+	TP_fast_assign(
+		__entry->block = block;
+		__entry->erases = erases;
+		__entry->us = us;
+	),
+	TP_printk("block=%u erases=%lu time=%luus",
+		  __entry->block, __entry->erases, __entry->us)
+);
+
+#endif /* _NANDSIM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nandsim_trace
+#include <trace/define_trace.h>
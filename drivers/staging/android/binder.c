@@ -19,6 +19,7 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -36,9 +37,30 @@
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking overview:
+ *
+ * binder_procs_lock is held for reading by every ioctl, poll and flush,
+ * and for writing only when a binder_proc or binder_thread goes away
+ * or the context manager changes. So procs, threads and node->proc are
+ * stable for any ioctl, while unrelated processes never serialize on it.
+ *
+ * Everything else uses per-object locks, always taken in this order:
+ *
+ *   proc->outer_lock (mutex)      refs_by_desc, refs_by_node, ref counts
+ *                                 and ref->death
+ *   node->lock (spinlock)         fields of a dead node (node->proc NULL)
+ *   proc->inner_lock (spinlock)   todo lists, thread state and transaction
+ *                                 stacks, the threads and nodes trees and
+ *                                 the fields of nodes owned by @proc
+ *
+ * No two locks of the same kind are ever held at once. proc->alloc_lock
+ * (mutex) covers the buffer allocator and nests outside mmap_sem only.
+ */
+static DECLARE_RWSEM(binder_procs_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 static DEFINE_MUTEX(binder_mmap_lock);
+static DEFINE_SPINLOCK(binder_dead_nodes_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
@@ -48,7 +70,7 @@ static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -106,6 +128,13 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static bool binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+/* Max. no. of unused pages each proc keeps mapped for the next buffer */
+static int binder_page_pool_size = 16;
+module_param_named(page_pool_size, binder_page_pool_size, int, S_IWUSR | S_IRUGO);
+
+/* Pages in all the pools, reported to the shrinker */
+static atomic_t binder_free_pages = ATOMIC_INIT(0);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -147,22 +176,22 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -184,11 +213,14 @@ struct binder_transaction_log {
 };
 static struct binder_transaction_log binder_transaction_log;
 static struct binder_transaction_log binder_transaction_log_failed;
+static DEFINE_SPINLOCK(binder_transaction_log_lock);
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
+
+	spin_lock(&binder_transaction_log_lock);
 	e = &log->entry[log->next];
 	memset(e, 0, sizeof(*e));
 	log->next++;
@@ -196,6 +228,7 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 		log->next = 0;
 		log->full = 1;
 	}
+	spin_unlock(&binder_transaction_log_lock);
 	return e;
 }
 
@@ -213,6 +246,7 @@ struct binder_work {
 
 struct binder_node {
 	int debug_id;
+	spinlock_t lock;
 	struct binder_work work;
 	union {
 		struct rb_node rb_node;
@@ -223,6 +257,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;	/* kernel pointers held outside of any lock */
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -235,6 +270,12 @@ struct binder_node {
 	struct list_head async_todo;
 };
 
+/* sched_policy plus rt_priority for RT policies, nice value otherwise */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
 struct binder_ref_death {
 	struct binder_work work;
 	void __user *cookie;
@@ -274,6 +315,12 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/* One per page of the mapping, page_ptr is set while it is mapped */
+struct binder_lru_page {
+	struct list_head lru;	/* on proc->free_pages if no buffer uses it */
+	struct page *page_ptr;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -282,6 +329,9 @@ enum binder_deferred_state {
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	spinlock_t inner_lock;
+	struct mutex outer_lock;
+	struct mutex alloc_lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -301,7 +351,12 @@ struct binder_proc {
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
+	struct list_head free_pages;
+	int free_pages_count;
+	unsigned long page_pool_hits;
+	unsigned long page_pool_misses;
+	unsigned long pages_reclaimed;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -312,7 +367,7 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	struct binder_priority default_priority;
 	struct dentry *debugfs_entry;
 };
 
@@ -354,11 +409,16 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	send_ts;
+	ktime_t	dequeue_ts;
 };
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
@@ -516,6 +576,80 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static int binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static struct binder_priority binder_get_priority(struct task_struct *task)
+{
+	struct binder_priority p;
+
+	p.sched_policy = task->policy;
+	if (binder_is_rt_policy(p.sched_policy))
+		p.prio = task->rt_priority;
+	else
+		p.prio = task_nice(task);
+	return p;
+}
+
+/*
+ * Switches current to @desired, scheduling class included, so an RT
+ * caller's transaction is not serviced at a normal thread's priority.
+ * Only binder itself decides this, hence the unchecked setscheduler.
+ */
+static void binder_set_priority(struct binder_priority desired)
+{
+	struct binder_priority cur = binder_get_priority(current);
+	struct sched_param param;
+
+	if (cur.sched_policy == desired.sched_policy && cur.prio == desired.prio)
+		return;
+
+	trace_binder_set_priority(current->tgid, current->pid,
+				  cur.sched_policy, cur.prio,
+				  desired.sched_policy, desired.prio);
+
+	if (binder_is_rt_policy(desired.sched_policy)) {
+		param.sched_priority = desired.prio;
+		sched_setscheduler_nocheck(current, desired.sched_policy,
+					   &param);
+		return;
+	}
+	if (cur.sched_policy != desired.sched_policy) {
+		param.sched_priority = 0;
+		sched_setscheduler_nocheck(current, desired.sched_policy,
+					   &param);
+	}
+	binder_set_nice(desired.prio);
+}
+
+/*
+ * Log2 histograms of transaction latency in microseconds: bucket 0 is
+ * below 1us, bucket i covers [2^(i-1), 2^i) and the last one the rest.
+ */
+#define BINDER_LATENCY_BUCKETS	24
+
+enum binder_latency_type {
+	BINDER_LATENCY_QUEUE,	/* send to dequeue by the target thread */
+	BINDER_LATENCY_SERVICE,	/* dequeue to reply */
+	BINDER_LATENCY_TOTAL,	/* send to reply */
+	BINDER_LATENCY_COUNT
+};
+
+static atomic_t binder_latency[BINDER_LATENCY_COUNT][BINDER_LATENCY_BUCKETS];
+
+static void binder_latency_add(enum binder_latency_type type,
+			       ktime_t start, ktime_t end)
+{
+	s64 us = ktime_us_delta(end, start);
+	int bucket = us > 0 ? fls64(us) : 0;
+
+	if (bucket >= BINDER_LATENCY_BUCKETS)
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+	atomic_inc(&binder_latency[type][bucket]);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -608,6 +742,82 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static void binder_pool_page(struct binder_proc *proc,
+			     struct binder_lru_page *page)
+{
+	list_add_tail(&page->lru, &proc->free_pages);
+	proc->free_pages_count++;
+	atomic_inc(&binder_free_pages);
+}
+
+static void binder_unpool_page(struct binder_proc *proc,
+			       struct binder_lru_page *page)
+{
+	list_del_init(&page->lru);
+	proc->free_pages_count--;
+	atomic_dec(&binder_free_pages);
+}
+
+/*
+ * Unmaps and frees up to @nr pages of the pool, least recently freed
+ * first. Called with proc->alloc_lock held; with @trylock set, gives up
+ * instead of waiting for mmap_sem. Returns the number of pages freed.
+ */
+static int binder_shrink_free_pages(struct binder_proc *proc, int nr,
+				    int trylock)
+{
+	struct binder_lru_page *page;
+	struct vm_area_struct *vma = NULL;
+	struct mm_struct *mm;
+	void *page_addr;
+	int freed = 0;
+
+	if (list_empty(&proc->free_pages))
+		return 0;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		if (!trylock)
+			down_write(&mm->mmap_sem);
+		else if (!down_write_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			return 0;
+		}
+		vma = proc->vma;
+		if (vma && mm != proc->vma_vm_mm)
+			vma = NULL;
+	}
+
+	while (freed < nr && !list_empty(&proc->free_pages)) {
+		page = list_first_entry(&proc->free_pages,
+					struct binder_lru_page, lru);
+		page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+		if (vma)
+			zap_page_range(vma, (uintptr_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(page->page_ptr);
+		page->page_ptr = NULL;
+		binder_unpool_page(proc, page);
+		freed++;
+	}
+
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: unmapped %d pool pages\n", proc->pid, freed);
+	return freed;
+}
+
+/*
+ * Pages that no buffer uses any more are not unmapped right away but
+ * kept, still mapped, on proc->free_pages. Allocations take them back
+ * from there without touching mmap_sem; binder_shrink_free_pages()
+ * unmaps whatever exceeds binder_page_pool_size, and the shrinker the
+ * rest under memory pressure.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -615,8 +825,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *page;
+	struct mm_struct *mm = NULL;
+	int mapped = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -625,9 +836,18 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
+	if (allocate == 0)
+		goto free_range;
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (!page->page_ptr)
+			break;
+	}
+	if (page_addr >= end)
+		goto claim_range; /* all pooled, nothing to map */
+
+	if (!vma)
 		mm = get_task_mm(proc->tsk);
 
 	if (mm) {
@@ -640,9 +860,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
 			     "binder: %d: binder_alloc_buf failed to "
@@ -655,9 +872,10 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr)
+			continue;
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
 				     "binder: %d: binder_alloc_buf failed "
 				     "for page at %p\n", proc->pid, page_addr);
@@ -665,7 +883,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -676,7 +894,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
 				     "binder: %d: binder_alloc_buf failed "
@@ -685,27 +903,52 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
+		mapped++;
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
+
+claim_range:
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		BUG_ON(!page->page_ptr);
+		if (!list_empty(&page->lru)) {
+			binder_unpool_page(proc, page);
+			proc->page_pool_hits++;
+		}
+	}
+	proc->page_pool_misses += mapped;
 	return 0;
 
 free_range:
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		binder_pool_page(proc, page);
+	}
+	if (proc->free_pages_count > binder_page_pool_size)
+		binder_shrink_free_pages(proc, proc->free_pages_count -
+					 binder_page_pool_size, 0);
+	return 0;
+
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
+	/* undo the pages mapped by this call, pooled ones stay put */
+	while ((page_addr -= PAGE_SIZE) >= start) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (!list_empty(&page->lru))
+			continue;
+		zap_page_range(vma, (uintptr_t)page_addr +
+			proc->user_buffer_offset, PAGE_SIZE, NULL);
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(page->page_ptr);
+		page->page_ptr = NULL;
 	}
 err_no_vma:
 	if (mm) {
@@ -715,9 +958,10 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+						     size_t data_size,
+						     size_t offsets_size,
+						     int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -823,6 +1067,19 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 is_async);
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -880,8 +1137,8 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void binder_free_buf_locked(struct binder_proc *proc,
+				   struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
@@ -935,12 +1192,57 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	binder_free_buf_locked(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
+/*
+ * Locks @node and, while it is alive, the inner lock of the process that
+ * owns it. node->proc only changes with binder_procs_lock held for
+ * writing, so it is stable here.
+ */
+static void binder_node_inner_lock(struct binder_node *node)
+{
+	spin_lock(&node->lock);
+	if (node->proc)
+		spin_lock(&node->proc->inner_lock);
+}
+
+static void binder_node_inner_unlock(struct binder_node *node)
+{
+	if (node->proc)
+		spin_unlock(&node->proc->inner_lock);
+	spin_unlock(&node->lock);
+}
+
+static void binder_free_node(struct binder_node *node)
+{
+	/*
+	 * Whoever dropped the last reference may still be on its way out
+	 * of node->lock; wait for it before the memory goes away.
+	 */
+	spin_lock(&node->lock);
+	spin_unlock(&node->lock);
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+/*
+ * Looks up the node for @ptr. The node is returned with a temporary
+ * reference that must be dropped with binder_put_node().
+ */
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
-	struct rb_node *n = proc->nodes.rb_node;
+	struct rb_node *n;
 	struct binder_node *node;
 
+	spin_lock(&proc->inner_lock);
+	n = proc->nodes.rb_node;
 	while (n) {
 		node = rb_entry(n, struct binder_node, rb_node);
 
@@ -948,20 +1250,35 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 			n = n->rb_left;
 		else if (ptr > node->ptr)
 			n = n->rb_right;
-		else
+		else {
+			node->tmp_refs++;
+			spin_unlock(&proc->inner_lock);
 			return node;
+		}
 	}
+	spin_unlock(&proc->inner_lock);
 	return NULL;
 }
 
+/*
+ * Like binder_get_node(), but creates the node if @proc does not have one
+ * for @ptr yet. @flags (FLAT_BINDER_FLAG_*) only apply to a new node.
+ */
 static struct binder_node *binder_new_node(struct binder_proc *proc,
 					   void __user *ptr,
-					   void __user *cookie)
+					   void __user *cookie,
+					   unsigned long flags)
 {
-	struct rb_node **p = &proc->nodes.rb_node;
+	struct rb_node **p;
 	struct rb_node *parent = NULL;
-	struct binder_node *node;
+	struct binder_node *node, *new_node;
 
+	new_node = kzalloc(sizeof(*node), GFP_KERNEL);
+	if (new_node == NULL)
+		return NULL;
+
+	spin_lock(&proc->inner_lock);
+	p = &proc->nodes.rb_node;
 	while (*p) {
 		parent = *p;
 		node = rb_entry(parent, struct binder_node, rb_node);
@@ -970,23 +1287,32 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 			p = &(*p)->rb_left;
 		else if (ptr > node->ptr)
 			p = &(*p)->rb_right;
-		else
-			return NULL;
+		else {
+			/* another thread of @proc got here first */
+			node->tmp_refs++;
+			spin_unlock(&proc->inner_lock);
+			kfree(new_node);
+			return node;
+		}
 	}
 
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (node == NULL)
-		return NULL;
+	node = new_node;
 	binder_stats_created(BINDER_STAT_NODE);
+	spin_lock_init(&node->lock);
+	node->tmp_refs = 1;
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
+	node->min_priority = flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+	node->accept_fds = !!(flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 	node->work.type = BINDER_WORK_NODE;
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
+	spin_unlock(&proc->inner_lock);
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d:%d node %d u%p c%p created\n",
 		     proc->pid, current->pid, node->debug_id,
@@ -994,8 +1320,9 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
-static int binder_inc_node(struct binder_node *node, int strong, int internal,
-			   struct list_head *target_list)
+static int binder_inc_node_nilocked(struct binder_node *node, int strong,
+				    int internal,
+				    struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
@@ -1031,8 +1358,30 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 	return 0;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+/*
+ * @target_list, if any, must be a todo list of the process owning @node.
+ */
+static int binder_inc_node(struct binder_node *node, int strong, int internal,
+			   struct list_head *target_list)
+{
+	int ret;
+
+	binder_node_inner_lock(node);
+	ret = binder_inc_node_nilocked(node, strong, internal, target_list);
+	binder_node_inner_unlock(node);
+	return ret;
+}
+
+/*
+ * Returns 1 if the last reference is gone and the node has been unlinked,
+ * in which case the caller frees it with binder_free_node() after
+ * dropping the locks.
+ */
+static int binder_dec_node_nilocked(struct binder_node *node, int strong,
+				    int internal)
 {
+	struct binder_proc *proc = node->proc;
+
 	if (strong) {
 		if (internal)
 			node->internal_strong_refs--;
@@ -1043,38 +1392,75 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 	} else {
 		if (!internal)
 			node->local_weak_refs--;
-		if (node->local_weak_refs || !hlist_empty(&node->refs))
+		if (node->local_weak_refs || node->tmp_refs ||
+		    !hlist_empty(&node->refs))
 			return 0;
 	}
-	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+	if (proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
-			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			list_add_tail(&node->work.entry, &proc->todo);
+			wake_up_interruptible(&proc->wait);
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
+		    !node->local_weak_refs && !node->tmp_refs) {
 			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
+			if (proc) {
+				rb_erase(&node->rb_node, &proc->nodes);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: refless node %d deleted\n",
 					     node->debug_id);
 			} else {
+				spin_lock(&binder_dead_nodes_lock);
 				hlist_del(&node->dead_node);
+				spin_unlock(&binder_dead_nodes_lock);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+			return 1;
 		}
 	}
 
 	return 0;
 }
 
+static void binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	int free_node;
+
+	binder_node_inner_lock(node);
+	free_node = binder_dec_node_nilocked(node, strong, internal);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+static void binder_inc_node_tmpref(struct binder_node *node)
+{
+	binder_node_inner_lock(node);
+	node->tmp_refs++;
+	binder_node_inner_unlock(node);
+}
+
+static void binder_put_node(struct binder_node *node)
+{
+	int free_node;
+
+	binder_node_inner_lock(node);
+	BUG_ON(node->tmp_refs <= 0);
+	node->tmp_refs--;
+	/* a weak internal decrement drops nothing, it only rechecks */
+	free_node = binder_dec_node_nilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
 
+/*
+ * The ref functions below are called with proc->outer_lock held, where
+ * proc is the process owning the refs.
+ */
 static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 					 uint32_t desc)
 {
@@ -1117,7 +1503,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1146,7 +1532,9 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
 	if (node) {
+		binder_node_inner_lock(node);
 		hlist_add_head(&new_ref->node_entry, &node->refs);
+		binder_node_inner_unlock(node);
 
 		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 			     "binder: %d new ref %d desc %d for "
@@ -1163,23 +1551,32 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 
 static void binder_delete_ref(struct binder_ref *ref)
 {
+	struct binder_node *node = ref->node;
+	int free_node;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
-		     ref->desc, ref->node->debug_id);
+		     ref->desc, node->debug_id);
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	binder_node_inner_lock(node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		binder_dec_node_nilocked(node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	free_node = binder_dec_node_nilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		spin_lock(&ref->proc->inner_lock);
 		list_del(&ref->death->work.entry);
+		spin_unlock(&ref->proc->inner_lock);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1221,12 +1618,8 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 			return -EINVAL;
 		}
 		ref->strong--;
-		if (ref->strong == 0) {
-			int ret;
-			ret = binder_dec_node(ref->node, strong, 1);
-			if (ret)
-				return ret;
-		}
+		if (ref->strong == 0)
+			binder_dec_node(ref->node, strong, 1);
 	} else {
 		if (ref->weak == 0) {
 			binder_user_error("binder: %d invalid dec weak, "
@@ -1242,19 +1635,50 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
-static void binder_pop_transaction(struct binder_thread *target_thread,
-				   struct binder_transaction *t)
+/*
+ * Looks up the node behind handle @desc of @proc and returns it with a
+ * temporary reference, so that it can be used once proc->outer_lock has
+ * been dropped.
+ */
+static struct binder_node *binder_get_node_from_ref(struct binder_proc *proc,
+						    uint32_t desc)
 {
-	if (target_thread) {
-		BUG_ON(target_thread->transaction_stack != t);
-		BUG_ON(target_thread->transaction_stack->from != target_thread);
-		target_thread->transaction_stack =
-			target_thread->transaction_stack->from_parent;
-		t->from = NULL;
+	struct binder_ref *ref;
+	struct binder_node *node = NULL;
+
+	mutex_lock(&proc->outer_lock);
+	ref = binder_get_ref(proc, desc);
+	if (ref) {
+		node = ref->node;
+		binder_inc_node_tmpref(node);
 	}
+	mutex_unlock(&proc->outer_lock);
+	return node;
+}
+
+/* Called with target_thread->proc->inner_lock held */
+static void binder_pop_transaction_ilocked(struct binder_thread *target_thread,
+					   struct binder_transaction *t)
+{
+	BUG_ON(target_thread->transaction_stack != t);
+	BUG_ON(target_thread->transaction_stack->from != target_thread);
+	target_thread->transaction_stack =
+		target_thread->transaction_stack->from_parent;
+	t->from = NULL;
+}
+
+static void binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *target_proc = t->to_proc;
+
 	t->need_reply = 0;
-	if (t->buffer)
-		t->buffer->transaction = NULL;
+	/* the buffer, if still there, belongs to target_proc */
+	if (target_proc) {
+		spin_lock(&target_proc->inner_lock);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		spin_unlock(&target_proc->inner_lock);
+	}
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
@@ -1267,6 +1691,9 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 	while (1) {
 		target_thread = t->from;
 		if (target_thread) {
+			struct binder_proc *target_proc = target_thread->proc;
+
+			spin_lock(&target_proc->inner_lock);
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
 				target_thread->return_error2 =
@@ -1277,20 +1704,24 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 					     "binder: send failed reply for "
 					     "transaction %d to %d:%d\n",
-					      t->debug_id, target_thread->proc->pid,
+					      t->debug_id, target_proc->pid,
 					      target_thread->pid);
 
-				binder_pop_transaction(target_thread, t);
+				binder_pop_transaction_ilocked(target_thread,
+							       t);
 				target_thread->return_error = error_code;
 				wake_up_interruptible(&target_thread->wait);
+				spin_unlock(&target_proc->inner_lock);
+				binder_free_transaction(t);
 			} else {
 				binder_debug(BINDER_DEBUG_TOP_ERRORS,
 					     "binder: reply failed, target "
 					     "thread, %d:%d, has error code %d "
 					     "already\n",
-					     target_thread->proc->pid,
+					     target_proc->pid,
 					     target_thread->pid,
 					     target_thread->return_error);
+				spin_unlock(&target_proc->inner_lock);
 			}
 			return;
 		} else {
@@ -1301,7 +1732,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				     "for transaction %d, target dead\n",
 				     t->debug_id);
 
-			binder_pop_transaction(target_thread, t);
+			binder_free_transaction(t);
 			if (next == NULL) {
 				binder_debug(BINDER_DEBUG_DEAD_BINDER,
 					     "binder: reply failed,"
@@ -1363,11 +1794,16 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        node %d u%p\n",
 				     node->debug_id, node->ptr);
 			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+
+			mutex_lock(&proc->outer_lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_debug(BINDER_DEBUG_TOP_ERRORS,
 					     "binder: transaction release %d"
 					     " bad handle %ld\n", debug_id,
@@ -1378,6 +1814,7 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        ref %d desc %d (node %d)\n",
 				     ref->debug_id, ref->desc, ref->node->debug_id);
 			binder_dec_ref(ref, fp->type == BINDER_TYPE_HANDLE);
+			mutex_unlock(&proc->outer_lock);
 		} break;
 
 		case BINDER_TYPE_FD:
@@ -1421,15 +1858,16 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		spin_lock(&proc->inner_lock);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			spin_unlock(&proc->inner_lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1439,16 +1877,21 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			spin_unlock(&proc->inner_lock);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
+		spin_unlock(&proc->inner_lock);
+		binder_set_priority(in_reply_to->saved_priority);
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		target_proc = target_thread->proc;
+		spin_lock(&target_proc->inner_lock);
 		if (target_thread->transaction_stack != in_reply_to) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad target transaction stack %d, "
@@ -1457,30 +1900,35 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			spin_unlock(&target_proc->inner_lock);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
-		target_proc = target_thread->proc;
+		spin_unlock(&target_proc->inner_lock);
 	} else {
+		/*
+		 * Hold on to target_node until the transaction is queued:
+		 * our ref to it can be dropped by another thread meanwhile.
+		 */
 		if (tr->target.handle) {
-			struct binder_ref *ref;
-			ref = binder_get_ref(proc, tr->target.handle);
-			if (ref == NULL) {
+			target_node = binder_get_node_from_ref(proc,
+							tr->target.handle);
+			if (target_node == NULL) {
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
 				return_error = BR_FAILED_REPLY;
 				goto err_invalid_target_handle;
 			}
-			target_node = ref->node;
 		} else {
 			target_node = binder_context_mgr_node;
 			if (target_node == NULL) {
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
+			binder_inc_node_tmpref(target_node);
 		}
 		e->to_node = target_node->debug_id;
 		target_proc = target_node->proc;
@@ -1488,10 +1936,12 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
-		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
+		if (!(tr->flags & TF_ONE_WAY)) {
 			struct binder_transaction *tmp;
+
+			spin_lock(&proc->inner_lock);
 			tmp = thread->transaction_stack;
-			if (tmp->to_thread != thread) {
+			if (tmp && tmp->to_thread != thread) {
 				binder_user_error("binder: %d:%d got new "
 					"transaction with bad transaction stack"
 					", transaction %d has target %d:%d\n",
@@ -1499,6 +1949,7 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				spin_unlock(&proc->inner_lock);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
@@ -1507,6 +1958,7 @@ static void binder_transaction(struct binder_proc *proc,
 					target_thread = tmp->from;
 				tmp = tmp->from_parent;
 			}
+			spin_unlock(&proc->inner_lock);
 		}
 	}
 	if (target_thread) {
@@ -1534,7 +1986,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1563,7 +2015,8 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_get_priority(current);
+	t->send_ts = ktime_get();
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
@@ -1617,13 +2070,12 @@ static void binder_transaction(struct binder_proc *proc,
 			struct binder_ref *ref;
 			struct binder_node *node = binder_get_node(proc, fp->binder);
 			if (node == NULL) {
-				node = binder_new_node(proc, fp->binder, fp->cookie);
+				node = binder_new_node(proc, fp->binder,
+						       fp->cookie, fp->flags);
 				if (node == NULL) {
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
-				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1631,10 +2083,14 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				binder_put_node(node);
 				goto err_binder_get_ref_for_node_failed;
 			}
+			mutex_lock(&target_proc->outer_lock);
 			ref = binder_get_ref_for_node(target_proc, node);
 			if (ref == NULL) {
+				mutex_unlock(&target_proc->outer_lock);
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1650,11 +2106,18 @@ static void binder_transaction(struct binder_proc *proc,
 				     "        node %d u%p -> ref %d desc %d\n",
 				     node->debug_id, node->ptr, ref->debug_id,
 				     ref->desc);
+			mutex_unlock(&target_proc->outer_lock);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+			struct binder_node *node;
+
+			mutex_lock(&proc->outer_lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction with invalid "
 					"handle, %ld\n", proc->pid,
@@ -1662,31 +2125,44 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_failed;
 			}
-			if (ref->node->proc == target_proc) {
+			node = ref->node;
+			if (node->proc == target_proc) {
 				if (fp->type == BINDER_TYPE_HANDLE)
 					fp->type = BINDER_TYPE_BINDER;
 				else
 					fp->type = BINDER_TYPE_WEAK_BINDER;
-				fp->binder = ref->node->ptr;
-				fp->cookie = ref->node->cookie;
-				binder_inc_node(ref->node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				fp->binder = node->ptr;
+				fp->cookie = node->cookie;
+				binder_inc_node(node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
 					     "        ref %d desc %d -> node %d u%p\n",
-					     ref->debug_id, ref->desc, ref->node->debug_id,
-					     ref->node->ptr);
+					     ref->debug_id, ref->desc, node->debug_id,
+					     node->ptr);
+				mutex_unlock(&proc->outer_lock);
 			} else {
 				struct binder_ref *new_ref;
-				new_ref = binder_get_ref_for_node(target_proc, ref->node);
+				int src_debug_id = ref->debug_id;
+
+				/* never hold two outer locks at once */
+				binder_inc_node_tmpref(node);
+				mutex_unlock(&proc->outer_lock);
+
+				mutex_lock(&target_proc->outer_lock);
+				new_ref = binder_get_ref_for_node(target_proc, node);
 				if (new_ref == NULL) {
+					mutex_unlock(&target_proc->outer_lock);
+					binder_put_node(node);
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_get_ref_for_node_failed;
 				}
+				binder_debug(BINDER_DEBUG_TRANSACTION,
+					     "        ref %d desc %ld -> ref %d desc %d (node %d)\n",
+					     src_debug_id, fp->handle, new_ref->debug_id,
+					     new_ref->desc, node->debug_id);
 				fp->handle = new_ref->desc;
 				binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
-				binder_debug(BINDER_DEBUG_TRANSACTION,
-					     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
-					     ref->debug_id, ref->desc, new_ref->debug_id,
-					     new_ref->desc, ref->node->debug_id);
+				mutex_unlock(&target_proc->outer_lock);
+				binder_put_node(node);
 			}
 		} break;
 
@@ -1736,29 +2212,60 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	trace_binder_transaction(reply, t, target_node);
+	t->work.type = BINDER_WORK_TRANSACTION;
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
+		trace_binder_transaction_replied(in_reply_to, t->send_ts);
+		binder_latency_add(BINDER_LATENCY_SERVICE,
+				   in_reply_to->dequeue_ts, t->send_ts);
+		binder_latency_add(BINDER_LATENCY_TOTAL,
+				   in_reply_to->send_ts, t->send_ts);
+		spin_lock(&proc->inner_lock);
+		list_add_tail(&tcomplete->entry, &thread->todo);
+		spin_unlock(&proc->inner_lock);
+
+		spin_lock(&target_proc->inner_lock);
+		binder_pop_transaction_ilocked(target_thread, in_reply_to);
+		list_add_tail(&t->work.entry, target_list);
+		wake_up_interruptible(target_wait);
+		spin_unlock(&target_proc->inner_lock);
+		binder_free_transaction(in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		t->need_reply = 1;
+		/* push before queueing, the reply may come back right away */
+		spin_lock(&proc->inner_lock);
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
+		list_add_tail(&tcomplete->entry, &thread->todo);
+		spin_unlock(&proc->inner_lock);
+
+		spin_lock(&target_proc->inner_lock);
+		list_add_tail(&t->work.entry, target_list);
+		wake_up_interruptible(target_wait);
+		spin_unlock(&target_proc->inner_lock);
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
+		spin_lock(&proc->inner_lock);
+		list_add_tail(&tcomplete->entry, &thread->todo);
+		spin_unlock(&proc->inner_lock);
+
+		binder_node_inner_lock(target_node);
 		if (target_node->has_async_transaction) {
 			target_list = &target_node->async_todo;
 			target_wait = NULL;
 		} else
 			target_node->has_async_transaction = 1;
+		list_add_tail(&t->work.entry, target_list);
+		if (target_wait)
+			wake_up_interruptible(target_wait);
+		binder_node_inner_unlock(target_node);
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
-		wake_up_interruptible(target_wait);
+	if (target_node)
+		binder_put_node(target_node);
 	return;
 
 err_get_unused_fd_failed:
@@ -1785,6 +2292,8 @@ err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
 err_no_context_mgr_node:
+	if (target_node)
+		binder_put_node(target_node);
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1796,12 +2305,16 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
+	spin_lock(&proc->inner_lock);
 	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
 		thread->return_error = BR_TRANSACTION_COMPLETE;
+		spin_unlock(&proc->inner_lock);
 		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	} else {
 		thread->return_error = return_error;
+		spin_unlock(&proc->inner_lock);
+	}
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1816,9 +2329,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1832,11 +2345,12 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			mutex_lock(&proc->outer_lock);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
 					       binder_context_mgr_node);
-				if (ref->desc != target) {
+				if (ref && ref->desc != target) {
 					binder_user_error("binder: %d:"
 						"%d tried to acquire "
 						"reference to desc 0, "
@@ -1847,6 +2361,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			} else
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1875,6 +2390,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				     proc->pid, thread->pid, debug_string, ref->debug_id,
 				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			mutex_unlock(&proc->outer_lock);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1908,8 +2424,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				binder_put_node(node);
 				break;
 			}
+			binder_node_inner_lock(node);
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
 					binder_user_error("binder: %d:%d "
@@ -1917,6 +2435,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1927,16 +2447,21 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			/* our temporary reference keeps the node around */
+			binder_dec_node_nilocked(node, cmd == BC_ACQUIRE_DONE, 0);
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s node %d ls %d lw %d\n",
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			binder_node_inner_unlock(node);
+			binder_put_node(node);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1956,20 +2481,28 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* claim it, a racing BC_FREE_BUFFER must not match */
+			buffer->allow_user_free = 0;
+			mutex_unlock(&proc->alloc_lock);
+
+			spin_lock(&proc->inner_lock);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1979,12 +2512,17 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				buffer->transaction->buffer = NULL;
 				buffer->transaction = NULL;
 			}
+			spin_unlock(&proc->inner_lock);
 			if (buffer->async_transaction && buffer->target_node) {
-				BUG_ON(!buffer->target_node->has_async_transaction);
-				if (list_empty(&buffer->target_node->async_todo))
-					buffer->target_node->has_async_transaction = 0;
+				struct binder_node *node = buffer->target_node;
+
+				binder_node_inner_lock(node);
+				BUG_ON(!node->has_async_transaction);
+				if (list_empty(&node->async_todo))
+					node->has_async_transaction = 0;
 				else
-					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+					list_move_tail(node->async_todo.next, &thread->todo);
+				binder_node_inner_unlock(node);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
@@ -2006,6 +2544,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2023,11 +2562,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2036,12 +2577,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_EXIT_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			spin_unlock(&proc->inner_lock);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -2057,8 +2601,29 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			/*
+			 * Allocate up front, the refs tree can not be
+			 * touched again until outer_lock is dropped.
+			 */
+			death = NULL;
+			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
+				death = kzalloc(sizeof(*death), GFP_KERNEL);
+				if (death == NULL) {
+					spin_lock(&proc->inner_lock);
+					thread->return_error = BR_ERROR;
+					spin_unlock(&proc->inner_lock);
+					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+						     "binder: %d:%d "
+						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
+						     proc->pid, thread->pid);
+					break;
+				}
+			}
+			mutex_lock(&proc->outer_lock);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
+				kfree(death);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2078,8 +2643,16 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     cookie, ref->debug_id, ref->desc,
 				     ref->strong, ref->weak, ref->node->debug_id);
 
+			/*
+			 * node->lock serializes against the node dying in
+			 * binder_deferred_release, which queues ref->death.
+			 */
+			spin_lock(&ref->node->lock);
 			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
 				if (ref->death) {
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->outer_lock);
+					kfree(death);
 					binder_user_error("binder: %d:%"
 						"d BC_REQUEST_DEATH_NOTI"
 						"FICATION death notific"
@@ -2087,30 +2660,25 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						proc->pid, thread->pid);
 					break;
 				}
-				death = kzalloc(sizeof(*death), GFP_KERNEL);
-				if (death == NULL) {
-					thread->return_error = BR_ERROR;
-					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-						     "binder: %d:%d "
-						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
-						     proc->pid, thread->pid);
-					break;
-				}
 				binder_stats_created(BINDER_STAT_DEATH);
 				INIT_LIST_HEAD(&death->work.entry);
 				death->cookie = cookie;
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					spin_lock(&proc->inner_lock);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
 						wake_up_interruptible(&proc->wait);
 					}
+					spin_unlock(&proc->inner_lock);
 				}
 			} else {
 				if (ref->death == NULL) {
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->outer_lock);
 					binder_user_error("binder: %d:%"
 						"d BC_CLEAR_DEATH_NOTIFI"
 						"CATION death notificat"
@@ -2120,6 +2688,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				}
 				death = ref->death;
 				if (death->cookie != cookie) {
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->outer_lock);
 					binder_user_error("binder: %d:%"
 						"d BC_CLEAR_DEATH_NOTIFI"
 						"CATION death notificat"
@@ -2130,6 +2700,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					break;
 				}
 				ref->death = NULL;
+				spin_lock(&proc->inner_lock);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
@@ -2142,7 +2713,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				spin_unlock(&proc->inner_lock);
 			}
+			spin_unlock(&ref->node->lock);
+			mutex_unlock(&proc->outer_lock);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2152,6 +2726,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			spin_lock(&proc->inner_lock);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2163,6 +2738,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				spin_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2179,6 +2755,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			spin_unlock(&proc->inner_lock);
 		} break;
 
 		default:
@@ -2196,12 +2773,50 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
+	}
+}
+
+/*
+ * Picks the priority current services @t at. Synchronous calls inherit
+ * the caller's priority, RT policy included, but never drop below the
+ * node's min_priority; oneway calls only get min_priority.
+ */
+static void binder_transaction_priority(struct binder_transaction *t,
+					struct binder_node *node)
+{
+	struct binder_priority desired;
+	struct binder_priority cur = t->saved_priority;
+	int oneway = t->flags & TF_ONE_WAY;
+
+	if (!oneway && binder_is_rt_policy(t->priority.sched_policy)) {
+		/* a thread already above the caller keeps its priority */
+		if (binder_is_rt_policy(cur.sched_policy) &&
+		    cur.prio >= t->priority.prio)
+			return;
+		binder_set_priority(t->priority);
+		return;
 	}
+	if (binder_is_rt_policy(cur.sched_policy))
+		return;
+
+	desired.sched_policy = cur.sched_policy;
+	if (!oneway && t->priority.prio < node->min_priority)
+		desired.prio = t->priority.prio;
+	else if (!oneway || cur.prio > node->min_priority)
+		desired.prio = node->min_priority;
+	else
+		return;
+	binder_set_priority(desired);
 }
 
+/*
+ * The two checks below are used as wait conditions without the inner
+ * lock; whoever queues work wakes us after dropping it, and the todo
+ * lists are looked at again under the lock before anything is taken.
+ */
 static int binder_has_proc_work(struct binder_proc *proc,
 				struct binder_thread *thread)
 {
@@ -2225,6 +2840,7 @@ static int binder_thread_read(struct binder_proc *proc,
 
 	int ret = 0;
 	int wait_for_proc_work;
+	uint32_t return_error, return_error2;
 
 	if (*consumed == 0) {
 		if (put_user(BR_NOOP, (uint32_t __user *)ptr))
@@ -2233,22 +2849,31 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
-		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+		return_error = thread->return_error;
+		return_error2 = thread->return_error2;
+		thread->return_error2 = BR_OK;
+		/* return_error stays pending if return_error2 fills the buffer */
+		if (return_error2 == BR_OK || ptr + sizeof(uint32_t) < end)
+			thread->return_error = BR_OK;
+		else
+			return_error = BR_OK;
+		spin_unlock(&proc->inner_lock);
+
+		if (return_error2 != BR_OK) {
+			if (put_user(return_error2, (uint32_t __user *)ptr))
+				return -EFAULT;
+			ptr += sizeof(uint32_t);
+		}
+		if (return_error != BR_OK) {
+			if (put_user(return_error, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (ptr == end)
-				goto done;
-			thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
 		goto done;
 	}
 
@@ -2256,7 +2881,9 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
+	/* let a dying peer get at binder_procs_lock while we sleep */
+	up_read(&binder_procs_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2267,7 +2894,7 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_set_priority(proc->default_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2280,10 +2907,12 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	down_read(&binder_procs_lock);
+	spin_lock(&proc->inner_lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	spin_unlock(&proc->inner_lock);
 
 	if (ret)
 		return ret;
@@ -2292,26 +2921,38 @@ retry:
 		uint32_t cmd;
 		struct binder_transaction_data tr;
 		struct binder_work *w;
+		struct list_head *list;
 		struct binder_transaction *t = NULL;
 
+		spin_lock(&proc->inner_lock);
 		if (!list_empty(&thread->todo))
-			w = list_first_entry(&thread->todo, struct binder_work, entry);
+			list = &thread->todo;
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
-			w = list_first_entry(&proc->todo, struct binder_work, entry);
+			list = &proc->todo;
 		else {
+			spin_unlock(&proc->inner_lock);
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			spin_unlock(&proc->inner_lock);
 			break;
+		}
+		w = list_first_entry(list, struct binder_work, entry);
+		list_del_init(&w->entry);
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
+			spin_unlock(&proc->inner_lock);
 			t = container_of(w, struct binder_transaction, work);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			spin_unlock(&proc->inner_lock);
+			kfree(w);
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
+
 			cmd = BR_TRANSACTION_COMPLETE;
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -2321,17 +2962,17 @@ retry:
 			binder_debug(BINDER_DEBUG_TRANSACTION_COMPLETE,
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
-
-			list_del(&w->entry);
-			kfree(w);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
 			uint32_t cmd = BR_NOOP;
 			const char *cmd_name;
+			void __user *node_ptr = node->ptr;
+			void __user *node_cookie = node->cookie;
+			int node_debug_id = node->debug_id;
 			int strong = node->internal_strong_refs || node->local_strong_refs;
-			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
+			int weak = !hlist_empty(&node->refs) || node->local_weak_refs ||
+				   node->tmp_refs || strong;
 			if (weak && !node->has_weak_ref) {
 				cmd = BR_INCREFS;
 				cmd_name = "BR_INCREFS";
@@ -2354,53 +2995,62 @@ retry:
 				node->has_weak_ref = 0;
 			}
 			if (cmd != BR_NOOP) {
+				/* more transitions may follow, keep it queued */
+				list_add(&w->entry, list);
+				spin_unlock(&proc->inner_lock);
 				if (put_user(cmd, (uint32_t __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
+				if (put_user(node_ptr, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
+				if (put_user(node_cookie, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
 
 				binder_stat_br(proc, thread, cmd);
 				binder_debug(BINDER_DEBUG_USER_REFS,
 					     "binder: %d:%d %s %d u%p c%p\n",
-					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
+					     proc->pid, thread->pid, cmd_name, node_debug_id, node_ptr, node_cookie);
+			} else if (!weak && !strong) {
+				rb_erase(&node->rb_node, &proc->nodes);
+				spin_unlock(&proc->inner_lock);
+				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+					     "binder: %d:%d node %d u%p c%p deleted\n",
+					     proc->pid, thread->pid, node_debug_id,
+					     node_ptr, node_cookie);
+				binder_free_node(node);
 			} else {
-				list_del_init(&w->entry);
-				if (!weak && !strong) {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p deleted\n",
-						     proc->pid, thread->pid, node->debug_id,
-						     node->ptr, node->cookie);
-					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
-					binder_stats_deleted(BINDER_STAT_NODE);
-				} else {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p state unchanged\n",
-						     proc->pid, thread->pid, node->debug_id, node->ptr,
-						     node->cookie);
-				}
+				spin_unlock(&proc->inner_lock);
+				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+					     "binder: %d:%d node %d u%p c%p state unchanged\n",
+					     proc->pid, thread->pid, node_debug_id, node_ptr,
+					     node_cookie);
 			}
 		} break;
 		case BINDER_WORK_DEAD_BINDER:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
+			void __user *cookie;
 			uint32_t cmd;
 
 			death = container_of(w, struct binder_ref_death, work);
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
+			cookie = death->cookie;
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
-			else
+				spin_unlock(&proc->inner_lock);
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			} else {
 				cmd = BR_DEAD_BINDER;
+				list_add_tail(&w->entry, &proc->delivered_death);
+				spin_unlock(&proc->inner_lock);
+			}
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
@@ -2409,17 +3059,14 @@ retry:
 				      cmd == BR_DEAD_BINDER ?
 				      "BR_DEAD_BINDER" :
 				      "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				      death->cookie);
+				      cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
+		default:
+			spin_unlock(&proc->inner_lock);
+			break;
 		}
 
 		if (!t)
@@ -2430,13 +3077,8 @@ retry:
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			t->saved_priority = binder_get_priority(current);
+			binder_transaction_priority(t, target_node);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2463,13 +3105,25 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
+		if (put_user(cmd, (uint32_t __user *)ptr) ||
+		    copy_to_user(ptr + sizeof(uint32_t), &tr, sizeof(tr))) {
+			/* leave it for the next read, as if never taken */
+			if (cmd == BR_TRANSACTION)
+				binder_set_priority(t->saved_priority);
+			spin_lock(&proc->inner_lock);
+			list_add(&t->work.entry, list);
+			spin_unlock(&proc->inner_lock);
 			return -EFAULT;
+		}
 		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
 		ptr += sizeof(tr);
 
+		/* Delivered: account the time it spent queued */
+		t->dequeue_ts = ktime_get();
+		trace_binder_transaction_received(t);
+		binder_latency_add(BINDER_LATENCY_QUEUE, t->send_ts,
+				   t->dequeue_ts);
+
 		binder_stat_br(proc, thread, cmd);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
@@ -2482,14 +3136,16 @@ retry:
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
+		spin_lock(&proc->inner_lock);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
+			spin_unlock(&proc->inner_lock);
 		} else {
 			t->buffer->transaction = NULL;
+			spin_unlock(&proc->inner_lock);
 			kfree(t);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION);
 		}
@@ -2499,18 +3155,21 @@ retry:
 done:
 
 	*consumed = ptr - buffer;
+	spin_lock(&proc->inner_lock);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		spin_unlock(&proc->inner_lock);
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
-	}
+	} else
+		spin_unlock(&proc->inner_lock);
 	return 0;
 }
 
@@ -2539,7 +3198,8 @@ static void binder_release_work(struct list_head *list)
 
 }
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+static struct binder_thread *binder_get_thread_ilocked(
+		struct binder_proc *proc, struct binder_thread *new_thread)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
@@ -2554,26 +3214,47 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		else if (current->pid > thread->pid)
 			p = &(*p)->rb_right;
 		else
-			break;
-	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
-		binder_stats_created(BINDER_STAT_THREAD);
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
+			return thread;
 	}
+	if (!new_thread)
+		return NULL;
+	thread = new_thread;
+	binder_stats_created(BINDER_STAT_THREAD);
+	thread->proc = proc;
+	thread->pid = current->pid;
+	init_waitqueue_head(&thread->wait);
+	INIT_LIST_HEAD(&thread->todo);
+	rb_link_node(&thread->rb_node, parent, p);
+	rb_insert_color(&thread->rb_node, &proc->threads);
+	thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	thread->return_error = BR_OK;
+	thread->return_error2 = BR_OK;
+	return thread;
+}
+
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *new_thread;
+
+	spin_lock(&proc->inner_lock);
+	thread = binder_get_thread_ilocked(proc, NULL);
+	spin_unlock(&proc->inner_lock);
+	if (thread)
+		return thread;
+
+	new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+	if (new_thread == NULL)
+		return NULL;
+	spin_lock(&proc->inner_lock);
+	thread = binder_get_thread_ilocked(proc, new_thread);
+	spin_unlock(&proc->inner_lock);
+	if (thread != new_thread)
+		kfree(new_thread);
 	return thread;
 }
 
+/* Called with binder_procs_lock held for writing */
 static int binder_free_thread(struct binder_proc *proc,
 			      struct binder_thread *thread)
 {
@@ -2622,12 +3303,18 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_procs_lock);
 	thread = binder_get_thread(proc);
+	if (thread == NULL) {
+		up_read(&binder_procs_lock);
+		return POLLERR;
+	}
 
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
+	up_read(&binder_procs_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2652,6 +3339,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	struct binder_thread *thread;
 	unsigned int size = _IOC_SIZE(cmd);
 	void __user *ubuf = (void __user *)arg;
+	int exclusive;
 
 	/*printk(KERN_INFO "binder_ioctl: %d:%d %x %lx\n", proc->pid, current->pid, cmd, arg);*/
 
@@ -2659,7 +3347,12 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	/* these two change what other ioctls rely on being stable */
+	exclusive = cmd == BINDER_THREAD_EXIT || cmd == BINDER_SET_CONTEXT_MGR;
+	if (exclusive)
+		down_write(&binder_procs_lock);
+	else
+		down_read(&binder_procs_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2693,8 +3386,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		if (bwr.read_size > 0) {
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
+			spin_lock(&proc->inner_lock);
 			if (!list_empty(&proc->todo))
 				wake_up_interruptible(&proc->wait);
+			spin_unlock(&proc->inner_lock);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2711,12 +3406,18 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		spin_lock(&proc->inner_lock);
+		proc->max_threads = max_threads;
+		spin_unlock(&proc->inner_lock);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
 		if (binder_context_mgr_node != NULL) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -2736,15 +3437,18 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			}
 		} else
 			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
+		binder_context_mgr_node = binder_new_node(proc, NULL, NULL, 0);
 		if (binder_context_mgr_node == NULL) {
 			ret = -ENOMEM;
 			goto err;
 		}
+		binder_node_inner_lock(binder_context_mgr_node);
 		binder_context_mgr_node->local_weak_refs++;
 		binder_context_mgr_node->local_strong_refs++;
 		binder_context_mgr_node->has_strong_ref = 1;
 		binder_context_mgr_node->has_weak_ref = 1;
+		binder_node_inner_unlock(binder_context_mgr_node);
+		binder_put_node(binder_context_mgr_node);
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
@@ -2768,9 +3472,15 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		spin_lock(&proc->inner_lock);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		spin_unlock(&proc->inner_lock);
+	}
+	if (exclusive)
+		up_write(&binder_procs_lock);
+	else
+		up_read(&binder_procs_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -2814,6 +3524,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2863,6 +3574,8 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		failure_string = "alloc page array";
 		goto err_alloc_pages_failed;
 	}
+	for (i = 0; i < (vma->vm_end - vma->vm_start) / PAGE_SIZE; i++)
+		INIT_LIST_HEAD(&proc->pages[i].lru);
 	proc->buffer_size = vma->vm_end - vma->vm_start;
 
 	vma->vm_ops = &binder_vm_ops;
@@ -2920,14 +3633,18 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
+	spin_lock_init(&proc->inner_lock);
+	mutex_init(&proc->outer_lock);
+	mutex_init(&proc->alloc_lock);
+	proc->default_priority = binder_get_priority(current);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
+	INIT_LIST_HEAD(&proc->free_pages);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	down_write(&binder_procs_lock);
+	binder_stats_created(BINDER_STAT_PROC);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	up_write(&binder_procs_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2952,6 +3669,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2960,6 +3679,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	spin_unlock(&proc->inner_lock);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -2976,6 +3696,11 @@ static int binder_release(struct inode *nodp, struct file *filp)
 	return 0;
 }
 
+/*
+ * Called with binder_procs_lock held for writing, so no ioctl is in
+ * flight anywhere. The per-object locks are still taken where objects
+ * of other procs are touched, for the sake of the lock rules above.
+ */
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
@@ -3009,9 +3734,10 @@ static void binder_deferred_release(struct binder_proc *proc)
 		nodes++;
 		rb_erase(&node->rb_node, &proc->nodes);
 		list_del_init(&node->work.entry);
+		spin_lock(&node->lock);
 		if (hlist_empty(&node->refs)) {
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+			spin_unlock(&node->lock);
+			binder_free_node(node);
 		} else {
 			struct binder_ref *ref;
 			int death = 0;
@@ -3019,20 +3745,25 @@ static void binder_deferred_release(struct binder_proc *proc)
 			node->proc = NULL;
 			node->local_strong_refs = 0;
 			node->local_weak_refs = 0;
+			spin_lock(&binder_dead_nodes_lock);
 			hlist_add_head(&node->dead_node, &binder_dead_nodes);
+			spin_unlock(&binder_dead_nodes_lock);
 
 			hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
 				incoming_refs++;
 				if (ref->death) {
 					death++;
+					spin_lock(&ref->proc->inner_lock);
 					if (list_empty(&ref->death->work.entry)) {
 						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
 						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
 						wake_up_interruptible(&ref->proc->wait);
 					} else
 						BUG();
+					spin_unlock(&ref->proc->inner_lock);
 				}
 			}
+			spin_unlock(&node->lock);
 			binder_debug(BINDER_DEBUG_DEAD_BINDER,
 				     "binder: node %d now dead, "
 				     "refs %d, death %d\n", node->debug_id,
@@ -3040,12 +3771,14 @@ static void binder_deferred_release(struct binder_proc *proc)
 		}
 	}
 	outgoing_refs = 0;
+	mutex_lock(&proc->outer_lock);
 	while ((n = rb_first(&proc->refs_by_desc))) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
 		outgoing_refs++;
 		binder_delete_ref(ref);
 	}
+	mutex_unlock(&proc->outer_lock);
 	binder_release_work(&proc->todo);
 	buffers = 0;
 
@@ -3071,8 +3804,12 @@ static void binder_deferred_release(struct binder_proc *proc)
 	page_count = 0;
 	if (proc->pages) {
 		int i;
+
+		mutex_lock(&proc->alloc_lock);
+		binder_shrink_free_pages(proc, proc->free_pages_count, 0);
+		mutex_unlock(&proc->alloc_lock);
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
+			if (proc->pages[i].page_ptr) {
 				void *page_addr = proc->buffer + i * PAGE_SIZE;
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
@@ -3081,7 +3818,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 					     page_addr);
 				unmap_kernel_range((unsigned long)page_addr,
 					PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				__free_page(proc->pages[i].page_ptr);
 				page_count++;
 			}
 		}
@@ -3108,7 +3845,6 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3124,18 +3860,25 @@ static void binder_deferred_func(struct work_struct *work)
 
 		files = NULL;
 		if (defer & BINDER_DEFERRED_PUT_FILES) {
+			down_write(&binder_procs_lock);
 			files = proc->files;
 			if (files)
 				proc->files = NULL;
+			up_write(&binder_procs_lock);
 		}
 
-		if (defer & BINDER_DEFERRED_FLUSH)
+		if (defer & BINDER_DEFERRED_FLUSH) {
+			down_read(&binder_procs_lock);
 			binder_deferred_flush(proc);
+			up_read(&binder_procs_lock);
+		}
 
-		if (defer & BINDER_DEFERRED_RELEASE)
+		if (defer & BINDER_DEFERRED_RELEASE) {
+			down_write(&binder_procs_lock);
 			binder_deferred_release(proc); /* frees proc */
+			up_write(&binder_procs_lock);
+		}
 
-		mutex_unlock(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3159,13 +3902,14 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				     struct binder_transaction *t)
 {
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %u:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy, t->priority.prio,
+		   t->need_reply);
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3388,17 +4132,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3406,12 +4154,35 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
+	}
+}
+
+static void print_binder_alloc_stats(struct seq_file *m,
+				     struct binder_proc *proc)
+{
+	int i, mapped = 0;
+
+	mutex_lock(&proc->alloc_lock);
+	if (proc->pages) {
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++)
+			if (proc->pages[i].page_ptr)
+				mapped++;
 	}
+	seq_printf(m, "  pages in use: %d\n"
+			"  pages pooled: %d/%d\n"
+			"  page pool hits %lu misses %lu reclaimed %lu\n",
+			mapped - proc->free_pages_count,
+			proc->free_pages_count, binder_page_pool_size,
+			proc->page_pool_hits, proc->page_pool_misses,
+			proc->pages_reclaimed);
+	mutex_unlock(&proc->alloc_lock);
 }
 
 static void print_binder_proc_stats(struct seq_file *m,
@@ -3431,6 +4202,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 			"  free async space %zd\n", proc->requested_threads,
 			proc->requested_threads_started, proc->max_threads,
 			proc->ready_threads, proc->free_async_space);
+	print_binder_alloc_stats(m, proc);
 	count = 0;
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
@@ -3476,7 +4248,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_procs_lock);
 
 	seq_puts(m, "binder state:\n");
 
@@ -3488,7 +4260,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_procs_lock);
 	return 0;
 }
 
@@ -3499,7 +4271,7 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_procs_lock);
 
 	seq_puts(m, "binder stats:\n");
 
@@ -3508,7 +4280,7 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_procs_lock);
 	return 0;
 }
 
@@ -3519,13 +4291,13 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_procs_lock);
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_procs_lock);
 	return 0;
 }
 
@@ -3535,11 +4307,12 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_procs_lock);
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
+	print_binder_alloc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_procs_lock);
 	return 0;
 }
 
@@ -3568,6 +4341,31 @@ static int binder_transaction_log_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
+static int binder_transaction_latency_show(struct seq_file *m, void *unused)
+{
+	int i, type;
+
+	seq_printf(m, "%10s %10s %10s %10s\n",
+		   "usecs >=", "queue", "service", "total");
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+		int count[BINDER_LATENCY_COUNT];
+		int any = 0;
+
+		for (type = 0; type < BINDER_LATENCY_COUNT; type++) {
+			count[type] = atomic_read(&binder_latency[type][i]);
+			any |= count[type];
+		}
+		if (!any)
+			continue;
+		seq_printf(m, "%10lu %10d %10d %10d\n",
+			   i ? 1UL << (i - 1) : 0UL,
+			   count[BINDER_LATENCY_QUEUE],
+			   count[BINDER_LATENCY_SERVICE],
+			   count[BINDER_LATENCY_TOTAL]);
+	}
+	return 0;
+}
+
 static const struct file_operations binder_fops = {
 	.owner = THIS_MODULE,
 	.poll = binder_poll,
@@ -3588,6 +4386,47 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(transaction_latency);
+
+/*
+ * binder_shrink - unmaps pooled pages, called from mm/vmscan.c :: shrink_slab
+ *
+ * Allocations are made with binder_procs_lock, alloc_lock and mmap_sem
+ * held, so all three are only tried here.
+ */
+static int binder_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int freed;
+
+	if (nr_to_scan && !(gfp_mask & __GFP_FS))
+		return -1;
+	if (!nr_to_scan)
+		return atomic_read(&binder_free_pages);
+
+	if (!down_read_trylock(&binder_procs_lock))
+		return -1;
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (list_empty(&proc->free_pages) ||
+		    !mutex_trylock(&proc->alloc_lock))
+			continue;
+		freed = binder_shrink_free_pages(proc, nr_to_scan, 1);
+		proc->pages_reclaimed += freed;
+		mutex_unlock(&proc->alloc_lock);
+		nr_to_scan -= freed;
+		if (nr_to_scan <= 0)
+			break;
+	}
+	up_read(&binder_procs_lock);
+
+	return atomic_read(&binder_free_pages);
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
 
 static int __init binder_init(void)
 {
@@ -3602,6 +4441,7 @@ static int __init binder_init(void)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
 				    S_IRUGO,
@@ -3628,6 +4468,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("transaction_latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_transaction_latency_fops);
 	}
 	return ret;
 }
@@ -0,0 +1,124 @@
+/* binder_trace.h - trace events for the binder driver
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct binder_transaction;
+struct binder_node;
+
+/* Only included from binder.c, which defines the structures above */
+
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(bool reply, struct binder_transaction *t,
+		 struct binder_node *target_node),
+	TP_ARGS(reply, t, target_node),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(int, reply)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->target_node = target_node ? target_node->debug_id : 0;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply = reply;
+		__entry->code = t->code;
+		__entry->flags = t->flags;
+	),
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->target_node,
+		  __entry->to_proc, __entry->to_thread,
+		  __entry->reply, __entry->flags, __entry->code)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(struct binder_transaction *t),
+	TP_ARGS(t),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(s64, queue_us)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->queue_us = ktime_us_delta(t->dequeue_ts, t->send_ts);
+	),
+	TP_printk("transaction=%d queued=%lldus",
+		  __entry->debug_id, __entry->queue_us)
+);
+
+TRACE_EVENT(binder_transaction_replied,
+	TP_PROTO(struct binder_transaction *t, ktime_t reply_ts),
+	TP_ARGS(t, reply_ts),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(s64, service_us)
+		__field(s64, total_us)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->service_us = ktime_us_delta(reply_ts, t->dequeue_ts);
+		__entry->total_us = ktime_us_delta(reply_ts, t->send_ts);
+	),
+	TP_printk("transaction=%d service=%lldus total=%lldus",
+		  __entry->debug_id, __entry->service_us, __entry->total_us)
+);
+
+TRACE_EVENT(binder_set_priority,
+	TP_PROTO(int proc, int thread, unsigned int old_policy, int old_prio,
+		 unsigned int new_policy, int new_prio),
+	TP_ARGS(proc, thread, old_policy, old_prio, new_policy, new_prio),
+
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, thread)
+		__field(unsigned int, old_policy)
+		__field(int, old_prio)
+		__field(unsigned int, new_policy)
+		__field(int, new_prio)
+	),
+	TP_fast_assign(
+		__entry->proc = proc;
+		__entry->thread = thread;
+		__entry->old_policy = old_policy;
+		__entry->old_prio = old_prio;
+		__entry->new_policy = new_policy;
+		__entry->new_prio = new_prio;
+	),
+	TP_printk("proc=%d thread=%d policy=%u prio=%d => policy=%u prio=%d",
+		  __entry->proc, __entry->thread,
+		  __entry->old_policy, __entry->old_prio,
+		  __entry->new_policy, __entry->new_prio)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
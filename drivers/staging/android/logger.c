@@ -25,27 +25,112 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/lzo.h>
 #include "logger.h"
 #include "logger_interface.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * A uid may fill at most this percentage of a log with its entries while
+ * other uids' entries are left in it: its entries are dropped instead of
+ * pushing theirs out. 0 (or 100) disables the quota.
+ */
+static int logger_uid_quota;
+module_param_named(uid_quota, logger_uid_quota, int, S_IWUSR | S_IRUGO);
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/*
+ * Memory for the compressed history of each log, in percent of the size of
+ * its ring buffer. 0 stops archiving.
+ */
+static int logger_archive_percent = 100;
+module_param_named(archive_percent, logger_archive_percent, int,
+		   S_IWUSR | S_IRUGO);
+#endif
+
+/* number of uids whose use of a log is tracked */
+#define LOGGER_UID_SLOTS	16
+
+/*
+ * struct logger_uid_usage - how much of a log is taken up by one uid
+ *
+ * Accounting is approximate: a uid whose entries were written while all
+ * slots were taken is not charged for them.
+ */
+struct logger_uid_usage {
+	uid_t			uid;
+	size_t			bytes;	/* bytes of entries in the ring */
+	unsigned long		dropped; /* entries dropped over quota */
+};
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/*
+ * struct logger_chunk - a run of entries sealed into the log's archive
+ *
+ * Committed entries are compressed with lzo in chunks of at least
+ * LOGGER_CHUNK_SIZE bytes, so they remain readable once they are overwritten
+ * in the ring. Chunks are protected by log->mutex.
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in logger_log's archive */
+	size_t			start;	/* offset of the first entry */
+	size_t			end;	/* offset just past the last one */
+	size_t			clen;	/* compressed length of data */
+	unsigned char		data[0];
+};
+
+#define LOGGER_CHUNK_SIZE	(4 * 1024)
+#define LOGGER_CHUNK_MAX	(LOGGER_CHUNK_SIZE + \
+				 sizeof(struct logger_entry) + \
+				 LOGGER_ENTRY_MAX_PAYLOAD)
+#endif
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Offsets into the log are free-running: they only ever grow (and wrap at
+ * ULONG_MAX), logger_offset() turns them into an index into 'buffer'. Bytes
+ * [w_commit - size, w_commit) hold the most recent entries, those from
+ * 'head' on are intact.
+ *
+ * Writers never sleep on the log: they reserve room under the spinlock
+ * 'lock', copy their entry in without any lock held and then commit it.
+ * 'lock' protects w_off, head and the 'pending' list of reservations; commits
+ * are published in reservation order through w_commit. The mutex 'mutex'
+ * only serializes readers and protects the 'readers' list.
+ *
+ * With CONFIG_ANDROID_LOGGER_COMPRESS, committed entries are also sealed
+ * into compressed chunks on 'archive', which readers fall back to for
+ * entries the ring no longer holds.
  */
 struct logger_log {
 	unsigned char		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	struct mutex		mutex;	/* mutex protecting readers */
+	spinlock_t		lock;	/* lock protecting reservations */
+	struct list_head	pending; /* reservations not yet committed */
+	size_t			w_off;	/* end of the last reservation */
+	size_t			w_commit; /* entries before this are complete */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_uid_usage	uids[LOGGER_UID_SLOTS]; /* protected by lock */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	struct list_head	archive; /* sealed chunks, oldest first */
+	size_t			archived; /* entries before this are sealed */
+	size_t			archive_bytes; /* memory used by the archive */
+	size_t			archive_raw; /* bytes of entries in it */
+	struct work_struct	seal_work; /* seals committed entries */
+#endif
 };
 
 /*
@@ -60,14 +145,44 @@ struct logger_reader {
 	size_t			r_off;	/* current read head offset */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	unsigned char		*r_buf;	/* last chunk read from the archive */
+	size_t			r_buf_start; /* offsets of the entries in r_buf */
+	size_t			r_buf_end;
+#endif
 };
 
+/*
+ * struct logger_reservation - room reserved by one writer
+ *
+ * Lives on the writer's stack from logger_reserve() to logger_commit().
+ */
+struct logger_reservation {
+	struct list_head	list;	/* entry in logger_log's pending list */
+	size_t			start;	/* offset of the entry */
+	size_t			end;	/* offset just past it */
+	bool			done;	/* entry is completely written */
+};
+
+/*
+ * An entry whose payload could not be copied from userspace keeps its room
+ * in the log, since later writers may already be past it, but is marked by
+ * a zero hdr_size and never handed out to readers.
+ */
+#define LOGGER_ENTRY_DISCARDED	0
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 size_t logger_offset(struct logger_log *log, size_t n)
 {
 	return n & (log->size-1);
 }
 
+/* logger_before - is offset 'a' before offset 'b', accounting for wrapping */
+static inline int logger_before(size_t a, size_t b)
+{
+	return (long)(a - b) < 0;
+}
+
 
 /*
  * file_get_log - Given a file structure, return the associated log
@@ -93,43 +208,29 @@ static inline struct logger_log *file_get_log(struct file *file)
 }
 
 /*
- * get_entry_header - returns a pointer to the logger_entry header within
- * 'log' starting at offset 'off'. A temporary logger_entry 'scratch' must
- * be provided. Typically the return value will be a pointer within
- * 'logger->buf'.  However, a pointer to 'scratch' may be returned if
- * the log entry spans the end and beginning of the circular buffer.
+ * copy_from_log - copies 'len' bytes starting at offset 'off' of 'log' to
+ * 'buf', wrapping around the end of the circular buffer.
  */
-static struct logger_entry *get_entry_header(struct logger_log *log,
-		size_t off, struct logger_entry *scratch)
+static void copy_from_log(struct logger_log *log, size_t off, void *buf,
+			  size_t len)
 {
-	size_t len = min(sizeof(struct logger_entry), log->size - off);
-	if (len != sizeof(struct logger_entry)) {
-		memcpy(((void *) scratch), log->buffer + off, len);
-		memcpy(((void *) scratch) + len, log->buffer,
-			sizeof(struct logger_entry) - len);
-		return scratch;
-	}
+	size_t idx = logger_offset(log, off);
+	size_t n = min(len, log->size - idx);
 
-	return (struct logger_entry *) (log->buffer + off);
+	memcpy(buf, log->buffer + idx, n);
+	if (n != len)
+		memcpy(buf + n, log->buffer, len - n);
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
- *
- * An entry length is 2 bytes (16 bits) in host endian order.
- * In the log, the length does not include the size of the log entry structure.
- * This function returns the size including the log entry structure.
- *
- * Caller needs to hold log->mutex.
+ * get_entry_header - copies the logger_entry header within 'log' starting at
+ * offset 'off' to 'entry'. Readers must check with reader_lapped() that the
+ * entry was not overwritten while they copied it.
  */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static void get_entry_header(struct logger_log *log,
+		size_t off, struct logger_entry *entry)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
-
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+	copy_from_log(log, off, entry, sizeof(struct logger_entry));
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -165,18 +266,290 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * reader_lapped - has a writer reserved the room at the reader's offset
+ * since it was last looked at? If so, whatever was copied from there may
+ * be torn.
+ *
+ * Writers move log->head past an entry before they write over it, so this
+ * is checked after copying, the read barrier orders it behind the copy.
+ */
+static inline int reader_lapped(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	smp_rmb();
+	return logger_before(reader->r_off, ACCESS_ONCE(log->head));
+}
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/* serializes use of the scratch buffers below */
+static DEFINE_MUTEX(logger_seal_mutex);
+static unsigned char *logger_seal_buf;	/* entries, then their compression */
+static void *logger_seal_wrkmem;
+
+static void logger_trim_archive(struct logger_log *log, size_t limit)
+{
+	struct logger_chunk *chunk;
+
+	while (log->archive_bytes > limit && !list_empty(&log->archive)) {
+		chunk = list_first_entry(&log->archive, struct logger_chunk,
+					 list);
+		list_del(&chunk->list);
+		log->archive_bytes -= sizeof(*chunk) + chunk->clen;
+		log->archive_raw -= chunk->end - chunk->start;
+		kfree(chunk);
+	}
+}
+
+/*
+ * logger_seal - compresses committed entries past log->archived into new
+ * chunks at the end of the archive, dropping the oldest chunks to stay
+ * within the log's budget.
+ *
+ * Entries are copied out of the ring like readers do, and the copy is
+ * thrown away if a writer lapped it.
+ */
+static void logger_seal(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      seal_work);
+	unsigned char *src = logger_seal_buf;
+	unsigned char *dst = logger_seal_buf + LOGGER_CHUNK_MAX;
+	struct logger_chunk *chunk;
+	struct logger_entry entry;
+	size_t prev, start, off, commit, len, n, clen;
+
+	mutex_lock(&logger_seal_mutex);
+	while (logger_archive_percent > 0) {
+		mutex_lock(&log->mutex);
+		prev = log->archived;
+		mutex_unlock(&log->mutex);
+
+		commit = ACCESS_ONCE(log->w_commit);
+		smp_rmb();
+		start = prev;
+		if (logger_before(start, ACCESS_ONCE(log->head)))
+			start = ACCESS_ONCE(log->head);
+
+		n = 0;
+		off = start;
+		while (n < LOGGER_CHUNK_SIZE && logger_before(off, commit)) {
+			get_entry_header(log, off, &entry);
+			len = sizeof(struct logger_entry) + entry.len;
+			if (n + len > LOGGER_CHUNK_MAX)
+				break;
+			copy_from_log(log, off, src + n, len);
+			n += len;
+			off += len;
+		}
+
+		smp_rmb();
+		if (logger_before(start, ACCESS_ONCE(log->head)))
+			continue;
+		if (n < LOGGER_CHUNK_SIZE)
+			break;
+
+		lzo1x_1_compress(src, n, dst, &clen, logger_seal_wrkmem);
+		chunk = kmalloc(sizeof(*chunk) + clen, GFP_KERNEL);
+		if (!chunk)
+			break;
+		chunk->start = start;
+		chunk->end = off;
+		chunk->clen = clen;
+		memcpy(chunk->data, dst, clen);
+
+		mutex_lock(&log->mutex);
+		if (log->archived != prev) {
+			/* the log was flushed meanwhile */
+			mutex_unlock(&log->mutex);
+			kfree(chunk);
+			continue;
+		}
+		list_add_tail(&chunk->list, &log->archive);
+		log->archive_bytes += sizeof(*chunk) + clen;
+		log->archive_raw += n;
+		log->archived = off;
+		logger_trim_archive(log,
+				    log->size / 100 * logger_archive_percent);
+		mutex_unlock(&log->mutex);
+	}
+	mutex_unlock(&logger_seal_mutex);
+}
+
+/* logger_seal_kick - have entries sealed once a chunk's worth is committed */
+static inline void logger_seal_kick(struct logger_log *log, size_t commit)
+{
+	if (logger_archive_percent > 0 && logger_seal_wrkmem &&
+	    commit - ACCESS_ONCE(log->archived) >= LOGGER_CHUNK_SIZE)
+		schedule_work(&log->seal_work);
+}
+
+/*
+ * logger_oldest - offset of the oldest entry the log still holds, either
+ * in the ring or in the archive
+ *
+ * Caller needs to hold log->mutex.
+ */
+static size_t logger_oldest(struct logger_log *log)
+{
+	struct logger_chunk *chunk;
+	size_t head = ACCESS_ONCE(log->head);
+
+	if (list_empty(&log->archive))
+		return head;
+	chunk = list_first_entry(&log->archive, struct logger_chunk, list);
+	return logger_before(chunk->start, head) ? chunk->start : head;
+}
+
+/* reader_in_archive - is the reader's entry in its decompressed chunk? */
+static inline int reader_in_archive(struct logger_reader *reader)
+{
+	return !logger_before(reader->r_off, reader->r_buf_start) &&
+		logger_before(reader->r_off, reader->r_buf_end);
+}
+
+static inline unsigned char *reader_archive_ptr(struct logger_reader *reader)
+{
+	return reader->r_buf + (reader->r_off - reader->r_buf_start);
+}
+
+static inline void reader_reset_archive(struct logger_reader *reader)
+{
+	reader->r_buf_start = reader->r_buf_end = reader->r_off;
+}
+
+/*
+ * reader_load_archive - decompresses the chunk holding the entry at the
+ * (lapped) reader's offset, or the next older one than the ring has if that
+ * entry was dropped from the archive as well. Returns 1 if the reader's
+ * entry is in its decompressed chunk now.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static int reader_load_archive(struct logger_log *log,
+			       struct logger_reader *reader)
+{
+	struct logger_chunk *chunk;
+	size_t len;
+
+	list_for_each_entry(chunk, &log->archive, list) {
+		if (!logger_before(reader->r_off, chunk->end))
+			continue;
+		if (!logger_before(chunk->start, ACCESS_ONCE(log->head)))
+			return 0;
+
+		if (!reader->r_buf) {
+			reader->r_buf = kmalloc(LOGGER_CHUNK_MAX, GFP_KERNEL);
+			if (!reader->r_buf)
+				return 0;
+		}
+		len = LOGGER_CHUNK_MAX;
+		if (lzo1x_decompress_safe(chunk->data, chunk->clen,
+					  reader->r_buf, &len) != LZO_E_OK ||
+		    len != chunk->end - chunk->start) {
+			reader->r_off = chunk->end;
+			continue;
+		}
+
+		if (logger_before(reader->r_off, chunk->start))
+			reader->r_off = chunk->start;
+		reader->r_buf_start = chunk->start;
+		reader->r_buf_end = chunk->end;
+		return 1;
+	}
+
+	return 0;
+}
+#else
+static inline void logger_seal_kick(struct logger_log *log, size_t commit)
+{
+}
+
+static size_t logger_oldest(struct logger_log *log)
+{
+	return ACCESS_ONCE(log->head);
+}
+
+static inline int reader_in_archive(struct logger_reader *reader)
+{
+	return 0;
+}
+
+static inline unsigned char *reader_archive_ptr(struct logger_reader *reader)
+{
+	return NULL;
+}
+
+static inline void reader_reset_archive(struct logger_reader *reader)
+{
+}
+
+static inline int reader_load_archive(struct logger_log *log,
+				      struct logger_reader *reader)
+{
+	return 0;
+}
+#endif
+
+/*
+ * get_next_entry_for_reader - moves 'reader' to the next entry it may read
+ * and copies its header to 'entry'. Returns 0 if there is none yet.
+ *
+ * Lapped readers continue from the archive, or are pulled forward to
+ * log->head if it does not hold their entry. Entries that are discarded, or
+ * written by another user for readers that cannot read all entries, are
+ * skipped.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static int get_next_entry_for_reader(struct logger_log *log,
+				     struct logger_reader *reader,
+				     struct logger_entry *entry)
+{
+	uid_t euid = current_euid();
+
+	while (1) {
+		size_t commit = ACCESS_ONCE(log->w_commit);
+
+		/* read the entries only after seeing them committed */
+		smp_rmb();
+		if (!reader_in_archive(reader) && reader_lapped(log, reader) &&
+		    !reader_load_archive(log, reader))
+			reader->r_off = ACCESS_ONCE(log->head);
+
+		if (reader_in_archive(reader)) {
+			memcpy(entry, reader_archive_ptr(reader),
+			       sizeof(struct logger_entry));
+		} else {
+			if (!logger_before(reader->r_off, commit))
+				return 0;
+
+			get_entry_header(log, reader->r_off, entry);
+			if (reader_lapped(log, reader))
+				continue;
+		}
+
+		if (entry->hdr_size != LOGGER_ENTRY_DISCARDED &&
+		    (reader->r_all || entry->euid == euid))
+			return 1;
+
+		reader->r_off += sizeof(struct logger_entry) + entry->len;
+	}
+}
+
+/*
+ * do_read_log_to_user - reads the entry at the reader's offset, whose header
+ * has been copied to 'entry', into the user-space buffer 'buf'. Returns
+ * the number of bytes read on success, or 0 if a writer overwrote the entry
+ * in the meantime.
  *
  * Caller must hold log->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+				   struct logger_entry *entry,
+				   char __user *buf)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	size_t count = entry->len;
 	size_t len;
 	size_t msg_start;
 
@@ -184,12 +557,20 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
-	count -= get_user_hdr_len(reader->r_ver);
 	buf += get_user_hdr_len(reader->r_ver);
+
+	/* entries from the archive are whole in the reader's buffer */
+	if (reader_in_archive(reader)) {
+		if (copy_to_user(buf, reader_archive_ptr(reader) +
+				 sizeof(struct logger_entry), count))
+			return -EFAULT;
+		reader->r_off += sizeof(struct logger_entry) + count;
+		return count + get_user_hdr_len(reader->r_ver);
+	}
+
 	msg_start = logger_offset(log,
 		reader->r_off + sizeof(struct logger_entry));
 
@@ -210,34 +591,12 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
-
-	return count + get_user_hdr_len(reader->r_ver);
-}
-
-/*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
- */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
-{
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
-
-		entry = get_entry_header(log, off, &scratch);
-
-		if (entry->euid == euid)
-			return off;
+	if (reader_lapped(log, reader))
+		return 0;
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(log, off + next_len);
-	}
+	reader->r_off += sizeof(struct logger_entry) + count;
 
-	return off;
+	return count + get_user_hdr_len(reader->r_ver);
 }
 
 /*
@@ -257,6 +616,7 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_entry entry;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -266,10 +626,10 @@ start:
 
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		ret = !get_next_entry_for_reader(log, reader, &entry);
 		if (!ret)
 			break;
+		mutex_unlock(&log->mutex);
 
 		if (file->f_flags & O_NONBLOCK) {
 			ret = -EAGAIN;
@@ -288,28 +648,20 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
-
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
-
 	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
+	ret = get_user_hdr_len(reader->r_ver) + entry.len;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, reader, &entry, buf);
+	if (unlikely(!ret)) {
+		/* a writer lapped us while we copied, try the next one */
+		mutex_unlock(&log->mutex);
+		goto start;
+	}
 
 out:
 	mutex_unlock(&log->mutex);
@@ -318,136 +670,228 @@ out:
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_uid_usage - finds the usage slot of 'uid' in 'log'. If it has none,
+ * one that is not charged for any entries is handed over when 'create' is
+ * set, NULL is returned if there is none.
  *
- * Caller must hold log->mutex.
+ * Caller needs to hold log->lock.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static struct logger_uid_usage *logger_uid_usage(struct logger_log *log,
+						 uid_t uid, int create)
 {
-	size_t count = 0;
+	struct logger_uid_usage *usage, *unused = NULL;
 
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(log, off + nr);
-		count += nr;
-	} while (count < len);
+	for (usage = log->uids; usage < log->uids + LOGGER_UID_SLOTS; usage++) {
+		if (usage->uid == uid && (usage->bytes || usage->dropped))
+			return usage;
+		if (!usage->bytes && (!unused || !usage->dropped))
+			unused = usage;
+	}
 
-	return off;
+	if (!create || !unused)
+		return NULL;
+	unused->uid = uid;
+	unused->bytes = 0;
+	unused->dropped = 0;
+	return unused;
 }
 
 /*
- * is_between - is a < c < b, accounting for wrapping of a, b, and c
- *    positions in the buffer
+ * logger_over_quota - would 'usage' exceed the uid quota of 'log' by adding
+ * an entry of 'len' bytes?
+ */
+static inline int logger_over_quota(struct logger_log *log,
+				    struct logger_uid_usage *usage, size_t len)
+{
+	int quota = logger_uid_quota;
+
+	if (!usage || quota <= 0 || quota >= 100)
+		return 0;
+	return usage->bytes + len > log->size / 100 * quota;
+}
+
+/*
+ * logger_quota_exceeded - would an entry of 'len' bytes for 'uid' push out
+ * another uid's entry while 'usage' is over its quota? Looks ahead from
+ * log->head without moving it, crediting 'usage' for the entries of 'uid' on
+ * the way, so that nothing leaves the log for a write that is then refused.
+ * Entries not committed yet cannot be looked at, the scan stops there.
  *
- * That is, if a<b, check for c between a and b
- * and if a>b, check for c outside (not between) a and b
+ * Caller needs to hold log->lock.
+ */
+static int logger_quota_exceeded(struct logger_log *log,
+				 struct logger_uid_usage *usage, uid_t uid,
+				 size_t len)
+{
+	struct logger_uid_usage own;
+	struct logger_entry entry;
+	size_t head = log->head;
+
+	/* pushing out its own entries only ever brings 'uid' under quota */
+	if (!logger_over_quota(log, usage, len))
+		return 0;
+
+	own = *usage;
+	while (logger_before(head, log->w_off + len - log->size) &&
+	       logger_before(head, log->w_commit)) {
+		get_entry_header(log, head, &entry);
+		if (entry.euid != uid)
+			return logger_over_quota(log, &own, len);
+		own.bytes -= min(own.bytes,
+			sizeof(struct logger_entry) + entry.len);
+		head += sizeof(struct logger_entry) + entry.len;
+	}
+
+	return 0;
+}
+
+/*
+ * logger_reserve - reserves 'len' bytes at the write head for an entry of
+ * 'uid', filling in 'res'. Entries about to be overwritten are dropped from
+ * the readable part of the log first by moving log->head past them.
  *
- * |------- a xxxxxxxx b --------|
- *               c^
+ * If that would overwrite an entry another writer is still copying in, we
+ * wait for that one to be committed.
  *
- * |xxxxx b --------- a xxxxxxxxx|
- *    c^
- *  or                    c^
+ * Returns -EDQUOT, reserving nothing and leaving log->head alone, if the
+ * entry would push out another uid's entry while 'uid' is over its quota.
+ * Once entries have been pushed out the write always goes ahead, so their
+ * space is not wasted.
  */
-static inline int is_between(size_t a, size_t b, size_t c)
+static int logger_reserve(struct logger_log *log,
+			  struct logger_reservation *res, size_t len,
+			  uid_t uid)
 {
-	if (a < b) {
-		/* is c between a and b? */
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		/* is c outside of b through a? */
-		if (c <= b || a < c)
-			return 1;
+	struct logger_uid_usage *usage, *owner;
+	struct logger_entry entry;
+	int evicted = 0;
+	size_t commit;
+
+	spin_lock(&log->lock);
+	usage = logger_uid_usage(log, uid, 1);
+	if (logger_quota_exceeded(log, usage, uid, len))
+		goto over_quota;
+	while (logger_before(log->head, log->w_off + len - log->size)) {
+		if (unlikely(!logger_before(log->head, log->w_commit))) {
+			commit = log->w_commit;
+			spin_unlock(&log->lock);
+			wait_event(log->wq, ACCESS_ONCE(log->w_commit) != commit);
+			spin_lock(&log->lock);
+			usage = logger_uid_usage(log, uid, 1);
+			/* the entries just committed can be looked at now */
+			if (!evicted &&
+			    logger_quota_exceeded(log, usage, uid, len))
+				goto over_quota;
+			continue;
+		}
+
+		get_entry_header(log, log->head, &entry);
+		owner = logger_uid_usage(log, entry.euid, 0);
+		if (owner)
+			owner->bytes -= min(owner->bytes,
+				sizeof(struct logger_entry) + entry.len);
+		log->head += sizeof(struct logger_entry) + entry.len;
+		evicted = 1;
 	}
+	if (usage)
+		usage->bytes += len;
+
+	res->start = log->w_off;
+	res->end = log->w_off + len;
+	res->done = false;
+	list_add_tail(&res->list, &log->pending);
+	log->w_off = res->end;
+	spin_unlock(&log->lock);
+
+	/* readers must see head moved before any of the new bytes */
+	smp_wmb();
 
 	return 0;
+
+over_quota:
+	usage->dropped++;
+	spin_unlock(&log->lock);
+	return -EDQUOT;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * logger_commit - marks the entry reserved in 'res' as complete
  *
- * The caller needs to hold log->mutex.
+ * w_commit only covers entries whose predecessors are complete as well, so
+ * whoever completes the oldest pending entry publishes it together with any
+ * completed ones behind it, and wakes up the readers for the whole batch.
+ * It also has the batch sealed into the archive once there is enough of it.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void logger_commit(struct logger_log *log,
+			  struct logger_reservation *res)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(log, old + len);
-	struct logger_reader *reader;
+	struct logger_reservation *first;
+	size_t commit;
+	int wake = 0;
+
+	spin_lock(&log->lock);
+	res->done = true;
+	while (!list_empty(&log->pending)) {
+		first = list_first_entry(&log->pending,
+					 struct logger_reservation, list);
+		if (!first->done)
+			break;
+		list_del(&first->list);
+		log->w_commit = first->end;
+		wake = 1;
+	}
+	commit = log->w_commit;
+	spin_unlock(&log->lock);
 
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	/* pairs with the barrier in prepare_to_wait() */
+	smp_mb();
+	if (wake && waitqueue_active(&log->wq))
+		wake_up(&log->wq);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	if (wake)
+		logger_seal_kick(log, commit);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to have reserved the room.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off, const void *buf,
+			 size_t count)
 {
+	size_t idx = logger_offset(log, off);
 	size_t len;
 
-  // if logger mode is disabled, terminate instantly
-  if (logger_mode == 0)
-  {
-      return;
-  } 
- 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - idx);
+	memcpy(log->buffer + idx, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log, log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * to the log 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to have reserved the room.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
+	size_t idx = logger_offset(log, off);
 	size_t len;
 
-  // if logger mode is disabled, terminate instantly
-  if (logger_mode == 0)
-  {
-      return;
-  } 
- 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - idx);
+	if (len && copy_from_user(log->buffer + idx, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
 			return -EFAULT;
 
-	log->w_off = logger_offset(log, log->w_off + count);
-
 	return count;
 }
 
@@ -460,9 +904,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	struct logger_reservation res;
 	struct logger_entry header;
 	struct timespec now;
+	size_t off;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -479,17 +924,17 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	// if logger mode is disabled, drop the entry
+	if (logger_mode == 0)
+		return header.len;
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	/* entries over the uid's quota are dropped, like when disabled */
+	if (logger_reserve(log, &res, sizeof(struct logger_entry) + header.len,
+			   header.euid))
+		return header.len;
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	do_write_log(log, res.start, &header, sizeof(struct logger_entry));
+	off = res.start + sizeof(struct logger_entry);
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -499,21 +944,25 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/*
+			 * Readers skip the entry, rather than seeing it
+			 * with fragments missing.
+			 */
+			header.hdr_size = LOGGER_ENTRY_DISCARDED;
+			do_write_log(log, res.start, &header,
+				     sizeof(struct logger_entry));
+			ret = nr;
+			break;
 		}
 
 		iov++;
+		off += nr;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_commit(log, &res);
 
 	return ret;
 }
@@ -547,13 +996,17 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 1;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		reader->r_buf = NULL;
+#endif
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		reader->r_off = logger_oldest(log);
+		reader_reset_archive(reader);
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -579,6 +1032,9 @@ static int logger_release(struct inode *ignored, struct file *file)
 		list_del(&reader->list);
 		mutex_unlock(&log->mutex);
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		kfree(reader->r_buf);
+#endif
 		kfree(reader);
 	}
 
@@ -598,6 +1054,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
 	struct logger_log *log;
+	struct logger_entry entry;
 	unsigned int ret = POLLOUT | POLLWRNORM;
 
 	if (!(file->f_mode & FMODE_READ))
@@ -609,11 +1066,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	if (get_next_entry_for_reader(log, reader, &entry))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -637,7 +1090,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_entry entry;
 	long ret = -EINVAL;
+	int i;
 	void __user *argp = (void __user *) arg;
 
 	mutex_lock(&log->mutex);
@@ -652,10 +1107,11 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		if (logger_before(reader->r_off, logger_oldest(log)))
+			reader->r_off = logger_oldest(log);
+		ret = ACCESS_ONCE(log->w_commit) - reader->r_off;
+		if (ret < 0)
+			ret = 0;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -664,13 +1120,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		if (get_next_entry_for_reader(log, reader, &entry))
+			ret = get_user_hdr_len(reader->r_ver) + entry.len;
 		else
 			ret = 0;
 		break;
@@ -679,9 +1130,20 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
+		/* entries still being written are flushed as well */
+		spin_lock(&log->lock);
 		log->head = log->w_off;
+		for (i = 0; i < LOGGER_UID_SLOTS; i++)
+			log->uids[i].bytes = 0;
+		spin_unlock(&log->lock);
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		logger_trim_archive(log, 0);
+		log->archived = log->head;
+#endif
+		list_for_each_entry(reader, &log->readers, list) {
+			reader->r_off = log->head;
+			reader_reset_archive(reader);
+		}
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -707,6 +1169,57 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+static struct dentry *logger_debugfs_dir;
+
+/*
+ * logger_stats_show - debugfs file with the use of a log, the size of its
+ * archive and how much of the ring the busiest uids take up
+ */
+static int logger_stats_show(struct seq_file *m, void *unused)
+{
+	struct logger_log *log = m->private;
+	struct logger_uid_usage uids[LOGGER_UID_SLOTS];
+	size_t used;
+	int i;
+
+	spin_lock(&log->lock);
+	used = log->w_off - log->head;
+	memcpy(uids, log->uids, sizeof(uids));
+	spin_unlock(&log->lock);
+
+	seq_printf(m, "size: %zu\nused: %zu\nuid_quota: %d%%\n",
+		   log->size, used, logger_uid_quota);
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	mutex_lock(&log->mutex);
+	seq_printf(m, "archive: %zu bytes holding %zu bytes of entries\n",
+		   log->archive_bytes, log->archive_raw);
+	mutex_unlock(&log->mutex);
+#endif
+
+	seq_puts(m, "uid\tbytes\tdropped\n");
+	for (i = 0; i < LOGGER_UID_SLOTS; i++) {
+		if (!uids[i].bytes && !uids[i].dropped)
+			continue;
+		seq_printf(m, "%u\t%zu\t%lu\n", uids[i].uid, uids[i].bytes,
+			   uids[i].dropped);
+	}
+
+	return 0;
+}
+
+static int logger_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, logger_stats_show, inode->i_private);
+}
+
+static const struct file_operations logger_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = logger_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
@@ -718,6 +1231,14 @@ static const struct file_operations logger_fops = {
 	.release = logger_release,
 };
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+#define LOGGER_ARCHIVE_INIT(VAR) \
+	.archive = LIST_HEAD_INIT(VAR .archive), \
+	.seal_work = __WORK_INITIALIZER(VAR .seal_work, logger_seal),
+#else
+#define LOGGER_ARCHIVE_INIT(VAR)
+#endif
+
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, and greater than
@@ -736,9 +1257,13 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.pending = LIST_HEAD_INIT(VAR .pending), \
 	.w_off = 0, \
+	.w_commit = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	LOGGER_ARCHIVE_INIT(VAR) \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 16*1024)
@@ -773,6 +1298,11 @@ static int __init init_log(struct logger_log *log)
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
 
+	if (logger_debugfs_dir)
+		debugfs_create_file(log->misc.name, S_IRUGO,
+				    logger_debugfs_dir, log,
+				    &logger_stats_fops);
+
 	return 0;
 }
 
@@ -780,6 +1310,22 @@ static int __init logger_init(void)
 {
 	int ret;
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	logger_seal_buf = kmalloc(LOGGER_CHUNK_MAX +
+				  lzo1x_worst_compress(LOGGER_CHUNK_MAX),
+				  GFP_KERNEL);
+	logger_seal_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (!logger_seal_buf || !logger_seal_wrkmem) {
+		printk(KERN_WARNING "logger: no memory to archive logs\n");
+		kfree(logger_seal_buf);
+		vfree(logger_seal_wrkmem);
+		logger_seal_buf = NULL;
+		logger_seal_wrkmem = NULL;
+	}
+#endif
+
+	logger_debugfs_dir = debugfs_create_dir("logger", NULL);
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
@@ -40,6 +40,13 @@
 #include <linux/mutex.h>
 #include <linux/delay.h>
 #include <linux/swap.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 
 #ifdef CONFIG_HIGHMEM
 #define _ZONE ZONE_HIGHMEM
@@ -75,20 +82,110 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
-static int test_task_flag(struct task_struct *p, int flag)
+/*
+ * Index of the processes lowmem_shrink() may kill, in one bucket per oom_adj
+ * value. Thread groups with a mm are added when forked, moved to the tail of
+ * another bucket when their oom_adj is written and removed when released.
+ */
+#define LOWMEM_NR_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_index[LOWMEM_NR_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+
+/* the last process killed, until it is released */
+static struct signal_struct *lowmem_deathpending;
+
+/* at most this many processes of a bucket are looked at for a victim */
+#define LOWMEM_BATCH		16
+
+static inline struct list_head *lowmem_bucket(int oom_adj)
+{
+	oom_adj = clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX);
+	return &lowmem_index[oom_adj - OOM_DISABLE];
+}
+
+/* called from copy_process() for a new thread group, under tasklist_lock */
+void lowmem_index_add(struct task_struct *tsk)
+{
+	struct signal_struct *sig = tsk->signal;
+	unsigned long flags;
+
+	INIT_LIST_HEAD(&sig->lmk_adj_node);
+	if (!tsk->mm)
+		return;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	list_add_tail(&sig->lmk_adj_node, lowmem_bucket(sig->oom_adj));
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/* called from __exit_signal() when the thread group is released */
+void lowmem_index_del(struct signal_struct *sig)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	list_del_init(&sig->lmk_adj_node);
+	if (sig == lowmem_deathpending)
+		lowmem_deathpending = NULL;
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/* called when tsk's oom_adj was written, under its siglock */
+void lowmem_index_adj(struct task_struct *tsk)
+{
+	struct signal_struct *sig = tsk->signal;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (!list_empty(&sig->lmk_adj_node))
+		list_move_tail(&sig->lmk_adj_node, lowmem_bucket(sig->oom_adj));
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/*
+ * Whether any thread of p's group still has a mm. Only a peek without
+ * task_lock(), the caller still has to use find_lock_task_mm().
+ */
+static bool lowmem_group_has_mm(struct task_struct *p)
 {
 	struct task_struct *t = p;
 
 	do {
-		task_lock(t);
-		if (test_tsk_thread_flag(t, flag)) {
-			task_unlock(t);
-			return 1;
-		}
-		task_unlock(t);
+		if (t->mm)
+			return true;
 	} while_each_thread(p, t);
 
-	return 0;
+	return false;
+}
+
+/*
+ * lowmem_index_collect - fills 'batch' with up to LOWMEM_BATCH processes of
+ * the bucket for 'oom_adj', those longest in it first, returning how many.
+ * Exiting groups and groups whose threads all dropped their mm are left
+ * out, so they cannot crowd the live processes of the bucket out of the
+ * batch.
+ *
+ * Caller needs to hold rcu_read_lock(), which keeps the tasks around.
+ */
+static int lowmem_index_collect(int oom_adj, struct task_struct **batch)
+{
+	struct signal_struct *sig;
+	unsigned long flags;
+	int n = 0;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	list_for_each_entry(sig, lowmem_bucket(oom_adj), lmk_adj_node) {
+		if (n == LOWMEM_BATCH)
+			break;
+		if (sig->flags & SIGNAL_GROUP_EXIT)
+			continue;
+		if (!lowmem_group_has_mm(sig->curr_target))
+			continue;
+		batch[n++] = sig->curr_target;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	return n;
 }
 
 /* from 3.4 oom_kill.c -> */
@@ -195,9 +292,263 @@ void tune_lmk_param(int *other_free, int *other_file, gfp_t gfp_mask)
 	}
 }
 
+/*
+ * Reclaim efficiency as a pressure signal, the way vmpressure does it: of
+ * every lowmem_pressure_window pages reclaim scans, the share it could not
+ * reclaim is the pressure in percent. Each window ends in an event at the
+ * low, medium or critical level, which user-space memory managers can wait
+ * for on /dev/lowmem_pressure. Writing "<level> [<eventfd>]" to it picks the
+ * lowest level to be woken up for, and optionally an eventfd to signal;
+ * reads return the level of the latest such event.
+ */
+enum {
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+	LOWMEM_PRESSURE_NR,
+};
+
+static const char * const lowmem_pressure_names[LOWMEM_PRESSURE_NR] = {
+	"low", "medium", "critical",
+};
+
+static int lowmem_pressure_medium = 60;
+static int lowmem_pressure_critical = 95;
+static unsigned long lowmem_pressure_window = SWAP_CLUSTER_MAX * 16;
+static int lowmem_pressure_kill = 1;
+
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static unsigned long lowmem_pressure_scanned;	/* protected by ..._lock */
+static unsigned long lowmem_pressure_reclaimed;
+
+/* the rest is protected by lowmem_pressure_mutex */
+static DEFINE_MUTEX(lowmem_pressure_mutex);
+static LIST_HEAD(lowmem_pressure_listeners);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static int lowmem_pressure_level;
+static unsigned long lowmem_pressure_stamp;
+/* events at or above each level, and the level of the latest of them */
+static unsigned long lowmem_pressure_events[LOWMEM_PRESSURE_NR];
+static int lowmem_pressure_last[LOWMEM_PRESSURE_NR];
+
+struct lowmem_pressure_listener {
+	struct list_head list;
+	int level;			/* lowest level to be woken up for */
+	unsigned long seen;		/* events at 'level' read so far */
+	struct eventfd_ctx *eventfd;
+};
+
+static void lowmem_pressure_fn(struct work_struct *work)
+{
+	struct lowmem_pressure_listener *listener;
+	unsigned long scanned, reclaimed, pressure;
+	int level, l;
+
+	spin_lock(&lowmem_pressure_lock);
+	scanned = lowmem_pressure_scanned;
+	reclaimed = lowmem_pressure_reclaimed;
+	lowmem_pressure_scanned = 0;
+	lowmem_pressure_reclaimed = 0;
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (!scanned)
+		return;
+
+	reclaimed = min(reclaimed, scanned);
+	pressure = (scanned - reclaimed) * 100 / scanned;
+	if (pressure >= lowmem_pressure_critical)
+		level = LOWMEM_PRESSURE_CRITICAL;
+	else if (pressure >= lowmem_pressure_medium)
+		level = LOWMEM_PRESSURE_MEDIUM;
+	else
+		level = LOWMEM_PRESSURE_LOW;
+
+	lowmem_print(4, "lowmem pressure %lu%% (%lu/%lu), %s\n", pressure,
+		     reclaimed, scanned, lowmem_pressure_names[level]);
+
+	mutex_lock(&lowmem_pressure_mutex);
+	lowmem_pressure_level = level;
+	lowmem_pressure_stamp = jiffies;
+	for (l = 0; l <= level; l++) {
+		lowmem_pressure_events[l]++;
+		lowmem_pressure_last[l] = level;
+	}
+	list_for_each_entry(listener, &lowmem_pressure_listeners, list)
+		if (listener->eventfd && level >= listener->level)
+			eventfd_signal(listener->eventfd, 1);
+	mutex_unlock(&lowmem_pressure_mutex);
+
+	wake_up_interruptible(&lowmem_pressure_wait);
+}
+
+static DECLARE_WORK(lowmem_pressure_work, lowmem_pressure_fn);
+
+/* called by shrink_zone() with the pages it scanned and reclaimed */
+void lowmem_vmpressure(gfp_t gfp_mask, unsigned long scanned,
+		       unsigned long reclaimed)
+{
+	/* only allocations that could have used any page count */
+	if (!(gfp_mask & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock(&lowmem_pressure_lock);
+	lowmem_pressure_scanned += scanned;
+	lowmem_pressure_reclaimed += reclaimed;
+	scanned = lowmem_pressure_scanned;
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (scanned >= lowmem_pressure_window)
+		schedule_work(&lowmem_pressure_work);
+}
+
+/* was the latest window critical, and recent? */
+static int lowmem_pressure_is_critical(void)
+{
+	return lowmem_pressure_kill &&
+		lowmem_pressure_level == LOWMEM_PRESSURE_CRITICAL &&
+		time_before_eq(jiffies, lowmem_pressure_stamp + HZ);
+}
+
+static int lowmem_pressure_pending(struct lowmem_pressure_listener *listener)
+{
+	return ACCESS_ONCE(lowmem_pressure_events[listener->level]) !=
+		listener->seen;
+}
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	struct lowmem_pressure_listener *listener;
+
+	listener = kzalloc(sizeof(*listener), GFP_KERNEL);
+	if (!listener)
+		return -ENOMEM;
+
+	mutex_lock(&lowmem_pressure_mutex);
+	listener->level = LOWMEM_PRESSURE_LOW;
+	listener->seen = lowmem_pressure_events[listener->level];
+	list_add_tail(&listener->list, &lowmem_pressure_listeners);
+	mutex_unlock(&lowmem_pressure_mutex);
+
+	file->private_data = listener;
+	return nonseekable_open(inode, file);
+}
+
+static int lowmem_pressure_release(struct inode *inode, struct file *file)
+{
+	struct lowmem_pressure_listener *listener = file->private_data;
+
+	mutex_lock(&lowmem_pressure_mutex);
+	list_del(&listener->list);
+	mutex_unlock(&lowmem_pressure_mutex);
+
+	if (listener->eventfd)
+		eventfd_ctx_put(listener->eventfd);
+	kfree(listener);
+	return 0;
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct lowmem_pressure_listener *listener = file->private_data;
+	char level[16];
+	size_t len;
+	int ret;
+
+	mutex_lock(&lowmem_pressure_mutex);
+	while (!lowmem_pressure_pending(listener)) {
+		mutex_unlock(&lowmem_pressure_mutex);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(lowmem_pressure_wait,
+				lowmem_pressure_pending(listener));
+		if (ret)
+			return ret;
+		mutex_lock(&lowmem_pressure_mutex);
+	}
+	listener->seen = lowmem_pressure_events[listener->level];
+	len = snprintf(level, sizeof(level), "%s\n",
+		       lowmem_pressure_names[
+				lowmem_pressure_last[listener->level]]);
+	mutex_unlock(&lowmem_pressure_mutex);
+
+	len = min(len, count);
+	if (copy_to_user(buf, level, len))
+		return -EFAULT;
+	return len;
+}
+
+static ssize_t lowmem_pressure_write(struct file *file,
+				     const char __user *buf, size_t count,
+				     loff_t *ppos)
+{
+	struct lowmem_pressure_listener *listener = file->private_data;
+	struct eventfd_ctx *eventfd = NULL;
+	char buffer[32], name[16];
+	int level, fd, n;
+
+	memset(buffer, 0, sizeof(buffer));
+	if (count > sizeof(buffer) - 1)
+		count = sizeof(buffer) - 1;
+	if (copy_from_user(buffer, buf, count))
+		return -EFAULT;
+
+	n = sscanf(buffer, "%15s %d", name, &fd);
+	if (n < 1)
+		return -EINVAL;
+	for (level = 0; level < LOWMEM_PRESSURE_NR; level++)
+		if (!strcmp(name, lowmem_pressure_names[level]))
+			break;
+	if (level == LOWMEM_PRESSURE_NR)
+		return -EINVAL;
+
+	if (n == 2) {
+		eventfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	mutex_lock(&lowmem_pressure_mutex);
+	listener->level = level;
+	listener->seen = lowmem_pressure_events[level];
+	swap(listener->eventfd, eventfd);
+	mutex_unlock(&lowmem_pressure_mutex);
+
+	if (eventfd)
+		eventfd_ctx_put(eventfd);
+	return count;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	struct lowmem_pressure_listener *listener = file->private_data;
+
+	poll_wait(file, &lowmem_pressure_wait, wait);
+	if (lowmem_pressure_pending(listener))
+		return POLLIN | POLLRDNORM | POLLPRI;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.release = lowmem_pressure_release,
+	.read = lowmem_pressure_read,
+	.write = lowmem_pressure_write,
+	.poll = lowmem_pressure_poll,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
-	struct task_struct *tsk;
+	struct task_struct *batch[LOWMEM_BATCH];
 	struct task_struct *selected = NULL;
 	int rem = 0;
 	int tasksize;
@@ -208,6 +559,8 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free;
 	int other_file;
+	int oom_score_adj;
+	int n;
 
 	if (nr_to_scan > 0) {
 		if (mutex_lock_interruptible(&scan_mutex) < 0)
@@ -231,6 +584,21 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			break;
 		}
 	}
+	/*
+	 * Reclaim hardly getting anything back means the caches counted as
+	 * free above are not, go one level further.
+	 */
+	if (array_size > 0 && lowmem_pressure_is_critical()) {
+		if (i == array_size)
+			i = array_size - 1;
+		else if (i > 0)
+			i--;
+		if (lowmem_adj[i] < min_score_adj) {
+			min_score_adj = lowmem_adj[i];
+			lowmem_print(3, "lowmem_shrink critical pressure, "
+				     "ma %d\n", min_score_adj);
+		}
+	}
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 				nr_to_scan, gfp_mask, other_free,
@@ -249,68 +617,53 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 		return rem;
 	}
 
-	selected_oom_score_adj = min_score_adj;
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		/* give the system time to free up the memory */
+		msleep_interruptible(20);
+		mutex_unlock(&scan_mutex);
+		return 0;
+	}
 
+	/*
+	 * Look for the biggest process in the highest non-empty bucket at or
+	 * above min_score_adj, going down while none of them has memory left.
+	 */
 	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_score_adj;
+	for (oom_score_adj = OOM_ADJUST_MAX;
+	     oom_score_adj >= min_score_adj && !selected; oom_score_adj--) {
+		n = lowmem_index_collect(oom_score_adj, batch);
+		for (i = 0; i < n; i++) {
+			struct task_struct *p;
 
-		if (tsk->flags & PF_KTHREAD)
-			continue;
-
-		if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			if (test_task_flag(tsk, TIF_MEMDIE)) {
-				rcu_read_unlock();
-				/* give the system time to free up the memory */
-				msleep_interruptible(20);
-				mutex_unlock(&scan_mutex);
-				return 0;
-			}
-		}
-
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+			if (batch[i]->flags & PF_KTHREAD)
+				continue;
 
-		/* if task no longer has any memory ignore it */
-		/*  - use old 2.6.35 version 'cos there is no TIF_MM_RELEASED in this kernel */
-		mm = p->mm;
-		sig = p->signal;
-		if(!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
+			p = find_lock_task_mm(batch[i]);
+			if (!p)
+				continue;
 
-		oom_score_adj = p->signal->oom_adj;
-		if (oom_score_adj < min_score_adj) {
+			tasksize = get_mm_rss(p->mm);
 			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
+			if (tasksize <= 0)
 				continue;
-		if (oom_score_adj == selected_oom_score_adj && tasksize <= selected_tasksize)
+			if (selected && tasksize <= selected_tasksize)
 				continue;
+
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_score_adj = oom_score_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm,
+				     oom_score_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_score_adj, tasksize);
 	}
 
 if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_score_adj, selected_tasksize);
+		lowmem_deathpending = selected->signal;
 		lowmem_deathpending_timeout = jiffies + HZ;
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
@@ -332,14 +685,29 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+/* before anything with a mm is forked */
+static int __init lowmem_index_init(void)
+{
+	int i;
+
+	for (i = 0; i < LOWMEM_NR_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_index[i]);
+	return 0;
+}
+early_initcall(lowmem_index_init);
+
 static int __init lowmem_init(void)
 {
 	register_shrinker(&lowmem_shrinker);
+	if (misc_register(&lowmem_pressure_misc))
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "pressure device\n");
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	misc_deregister(&lowmem_pressure_misc);
 	unregister_shrinker(&lowmem_shrinker);
 }
 
@@ -350,6 +718,14 @@ module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 module_param_named(lmk_fast_run, lmk_fast_run, int, S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium, lowmem_pressure_medium, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_window, lowmem_pressure_window, ulong,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_kill, lowmem_pressure_kill, int,
+		   S_IRUGO | S_IWUSR);
 
 
 module_init(lowmem_init);
@@ -501,9 +501,14 @@ static void tmem_pampd_destroy_all_in_obj(struct tmem_obj *obj)
  * "flushed" so that the data is not accessible to a subsequent "get".
  * Since these "duplicate puts" are relatively rare, this implementation
  * always flushes for simplicity.
+ *
+ * The data is opaque to tmem and only passed on to the PAM "create"
+ * method. Anything expensive the PAM implementation needs to do with
+ * the page (e.g. compress it) should be done before calling tmem_put(),
+ * so that it does not run under the hash bucket lock.
  */
 int tmem_put(struct tmem_pool *pool, struct tmem_oid *oidp, uint32_t index,
-		struct page *page)
+		void *data)
 {
 	struct tmem_obj *obj = NULL, *objfound = NULL, *objnew = NULL;
 	void *pampd = NULL, *pampd_del = NULL;
@@ -538,7 +543,7 @@ int tmem_put(struct tmem_pool *pool, struct tmem_oid *oidp, uint32_t index,
 	}
 	BUG_ON(obj == NULL);
 	BUG_ON(((objnew != obj) && (objfound != obj)) || (objnew == objfound));
-	pampd = (*tmem_pamops.create)(obj->pool, &obj->oid, index, page);
+	pampd = (*tmem_pamops.create)(obj->pool, &obj->oid, index, data);
 	if (unlikely(pampd == NULL))
 		goto free;
 	ret = tmem_pampd_add_to_obj(obj, index, pampd);
@@ -167,7 +167,7 @@ struct tmem_objnode {
 /* pampd abstract datatype methods provided by the PAM implementation */
 struct tmem_pamops {
 	void *(*create)(struct tmem_pool *, struct tmem_oid *, uint32_t,
-			struct page *);
+			void *);
 	int (*get_data)(struct page *, void *, struct tmem_pool *);
 	void (*free)(void *, struct tmem_pool *);
 };
@@ -184,7 +184,7 @@ extern void tmem_register_hostops(struct tmem_hostops *m);
 
 /* core tmem accessor functions */
 extern int tmem_put(struct tmem_pool *, struct tmem_oid *, uint32_t index,
-			struct page *page);
+			void *data);
 extern int tmem_get(struct tmem_pool *, struct tmem_oid *, uint32_t index,
 			struct page *page);
 extern int tmem_flush_page(struct tmem_pool *, struct tmem_oid *,
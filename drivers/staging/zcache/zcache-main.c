@@ -6,11 +6,12 @@
  *
  * Zcache provides an in-kernel "host implementation" for transcendent memory
  * and, thus indirectly, for cleancache and frontswap.  Zcache includes two
- * page-accessible memory [1] interfaces, both utilizing lzo1x compression:
+ * page-accessible memory [1] interfaces, both utilizing a selectable
+ * compressor (lzo1x, lz4 or snappy):
  * 1) "compression buddies" ("zbud") is used for ephemeral pages
- * 2) xvmalloc is used for persistent pages.
- * Xvmalloc (based on the TLSF allocator) has very low fragmentation
- * so maximizes space efficiency, while zbud allows pairs (and potentially,
+ * 2) zsmalloc is used for persistent pages.
+ * Zsmalloc (based on size classes) packs objects densely and so
+ * maximizes space efficiency, while zbud allows pairs (and potentially,
  * in the future, more than a pair of) compressed pages to be closely linked
  * so that reclaiming can be done via the kernel's physical-page-oriented
  * "shrinker" interface.
@@ -22,14 +23,29 @@
 #include <linux/cpu.h>
 #include <linux/highmem.h>
 #include <linux/list.h>
-#include <linux/lzo.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/string.h>
 #include <linux/types.h>
 #include <asm/atomic.h>
 #include "tmem.h"
 
-#include "../zram/xvmalloc.h" /* if built in drivers/staging */
+#include "../zram/zsmalloc.h" /* if built in drivers/staging */
+
+#ifdef CONFIG_ZCACHE_LZO
+#include <linux/lzo.h>
+#endif
+#ifdef CONFIG_ZCACHE_LZ4
+#include <linux/lz4.h>
+#endif
+#ifdef CONFIG_ZCACHE_SNAPPY
+#include "../snappy/csnappy.h" /* if built in drivers/staging */
+#endif
+
+#if !defined(CONFIG_ZCACHE_LZO) && !defined(CONFIG_ZCACHE_LZ4) && \
+	!defined(CONFIG_ZCACHE_SNAPPY)
+#error at least one of CONFIG_ZCACHE_{LZO,LZ4,SNAPPY} must be defined
+#endif
 
 #if (!defined(CONFIG_CLEANCACHE) && !defined(CONFIG_FRONTSWAP))
 #error "zcache is useless without CONFIG_CLEANCACHE or CONFIG_FRONTSWAP"
@@ -49,6 +65,115 @@
 	(__GFP_FS | __GFP_NORETRY | __GFP_NOWARN | __GFP_NOMEMALLOC)
 #endif
 
+/**********
+ * Compressors. The one in use can be picked at boot ("zcache=lz4") or at
+ * run time through sysfs. Every compressed page records the index of the
+ * compressor it was compressed with, so switching requires no flush.
+ */
+
+struct zcache_comp {
+	const char *name;
+	size_t workmem_size;
+	int (*compress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *workmem);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len);
+};
+
+#ifdef CONFIG_ZCACHE_LZ4
+static int zcache_lz4_decompress(const unsigned char *src, size_t src_len,
+				 unsigned char *dst, size_t *dst_len)
+{
+	return lz4_decompress((const char *)src, src_len, (char *)dst,
+			      dst_len);
+}
+#endif
+
+#ifdef CONFIG_ZCACHE_SNAPPY
+#define SNAPPY_WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
+
+static int zcache_snappy_compress(const unsigned char *src, size_t src_len,
+				  unsigned char *dst, size_t *dst_len,
+				  void *workmem)
+{
+	const unsigned char *end = csnappy_compress_fragment(
+		src, (uint32_t)src_len, dst, workmem, SNAPPY_WMSIZE_ORDER);
+	*dst_len = end - dst;
+	return 0;
+}
+
+static int zcache_snappy_decompress(const unsigned char *src, size_t src_len,
+				    unsigned char *dst, size_t *dst_len)
+{
+	uint32_t dst_len_ = (uint32_t)*dst_len;
+	int ret = csnappy_decompress_noheader(src, src_len, dst, &dst_len_);
+	*dst_len = (size_t)dst_len_;
+	return ret;
+}
+#endif
+
+static const struct zcache_comp zcache_comps[] = {
+#ifdef CONFIG_ZCACHE_LZO
+	{
+		.name		= "lzo",
+		.workmem_size	= LZO1X_MEM_COMPRESS,
+		.compress	= lzo1x_1_compress,
+		.decompress	= lzo1x_decompress_safe,
+	},
+#endif
+#ifdef CONFIG_ZCACHE_LZ4
+	{
+		.name		= "lz4",
+		.workmem_size	= LZ4_MEM_COMPRESS,
+		.compress	= lz4_compress,
+		.decompress	= zcache_lz4_decompress,
+	},
+#endif
+#ifdef CONFIG_ZCACHE_SNAPPY
+	{
+		.name		= "snappy",
+		.workmem_size	= 1 << SNAPPY_WMSIZE_ORDER,
+		.compress	= zcache_snappy_compress,
+		.decompress	= zcache_snappy_decompress,
+	},
+#endif
+};
+
+/* index in zcache_comps[] of the compressor used for new pages */
+static int zcache_comp_idx;
+
+static int zcache_comp_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(zcache_comps); i++)
+		if (sysfs_streq(name, zcache_comps[i].name))
+			return i;
+	return -1;
+}
+
+static size_t zcache_comp_workmem_size(void)
+{
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(zcache_comps); i++)
+		size = max(size, zcache_comps[i].workmem_size);
+	return size;
+}
+
+static void zcache_decompress(uint8_t comp, char *from_va, unsigned size,
+				char *to_va)
+{
+	size_t out_len = PAGE_SIZE;
+	int ret;
+
+	BUG_ON(comp >= ARRAY_SIZE(zcache_comps));
+	ret = zcache_comps[comp].decompress(from_va, size, to_va, &out_len);
+	BUG_ON(ret != 0);
+	BUG_ON(out_len != PAGE_SIZE);
+}
+
 /**********
  * Compression buddies ("zbud") provides for packing two (or, possibly
  * in the future, more) compressed ephemeral pages into a single "raw"
@@ -76,6 +201,7 @@ struct zbud_hdr {
 	struct tmem_oid oid;
 	uint32_t index;
 	uint16_t size; /* compressed size in bytes, zero means unused */
+	uint8_t comp; /* index in zcache_comps[] */
 	DECL_SENTINEL
 };
 
@@ -295,8 +421,8 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 }
 
 static struct zbud_hdr *zbud_create(uint32_t pool_id, struct tmem_oid *oid,
-					uint32_t index, struct page *page,
-					void *cdata, unsigned size)
+					uint32_t index, void *cdata,
+					unsigned size, uint8_t comp)
 {
 	struct zbud_hdr *zh0, *zh1, *zh = NULL;
 	struct zbud_page *zbpg = NULL, *ztmp;
@@ -350,6 +476,7 @@ found_unbuddied:
 init_zh:
 	SET_SENTINEL(zh, ZBH);
 	zh->size = size;
+	zh->comp = comp;
 	zh->index = index;
 	zh->oid = *oid;
 	zh->pool_id = pool_id;
@@ -371,7 +498,6 @@ static int zbud_decompress(struct page *page, struct zbud_hdr *zh)
 {
 	struct zbud_page *zbpg;
 	unsigned budnum = zbud_budnum(zh);
-	size_t out_len = PAGE_SIZE;
 	char *to_va, *from_va;
 	unsigned size;
 	int ret = 0;
@@ -388,9 +514,7 @@ static int zbud_decompress(struct page *page, struct zbud_hdr *zh)
 	to_va = kmap_atomic(page, KM_USER0);
 	size = zh->size;
 	from_va = zbud_data(zh, size);
-	ret = lzo1x_decompress_safe(from_va, size, to_va, &out_len);
-	BUG_ON(ret != LZO_E_OK);
-	BUG_ON(out_len != PAGE_SIZE);
+	zcache_decompress(zh->comp, from_va, size, to_va);
 	kunmap_atomic(to_va, KM_USER0);
 out:
 	spin_unlock(&zbpg->lock);
@@ -584,12 +708,13 @@ static int zbud_show_cumul_chunk_counts(char *buf)
 #endif
 
 /**********
- * This "zv" PAM implementation combines the TLSF-based xvMalloc
- * with lzo1x compression to maximize the amount of data that can
- * be packed into a physical page.
+ * This "zv" PAM implementation combines the size class based zsmalloc
+ * with compression to maximize the amount of data that can be packed
+ * into a physical page.
  *
- * Zv represents a PAM page with the index and object (plus a "size" value
- * necessary for decompression) immediately preceding the compressed data.
+ * Zv represents a PAM page with the index and object (plus the "size"
+ * and compressor necessary for decompression) immediately preceding the
+ * compressed data. The pampd is the zsmalloc handle of the object.
  */
 
 #define ZVH_SENTINEL  0x43214321
@@ -598,70 +723,71 @@ struct zv_hdr {
 	uint32_t pool_id;
 	struct tmem_oid oid;
 	uint32_t index;
+	uint16_t size; /* compressed size in bytes */
+	uint8_t comp; /* index in zcache_comps[] */
 	DECL_SENTINEL
 };
 
 static const int zv_max_page_size = (PAGE_SIZE / 8) * 7;
 
-static struct zv_hdr *zv_create(struct xv_pool *xvpool, uint32_t pool_id,
+static atomic_t zcache_zv_curr_zbytes = ATOMIC_INIT(0);
+static unsigned long zcache_zv_cumul_zbytes;
+
+static unsigned long zv_create(struct zs_pool *pool, uint32_t pool_id,
 				struct tmem_oid *oid, uint32_t index,
-				void *cdata, unsigned clen)
+				void *cdata, unsigned clen, uint8_t comp)
 {
-	struct page *page;
-	struct zv_hdr *zv = NULL;
-	uint32_t offset;
-	int ret;
+	struct zv_hdr *zv;
+	unsigned long handle;
 
 	BUG_ON(!irqs_disabled());
-	ret = xv_malloc(xvpool, clen + sizeof(struct zv_hdr),
-			&page, &offset, ZCACHE_GFP_MASK);
-	if (unlikely(ret))
+	handle = zs_malloc(pool, clen + sizeof(struct zv_hdr),
+			   ZCACHE_GFP_MASK);
+	if (unlikely(!handle))
 		goto out;
-	zv = kmap_atomic(page, KM_USER0) + offset;
+	zv = zs_map_object(pool, handle, ZS_MM_WO);
 	zv->index = index;
 	zv->oid = *oid;
 	zv->pool_id = pool_id;
+	zv->size = clen;
+	zv->comp = comp;
 	SET_SENTINEL(zv, ZVH);
 	memcpy((char *)zv + sizeof(struct zv_hdr), cdata, clen);
-	kunmap_atomic(zv, KM_USER0);
+	zs_unmap_object(pool, handle);
+	atomic_add(clen, &zcache_zv_curr_zbytes);
+	zcache_zv_cumul_zbytes += clen;
 out:
-	return zv;
+	return handle;
 }
 
-static void zv_free(struct xv_pool *xvpool, struct zv_hdr *zv)
+static void zv_free(struct zs_pool *pool, unsigned long handle)
 {
-	unsigned long flags;
-	struct page *page;
-	uint32_t offset;
+	struct zv_hdr *zv;
 	uint16_t size;
 
+	zv = zs_map_object(pool, handle, ZS_MM_RW);
 	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
+	size = zv->size;
 	BUG_ON(size == 0 || size > zv_max_page_size);
 	INVERT_SENTINEL(zv, ZVH);
-	page = virt_to_page(zv);
-	offset = (unsigned long)zv & ~PAGE_MASK;
-	local_irq_save(flags);
-	xv_free(xvpool, page, offset);
-	local_irq_restore(flags);
+	zs_unmap_object(pool, handle);
+	zs_free(pool, handle);
+	atomic_sub(size, &zcache_zv_curr_zbytes);
 }
 
-static void zv_decompress(struct page *page, struct zv_hdr *zv)
+static void zv_decompress(struct zs_pool *pool, struct page *page,
+				unsigned long handle)
 {
-	size_t clen = PAGE_SIZE;
+	struct zv_hdr *zv;
 	char *to_va;
-	unsigned size;
-	int ret;
 
+	zv = zs_map_object(pool, handle, ZS_MM_RO);
 	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
-	BUG_ON(size == 0 || size > zv_max_page_size);
+	BUG_ON(zv->size == 0 || zv->size > zv_max_page_size);
 	to_va = kmap_atomic(page, KM_USER0);
-	ret = lzo1x_decompress_safe((char *)zv + sizeof(*zv),
-					size, to_va, &clen);
+	zcache_decompress(zv->comp, (char *)zv + sizeof(*zv), zv->size, to_va);
 	kunmap_atomic(to_va, KM_USER0);
-	BUG_ON(ret != LZO_E_OK);
-	BUG_ON(clen != PAGE_SIZE);
+	zs_unmap_object(pool, handle);
 }
 
 /*
@@ -680,7 +806,7 @@ static unsigned long zcache_failed_pers_puts;
 
 static struct {
 	struct tmem_pool *tmem_pools[MAX_POOLS_PER_CLIENT];
-	struct xv_pool *xvpool;
+	struct zs_pool *zspool;
 } zcache_client;
 
 /*
@@ -882,52 +1008,63 @@ static unsigned long zcache_curr_eph_pampd_count_max;
 static atomic_t zcache_curr_pers_pampd_count = ATOMIC_INIT(0);
 static unsigned long zcache_curr_pers_pampd_count_max;
 
+/*
+ * FIXME: This is all the "policy" there is for now.
+ * 3/4 totpages should allow ~37% of RAM to be filled with
+ * compressed frontswap pages
+ */
+static inline bool zcache_pers_full(void)
+{
+	return atomic_read(&zcache_curr_pers_pampd_count) >
+						3 * totalram_pages / 4;
+}
+
+/*
+ * A page as compressed by zcache_put_page() before calling tmem_put(),
+ * handed through to zcache_pampd_create().
+ */
+struct zcache_cdata {
+	void *cdata;	/* NULL if the page was not compressed */
+	size_t clen;
+	uint8_t comp;
+};
+
 /* forward reference */
-static int zcache_compress(struct page *from, void **out_va, size_t *out_len);
+static int zcache_compress(struct page *from, void **out_va, size_t *out_len,
+				uint8_t *comp);
 
 static void *zcache_pampd_create(struct tmem_pool *pool, struct tmem_oid *oid,
-				 uint32_t index, struct page *page)
+				 uint32_t index, void *data)
 {
-	void *pampd = NULL, *cdata;
-	size_t clen;
-	int ret;
+	struct zcache_cdata *zcd = data;
+	void *pampd = NULL;
 	bool ephemeral = is_ephemeral(pool);
 	unsigned long count;
 
+	if (zcd->cdata == NULL)
+		goto out;
 	if (ephemeral) {
-		ret = zcache_compress(page, &cdata, &clen);
-		if (ret == 0)
-
-			goto out;
-		if (clen == 0 || clen > zbud_max_buddy_size()) {
+		if (zcd->clen == 0 || zcd->clen > zbud_max_buddy_size()) {
 			zcache_compress_poor++;
 			goto out;
 		}
 		pampd = (void *)zbud_create(pool->pool_id, oid, index,
-						page, cdata, clen);
+					zcd->cdata, zcd->clen, zcd->comp);
 		if (pampd != NULL) {
 			count = atomic_inc_return(&zcache_curr_eph_pampd_count);
 			if (count > zcache_curr_eph_pampd_count_max)
 				zcache_curr_eph_pampd_count_max = count;
 		}
 	} else {
-		/*
-		 * FIXME: This is all the "policy" there is for now.
-		 * 3/4 totpages should allow ~37% of RAM to be filled with
-		 * compressed frontswap pages
-		 */
-		if (atomic_read(&zcache_curr_pers_pampd_count) >
-							3 * totalram_pages / 4)
+		if (zcache_pers_full())
 			goto out;
-		ret = zcache_compress(page, &cdata, &clen);
-		if (ret == 0)
-			goto out;
-		if (clen > zv_max_page_size) {
+		if (zcd->clen > zv_max_page_size) {
 			zcache_compress_poor++;
 			goto out;
 		}
-		pampd = (void *)zv_create(zcache_client.xvpool, pool->pool_id,
-						oid, index, cdata, clen);
+		pampd = (void *)zv_create(zcache_client.zspool, pool->pool_id,
+					oid, index, zcd->cdata, zcd->clen,
+					zcd->comp);
 		if (pampd == NULL)
 			goto out;
 		count = atomic_inc_return(&zcache_curr_pers_pampd_count);
@@ -950,7 +1087,8 @@ static int zcache_pampd_get_data(struct page *page, void *pampd,
 	if (is_ephemeral(pool))
 		ret = zbud_decompress(page, pampd);
 	else
-		zv_decompress(page, pampd);
+		zv_decompress(zcache_client.zspool, page,
+				(unsigned long)pampd);
 	return ret;
 }
 
@@ -965,7 +1103,7 @@ static void zcache_pampd_free(void *pampd, struct tmem_pool *pool)
 		atomic_dec(&zcache_curr_eph_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_eph_pampd_count) < 0);
 	} else {
-		zv_free(zcache_client.xvpool, (struct zv_hdr *)pampd);
+		zv_free(zcache_client.zspool, (unsigned long)pampd);
 		atomic_dec(&zcache_curr_pers_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_pers_pampd_count) < 0);
 	}
@@ -981,26 +1119,29 @@ static struct tmem_pamops zcache_pamops = {
  * zcache compression/decompression and related per-cpu stuff
  */
 
-#define LZO_WORKMEM_BYTES LZO1X_1_MEM_COMPRESS
-#define LZO_DSTMEM_PAGE_ORDER 1
+#define ZCACHE_DSTMEM_PAGE_ORDER 1
 static DEFINE_PER_CPU(unsigned char *, zcache_workmem);
 static DEFINE_PER_CPU(unsigned char *, zcache_dstmem);
 
-static int zcache_compress(struct page *from, void **out_va, size_t *out_len)
+static int zcache_compress(struct page *from, void **out_va, size_t *out_len,
+				uint8_t *comp)
 {
 	int ret = 0;
 	unsigned char *dmem = __get_cpu_var(zcache_dstmem);
 	unsigned char *wmem = __get_cpu_var(zcache_workmem);
 	char *from_va;
+	int idx = ACCESS_ONCE(zcache_comp_idx);
 
 	BUG_ON(!irqs_disabled());
 	if (unlikely(dmem == NULL || wmem == NULL))
 		goto out;  /* no buffer, so can't compress */
 	from_va = kmap_atomic(from, KM_USER0);
 	mb();
-	ret = lzo1x_1_compress(from_va, PAGE_SIZE, dmem, out_len, wmem);
-	BUG_ON(ret != LZO_E_OK);
+	ret = zcache_comps[idx].compress(from_va, PAGE_SIZE, dmem, out_len,
+					wmem);
+	BUG_ON(ret != 0);
 	*out_va = dmem;
+	*comp = idx;
 	kunmap_atomic(from_va, KM_USER0);
 	ret = 1;
 out:
@@ -1018,15 +1159,15 @@ static int zcache_cpu_notifier(struct notifier_block *nb,
 	case CPU_UP_PREPARE:
 		per_cpu(zcache_dstmem, cpu) = (void *)__get_free_pages(
 			GFP_KERNEL | __GFP_REPEAT,
-			LZO_DSTMEM_PAGE_ORDER),
+			ZCACHE_DSTMEM_PAGE_ORDER),
 		per_cpu(zcache_workmem, cpu) =
-			kzalloc(LZO1X_MEM_COMPRESS,
+			kzalloc(zcache_comp_workmem_size(),
 				GFP_KERNEL | __GFP_REPEAT);
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
 		free_pages((unsigned long)per_cpu(zcache_dstmem, cpu),
-				LZO_DSTMEM_PAGE_ORDER);
+				ZCACHE_DSTMEM_PAGE_ORDER);
 		per_cpu(zcache_dstmem, cpu) = NULL;
 		kfree(per_cpu(zcache_workmem, cpu));
 		per_cpu(zcache_workmem, cpu) = NULL;
@@ -1090,6 +1231,47 @@ static struct notifier_block zcache_cpu_notifier_block = {
 		.show = zcache_##_name##_show, \
 	}
 
+static int zcache_zv_show_pool_pages(char *buf)
+{
+	u64 bytes = 0;
+
+	if (zcache_client.zspool != NULL)
+		bytes = zs_get_total_size_bytes(zcache_client.zspool);
+	return sprintf(buf, "%llu\n", bytes >> PAGE_SHIFT);
+}
+
+/* all compiled in compressors, the one in use in square brackets */
+static ssize_t zcache_compressor_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	char *p = buf;
+	int i, idx = zcache_comp_idx;
+
+	for (i = 0; i < ARRAY_SIZE(zcache_comps); i++)
+		p += sprintf(p, i == idx ? "[%s] " : "%s ",
+				zcache_comps[i].name);
+	p[-1] = '\n';
+	return p - buf;
+}
+
+static ssize_t zcache_compressor_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	int idx = zcache_comp_find(buf);
+
+	if (idx < 0)
+		return -EINVAL;
+	zcache_comp_idx = idx;
+	return count;
+}
+
+static struct kobj_attribute zcache_compressor_attr = {
+	.attr = { .name = "compressor", .mode = 0644 },
+	.show = zcache_compressor_show,
+	.store = zcache_compressor_store,
+};
+
 ZCACHE_SYSFS_RO(curr_obj_count_max);
 ZCACHE_SYSFS_RO(curr_objnode_count_max);
 ZCACHE_SYSFS_RO(flush_total);
@@ -1110,6 +1292,10 @@ ZCACHE_SYSFS_RO(failed_get_free_pages);
 ZCACHE_SYSFS_RO(failed_alloc);
 ZCACHE_SYSFS_RO(put_to_flush);
 ZCACHE_SYSFS_RO(compress_poor);
+ZCACHE_SYSFS_RO(zv_cumul_zbytes);
+ZCACHE_SYSFS_RO_ATOMIC(zv_curr_zbytes);
+ZCACHE_SYSFS_RO_ATOMIC(curr_pers_pampd_count);
+ZCACHE_SYSFS_RO_CUSTOM(zv_pool_pages, zcache_zv_show_pool_pages);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_raw_pages);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_zpages);
 ZCACHE_SYSFS_RO_ATOMIC(curr_obj_count);
@@ -1131,6 +1317,11 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_failed_eph_puts_attr.attr,
 	&zcache_failed_pers_puts_attr.attr,
 	&zcache_compress_poor_attr.attr,
+	&zcache_compressor_attr.attr,
+	&zcache_curr_pers_pampd_count_attr.attr,
+	&zcache_zv_curr_zbytes_attr.attr,
+	&zcache_zv_cumul_zbytes_attr.attr,
+	&zcache_zv_pool_pages_attr.attr,
 	&zcache_zbud_curr_raw_pages_attr.attr,
 	&zcache_zbud_curr_zpages_attr.attr,
 	&zcache_zbud_curr_zbytes_attr.attr,
@@ -1202,8 +1393,18 @@ static int zcache_put_page(int pool_id, struct tmem_oid *oidp,
 	if (unlikely(pool == NULL))
 		goto out;
 	if (!zcache_freeze && zcache_do_preload(pool) == 0) {
+		struct zcache_cdata zcd = { .cdata = NULL };
+
+		/*
+		 * Compress before tmem_put() takes the hash bucket lock:
+		 * puts hashing to the same bucket from other cpus then only
+		 * wait for the tree update and the copy, not compression.
+		 * Irqs stay disabled, so the per-cpu buffer remains ours.
+		 */
+		if (is_ephemeral(pool) || !zcache_pers_full())
+			zcache_compress(page, &zcd.cdata, &zcd.clen, &zcd.comp);
 		/* preload does preempt_disable on success */
-		ret = tmem_put(pool, oidp, index, page);
+		ret = tmem_put(pool, oidp, index, &zcd);
 		if (ret < 0) {
 			if (is_ephemeral(pool))
 				zcache_failed_eph_puts++;
@@ -1551,9 +1752,21 @@ struct frontswap_ops zcache_frontswap_register_ops(void)
 
 static int zcache_enabled;
 
+/* "zcache" or "zcache=<compressor>" */
 static int __init enable_zcache(char *s)
 {
+	int idx;
+
 	zcache_enabled = 1;
+	if (*s == '=') {
+		idx = zcache_comp_find(s + 1);
+		if (idx < 0)
+			pr_warning("zcache: unknown compressor %s, "
+				"using %s\n", s + 1,
+				zcache_comps[zcache_comp_idx].name);
+		else
+			zcache_comp_idx = idx;
+	}
 	return 1;
 }
 __setup("zcache", enable_zcache);
@@ -1597,6 +1810,8 @@ static int __init zcache_init(void)
 
 		tmem_register_hostops(&zcache_hostops);
 		tmem_register_pamops(&zcache_pamops);
+		pr_info("zcache: using %s compressor\n",
+			zcache_comps[zcache_comp_idx].name);
 		ret = register_cpu_notifier(&zcache_cpu_notifier_block);
 		if (ret) {
 			pr_err("zcache: can't register cpu notifier\n");
@@ -1630,14 +1845,14 @@ static int __init zcache_init(void)
 	if (zcache_enabled && use_frontswap) {
 		struct frontswap_ops old_ops;
 
-		zcache_client.xvpool = xv_create_pool();
-		if (zcache_client.xvpool == NULL) {
-			pr_err("zcache: can't create xvpool\n");
+		zcache_client.zspool = zs_create_pool();
+		if (zcache_client.zspool == NULL) {
+			pr_err("zcache: can't create zspool\n");
 			goto out;
 		}
 		old_ops = zcache_frontswap_register_ops();
 		pr_info("zcache: frontswap enabled using kernel "
-			"transcendent memory and xvmalloc\n");
+			"transcendent memory and zsmalloc\n");
 		if (old_ops.init != NULL)
 			pr_warning("ktmem: frontswap_ops overridden");
 	}
@@ -0,0 +1,296 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+
+#include "zram_comp.h"
+
+#ifdef CONFIG_ZRAM_LZO
+#include <linux/lzo.h>
+#endif
+
+#ifdef CONFIG_ZRAM_LZ4
+#include <linux/lz4.h>
+#endif
+
+#ifdef CONFIG_ZRAM_SNAPPY
+#include "../snappy/csnappy.h" /* if built in drivers/staging */
+#endif
+
+#if !defined(CONFIG_ZRAM_LZO) && !defined(CONFIG_ZRAM_LZ4) && \
+	!defined(CONFIG_ZRAM_SNAPPY)
+#error at least one of CONFIG_ZRAM_{LZO,LZ4,SNAPPY} must be defined
+#endif
+
+#ifdef CONFIG_ZRAM_LZ4
+static int zram_lz4_decompress(const unsigned char *src, size_t src_len,
+			       unsigned char *dst, size_t *dst_len)
+{
+	return lz4_decompress((const char *)src, src_len, (char *)dst,
+			      dst_len);
+}
+#endif
+
+#ifdef CONFIG_ZRAM_SNAPPY
+#define SNAPPY_WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
+
+static int zram_snappy_compress(const unsigned char *src, size_t src_len,
+				unsigned char *dst, size_t *dst_len,
+				void *workmem)
+{
+	const unsigned char *end = csnappy_compress_fragment(
+		src, (uint32_t)src_len, dst, workmem, SNAPPY_WMSIZE_ORDER);
+	*dst_len = end - dst;
+	return 0;
+}
+
+static int zram_snappy_decompress(const unsigned char *src, size_t src_len,
+				  unsigned char *dst, size_t *dst_len)
+{
+	uint32_t dst_len_ = (uint32_t)*dst_len;
+	int ret = csnappy_decompress_noheader(src, src_len, dst, &dst_len_);
+	*dst_len = (size_t)dst_len_;
+	return ret;
+}
+#endif
+
+/* The first entry is used by devices that never set comp_algorithm */
+static const struct zram_backend zram_backends[] = {
+#ifdef CONFIG_ZRAM_LZO
+	{
+		.name		= "lzo",
+		.workmem_size	= LZO1X_MEM_COMPRESS,
+		.compress	= lzo1x_1_compress,
+		.decompress	= lzo1x_decompress_safe,
+	},
+#endif
+#ifdef CONFIG_ZRAM_LZ4
+	{
+		.name		= "lz4",
+		.workmem_size	= LZ4_MEM_COMPRESS,
+		.compress	= lz4_compress,
+		.decompress	= zram_lz4_decompress,
+	},
+#endif
+#ifdef CONFIG_ZRAM_SNAPPY
+	{
+		.name		= "snappy",
+		.workmem_size	= 1 << SNAPPY_WMSIZE_ORDER,
+		.compress	= zram_snappy_compress,
+		.decompress	= zram_snappy_decompress,
+	},
+#endif
+};
+
+const struct zram_backend *zram_backend_default(void)
+{
+	return &zram_backends[0];
+}
+
+const struct zram_backend *zram_backend_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(zram_backends); i++) {
+		if (sysfs_streq(name, zram_backends[i].name))
+			return &zram_backends[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * List all compiled in backends, the one in use in square brackets,
+ * in the same format as the block layer's 'scheduler' attribute.
+ */
+ssize_t zram_backend_show(const struct zram_backend *cur, char *buf)
+{
+	int i;
+	ssize_t len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(zram_backends); i++) {
+		const struct zram_backend *b = &zram_backends[i];
+
+		if (b == cur)
+			len += sprintf(buf + len, "[%s] ", b->name);
+		else
+			len += sprintf(buf + len, "%s ", b->name);
+	}
+	/* Replace the trailing space */
+	buf[len - 1] = '\n';
+
+	return len;
+}
+
+static void zram_comp_strm_free(struct zram_comp_strm *zstrm)
+{
+	kfree(zstrm->workmem);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+static struct zram_comp_strm *zram_comp_strm_alloc(struct zram_comp *comp,
+						   gfp_t flags)
+{
+	struct zram_comp_strm *zstrm;
+
+	zstrm = kmalloc(sizeof(*zstrm), flags);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->workmem = kzalloc(comp->backend->workmem_size, flags);
+	zstrm->buffer = (void *)__get_free_pages(flags | __GFP_ZERO, 1);
+	if (!zstrm->workmem || !zstrm->buffer) {
+		zram_comp_strm_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/*
+ * Get an idle stream, allocating a new one if fewer than max_strm exist.
+ * Sleeps until another writer releases its stream otherwise. Never fails:
+ * the stream allocated by zram_comp_create() is always there to wait for.
+ */
+struct zram_comp_strm *zram_comp_strm_find(struct zram_comp *comp)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_entry(comp->idle_strm.next,
+					   struct zram_comp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+
+		if (comp->avail_strm >= comp->max_strm) {
+			comp->strm_waits++;
+			spin_unlock(&comp->strm_lock);
+			wait_event(comp->strm_wait,
+				   !list_empty(&comp->idle_strm));
+			continue;
+		}
+
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		/* We are in the I/O path: must not recurse into swap */
+		zstrm = zram_comp_strm_alloc(comp, GFP_NOIO);
+		if (zstrm)
+			return zstrm;
+
+		spin_lock(&comp->strm_lock);
+		comp->avail_strm--;
+		comp->strm_waits++;
+		spin_unlock(&comp->strm_lock);
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+void zram_comp_strm_release(struct zram_comp *comp,
+			    struct zram_comp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	/* max_strm was lowered while this stream was in use */
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zram_comp_strm_free(zstrm);
+}
+
+void zram_comp_set_max_streams(struct zram_comp *comp, int max_strm)
+{
+	struct zram_comp_strm *zstrm;
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = max_strm;
+	/* Busy streams are freed as they get released */
+	while (comp->avail_strm > max_strm &&
+	       !list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				   struct zram_comp_strm, list);
+		list_del(&zstrm->list);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		zram_comp_strm_free(zstrm);
+		spin_lock(&comp->strm_lock);
+	}
+	spin_unlock(&comp->strm_lock);
+}
+
+u64 zram_comp_strm_waits(struct zram_comp *comp)
+{
+	u64 val;
+
+	spin_lock(&comp->strm_lock);
+	val = comp->strm_waits;
+	spin_unlock(&comp->strm_lock);
+
+	return val;
+}
+
+struct zram_comp *zram_comp_create(const struct zram_backend *backend,
+				   int max_strm)
+{
+	struct zram_comp *comp;
+	struct zram_comp_strm *zstrm;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	comp->backend = backend;
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	comp->max_strm = max_strm;
+
+	zstrm = zram_comp_strm_alloc(comp, GFP_KERNEL);
+	if (!zstrm) {
+		kfree(comp);
+		return NULL;
+	}
+	list_add(&zstrm->list, &comp->idle_strm);
+	comp->avail_strm = 1;
+
+	return comp;
+}
+
+/* Called on device reset, when no writer can hold a stream any more */
+void zram_comp_destroy(struct zram_comp *comp)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				   struct zram_comp_strm, list);
+		list_del(&zstrm->list);
+		zram_comp_strm_free(zstrm);
+	}
+	kfree(comp);
+}
@@ -0,0 +1,82 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_COMP_H_
+#define _ZRAM_COMP_H_
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <asm/page.h>
+
+/*
+ * Compression backend. Every zram device picks one of these
+ * (sysfs node 'comp_algorithm') before it is initialized.
+ */
+struct zram_backend {
+	const char *name;
+	/* size of the scratch memory passed to compress() */
+	size_t workmem_size;
+	int (*compress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *workmem);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len);
+};
+
+/* Scratch state needed to compress one page */
+struct zram_comp_strm {
+	void *workmem;
+	/* compressed output, 2 pages to fit the worst case expansion */
+	void *buffer;
+	struct list_head list;
+};
+
+/*
+ * Pool of compression streams shared by all writers of a device. Streams
+ * are created on demand, up to max_strm of them; when all are busy new
+ * writers sleep on strm_wait until one is released.
+ */
+struct zram_comp {
+	const struct zram_backend *backend;
+	spinlock_t strm_lock;	/* protects all fields below */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;
+	int max_strm;
+	u64 strm_waits;		/* writers that found every stream busy */
+};
+
+extern const struct zram_backend *zram_backend_default(void);
+extern const struct zram_backend *zram_backend_find(const char *name);
+extern ssize_t zram_backend_show(const struct zram_backend *cur, char *buf);
+
+extern struct zram_comp *zram_comp_create(const struct zram_backend *backend,
+					  int max_strm);
+extern void zram_comp_destroy(struct zram_comp *comp);
+extern void zram_comp_set_max_streams(struct zram_comp *comp, int max_strm);
+extern u64 zram_comp_strm_waits(struct zram_comp *comp);
+extern struct zram_comp_strm *zram_comp_strm_find(struct zram_comp *comp);
+extern void zram_comp_strm_release(struct zram_comp *comp,
+				   struct zram_comp_strm *zstrm);
+
+static inline int zram_comp_compress(struct zram_comp *comp,
+				     struct zram_comp_strm *zstrm,
+				     const unsigned char *src, size_t *dst_len)
+{
+	return comp->backend->compress(src, PAGE_SIZE, zstrm->buffer,
+				       dst_len, zstrm->workmem);
+}
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+
+void zram_dedup_init(struct zram *zram)
+{
+	zram->dedup_root = RB_ROOT;
+	spin_lock_init(&zram->dedup_lock);
+}
+
+u32 zram_dedup_checksum(const unsigned char *mem)
+{
+	return jhash2((const u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+/*
+ * Checksums may collide, so a candidate only matches if it decompresses
+ * to exactly the same page. @buf must hold at least PAGE_SIZE bytes.
+ */
+static int zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+				const unsigned char *mem, unsigned char *buf)
+{
+	int ret;
+	size_t len = PAGE_SIZE;
+	unsigned char *cmem;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	ret = zram->backend->decompress(cmem, entry->len, buf, &len);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return !ret && len == PAGE_SIZE && !memcmp(mem, buf, PAGE_SIZE);
+}
+
+/*
+ * Look for an object holding the same content as the page at @mem.
+ * On success, the returned entry has an extra reference for the caller.
+ *
+ * Candidates are compared with dedup_lock held: this keeps them from
+ * going away under us and is cheap since collisions are rare.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, const unsigned char *mem,
+				u32 checksum, unsigned char *buf)
+{
+	struct rb_node *rb_node, *prev;
+	struct zram_entry *entry, *found = NULL;
+
+	spin_lock(&zram->dedup_lock);
+
+	rb_node = zram->dedup_root.rb_node;
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (checksum == entry->checksum)
+			break;
+		if (checksum < entry->checksum)
+			rb_node = rb_node->rb_left;
+		else
+			rb_node = rb_node->rb_right;
+	}
+
+	if (!rb_node)
+		goto out;
+
+	/* Entries with the same checksum are adjacent in the tree */
+	while ((prev = rb_prev(rb_node))) {
+		entry = rb_entry(prev, struct zram_entry, rb_node);
+		if (entry->checksum != checksum)
+			break;
+		rb_node = prev;
+	}
+
+	for (; rb_node; rb_node = rb_next(rb_node)) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (entry->checksum != checksum)
+			break;
+
+		if (zram_dedup_match(zram, entry, mem, buf)) {
+			entry->refcount++;
+			found = entry;
+			break;
+		}
+	}
+
+out:
+	spin_unlock(&zram->dedup_lock);
+	return found;
+}
+
+struct zram_entry *zram_entry_alloc(unsigned long handle, u16 len,
+				gfp_t flags)
+{
+	struct zram_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), flags);
+	if (!entry)
+		return NULL;
+
+	RB_CLEAR_NODE(&entry->rb_node);
+	entry->refcount = 1;
+	entry->handle = handle;
+	entry->len = len;
+
+	return entry;
+}
+
+void zram_dedup_insert(struct zram *zram, struct zram_entry *entry,
+				u32 checksum)
+{
+	struct rb_node **rb_link, *parent = NULL;
+	struct zram_entry *cur;
+
+	entry->checksum = checksum;
+
+	spin_lock(&zram->dedup_lock);
+	rb_link = &zram->dedup_root.rb_node;
+	while (*rb_link) {
+		parent = *rb_link;
+		cur = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < cur->checksum)
+			rb_link = &parent->rb_left;
+		else
+			rb_link = &parent->rb_right;
+	}
+
+	rb_link_node(&entry->rb_node, parent, rb_link);
+	rb_insert_color(&entry->rb_node, &zram->dedup_root);
+	spin_unlock(&zram->dedup_lock);
+}
+
+/*
+ * Drop a reference to @entry. Returns 1 if it was the last one, in
+ * which case the object has been freed, 0 otherwise.
+ */
+int zram_entry_put(struct zram *zram, struct zram_entry *entry)
+{
+	int refcount;
+
+	spin_lock(&zram->dedup_lock);
+	refcount = --entry->refcount;
+	if (!refcount && !RB_EMPTY_NODE(&entry->rb_node))
+		rb_erase(&entry->rb_node, &zram->dedup_root);
+	spin_unlock(&zram->dedup_lock);
+
+	if (refcount)
+		return 0;
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+
+	return 1;
+}
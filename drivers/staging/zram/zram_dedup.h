@@ -0,0 +1,46 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/rbtree.h>
+#include <linux/types.h>
+
+struct zram;
+
+/*
+ * Compressed object shared by all disk pages with the same content.
+ * Only used on devices with 'use_dedup' set; table[index].entry then
+ * points to one of these instead of holding a zsmalloc handle.
+ */
+struct zram_entry {
+	struct rb_node rb_node;	/* in zram->dedup_root, keyed by checksum */
+	u32 checksum;		/* of the uncompressed page */
+	int refcount;		/* protected by zram->dedup_lock */
+	unsigned long handle;	/* zsmalloc handle of the object */
+	u16 len;		/* compressed object size */
+};
+
+void zram_dedup_init(struct zram *zram);
+u32 zram_dedup_checksum(const unsigned char *mem);
+struct zram_entry *zram_dedup_find(struct zram *zram, const unsigned char *mem,
+				u32 checksum, unsigned char *buf);
+struct zram_entry *zram_entry_alloc(unsigned long handle, u16 len,
+				gfp_t flags);
+void zram_dedup_insert(struct zram *zram, struct zram_entry *entry,
+				u32 checksum);
+int zram_entry_put(struct zram *zram, struct zram_entry *entry);
+
+#endif
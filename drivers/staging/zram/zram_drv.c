@@ -25,62 +25,22 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
-#if defined(CONFIG_ZRAM_LZO)
-#include <linux/lzo.h>
-#define WMSIZE		LZO1X_MEM_COMPRESS
-#define COMPRESS(s, sl, d, dl, wm)	\
-	lzo1x_1_compress(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	lzo1x_decompress_safe(s, sl, d, dl)
-#elif defined(CONFIG_ZRAM_SNAPPY)
-#include "../snappy/csnappy.h" /* if built in drivers/staging */
-#define WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
-#define WMSIZE		(1 << WMSIZE_ORDER)
-static int
-snappy_compress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len,
-	void *workmem)
-{
-	const unsigned char *end = csnappy_compress_fragment(
-		src, (uint32_t)src_len, dst, workmem, WMSIZE_ORDER);
-	*dst_len = end - dst;
-	return 0;
-}
-static int
-snappy_decompress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len)
-{
-	uint32_t dst_len_ = (uint32_t)*dst_len;
-	int ret = csnappy_decompress_noheader(src, src_len, dst, &dst_len_);
-	*dst_len = (size_t)dst_len_;
-	return ret;
-}
-#define COMPRESS(s, sl, d, dl, wm)	\
-	snappy_compress_(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	snappy_decompress_(s, sl, d, dl)
-#else
-#error either CONFIG_ZRAM_LZO or CONFIG_ZRAM_SNAPPY must be defined
-#endif
-
-
 /* Globals */
 static int zram_major;
 struct zram *zram_devices;
+static struct workqueue_struct *zram_bd_wq;
+static struct workqueue_struct *zram_async_wq;
 
 /* Module params (documentation at end) */
 unsigned int zram_num_devices;
@@ -132,21 +92,50 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != val)
 			return 0;
 	}
 
+	*element = val;
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned long len,
+			   unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	if (likely(!element)) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	page = (unsigned long *)ptr;
+
+	for (pos = 0; pos != len / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
+/* Only valid for pages stored compressed */
+static unsigned long zram_get_handle(struct zram *zram, u32 index)
+{
+	if (zram->use_dedup)
+		return zram->table[index].entry->handle;
+
+	return zram->table[index].handle;
+}
+
 static u64 zram_default_disksize_bytes(void)
 {
 #if 0
@@ -162,57 +151,101 @@ static void zram_set_disksize(struct zram *zram, u64 size_bytes)
 	set_capacity(zram->disk, size_bytes >> SECTOR_SHIFT);
 }
 
+static void zram_bd_free_block(struct zram *zram, unsigned long blk_idx);
+static void zram_free_page(struct zram *zram, size_t index);
+
+/*
+ * Apply the swap slot frees zram_slot_free_notify() had to defer.
+ * Writers call this before touching the table, so that a late free never
+ * hits data stored after the slot was reused. Call with zram->lock held
+ * for write.
+ */
+static void zram_slot_free_drain(struct zram *zram)
+{
+	struct zram_slot_free *free_rq;
+
+	for (;;) {
+		spin_lock(&zram->slot_free_lock);
+		free_rq = zram->slot_free_rq;
+		if (free_rq)
+			zram->slot_free_rq = free_rq->next;
+		spin_unlock(&zram->slot_free_lock);
+		if (!free_rq)
+			break;
+
+		zram_free_page(zram, free_rq->index);
+		kfree(free_rq);
+	}
+}
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_bd_free_block(zram, zram->table[index].element);
+		zram_stat_dec(&zram->stats.bd_count);
+		zram->table[index].element = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (zram->table[index].element)
+			zram_stat_dec(&zram->stats.pages_same);
+		else
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram->table[index].element = 0;
 		return;
 	}
 
+	if (unlikely(!handle))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
+	if (!zram->use_dedup) {
+		zs_free(zram->mem_pool, handle);
+	} else if (!zram_entry_put(zram, zram->table[index].entry)) {
+		/* Other pages still share this object */
+		zram_stat64_sub(zram, &zram->stats.dup_data_size, clen);
+		clen = 0;
+	}
+
 out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -239,30 +272,175 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+/*
+ * Backing device blocks are page sized. Block 0 is never handed out
+ * so that a written back page never has a zero table entry.
+ */
+static unsigned long zram_bd_alloc_block(struct zram *zram)
+{
+	unsigned long blk_idx = 1;
+
+	do {
+		blk_idx = find_next_zero_bit(zram->bd_bitmap,
+					zram->nr_bd_pages, blk_idx);
+		if (blk_idx >= zram->nr_bd_pages)
+			return 0;
+	} while (test_and_set_bit(blk_idx, zram->bd_bitmap));
+
+	return blk_idx;
+}
+
+static void zram_bd_free_block(struct zram *zram, unsigned long blk_idx)
+{
+	WARN_ON_ONCE(!test_and_clear_bit(blk_idx, zram->bd_bitmap));
+}
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_bd_rw_page(struct zram *zram, struct page *page,
+			   unsigned long blk_idx, int rw)
+{
+	int ret = 0;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	bio->bi_end_io = zram_bd_end_io;
+	bio->bi_private = &done;
+	if (bio_add_page(bio, page, PAGE_SIZE, 0) != PAGE_SIZE) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		ret = -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bd_read {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int ret;
+};
+
+static void zram_bd_read_fn(struct work_struct *work)
+{
+	struct zram_bd_read *req = container_of(work, struct zram_bd_read,
+						work);
+
+	req->ret = zram_bd_rw_page(req->zram, req->page, req->blk_idx, READ);
+}
+
+/*
+ * Reads are issued from zram_make_request(), where generic_make_request()
+ * would only queue our bio until we return. Submit it from zram_bd_wq
+ * and wait for it there instead.
+ */
+static int zram_bd_read_page(struct zram *zram, struct page *page,
+			     unsigned long blk_idx)
+{
+	struct zram_bd_read req;
+
+	req.zram = zram;
+	req.page = page;
+	req.blk_idx = blk_idx;
+	INIT_WORK(&req.work, zram_bd_read_fn);
+	queue_work(zram_bd_wq, &req.work);
+	flush_work(&req.work);
+
+	if (unlikely(req.ret)) {
+		pr_err("Backing device read failed! err=%d, block=%lu\n",
+			req.ret, blk_idx);
+		return req.ret;
+	}
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	return 0;
+}
+
+static int handle_bd_page(struct zram *zram, struct bio_vec *bvec,
+			  u32 index, int offset)
+{
+	int ret;
+	struct page *page = bvec->bv_page, *bd_page;
+	unsigned char *user_mem, *mem;
+	unsigned long blk_idx = zram->table[index].element;
+
+	if (!is_partial_io(bvec) && !bvec->bv_offset) {
+		ret = zram_bd_read_page(zram, page, blk_idx);
+		goto out;
+	}
+
+	bd_page = alloc_page(GFP_NOIO);
+	if (!bd_page)
+		return -ENOMEM;
+
+	ret = zram_bd_read_page(zram, bd_page, blk_idx);
+	if (!ret) {
+		user_mem = kmap_atomic(page, KM_USER0);
+		mem = kmap_atomic(bd_page, KM_USER1);
+		memcpy(user_mem + bvec->bv_offset, mem + offset, bvec->bv_len);
+		kunmap_atomic(mem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+	}
+	__free_page(bd_page);
+
+out:
+	if (ret)
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+	else
+		flush_dcache_page(page);
+	return ret;
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
 	size_t clen;
 	struct page *page;
-	struct zobj_header *zheader;
+	unsigned long handle;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+	/*
+	 * Readers hold zram->lock shared, but all they ever change in
+	 * the flags is this bit, so they cannot corrupt each other.
+	 */
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(bvec, zram->table[index].element);
 		return 0;
 	}
 
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!zram->table[index].handle)) {
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+		handle_same_page(bvec, 0);
 		return 0;
 	}
 
+	if (zram_test_flag(zram, index, ZRAM_WB))
+		return handle_bd_page(zram, bvec, index, offset);
+
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		handle_uncompressed_page(zram, bvec, index, offset);
@@ -283,13 +461,13 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		uncmem = user_mem;
 	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	handle = zram_get_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+
+	ret = zram->backend->decompress(cmem, zram->table[index].size,
+					uncmem, &clen);
 
-	ret = DECOMPRESS(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			uncmem, &clen);
+	zs_unmap_object(zram->mem_pool, handle);
 
 	if (is_partial_io(bvec)) {
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
@@ -297,7 +475,6 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		kfree(uncmem);
 	}
 
-	kunmap_atomic(cmem, KM_USER1);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	/* Should NEVER happen. Return bio error if it does. */
@@ -316,29 +493,45 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 {
 	int ret;
 	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
+	unsigned long handle;
 	unsigned char *cmem;
+	struct page *bd_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_fill_page(mem, PAGE_SIZE, zram->table[index].element);
+		return 0;
+	}
+
+	if (!zram->table[index].handle) {
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		bd_page = alloc_page(GFP_NOIO);
+		if (!bd_page)
+			return -ENOMEM;
+		ret = zram_bd_read_page(zram, bd_page,
+					zram->table[index].element);
+		if (!ret)
+			memcpy(mem, page_address(bd_page), PAGE_SIZE);
+		__free_page(bd_page);
+		return ret;
+	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(zram->table[index].page, KM_USER0);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem, KM_USER0);
 		return 0;
 	}
 
-	ret = DECOMPRESS(cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	handle = zram_get_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	ret = zram->backend->decompress(cmem, zram->table[index].size,
+					mem, &clen);
+	zs_unmap_object(zram->mem_pool, handle);
 
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret)) {
@@ -354,14 +547,16 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
 	size_t clen;
-	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	u32 checksum = 0;
+	unsigned long handle = 0, element;
+	struct zram_comp_strm *zstrm;
+	struct zram_entry *entry = NULL;
+	struct page *page, *page_store = NULL;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	int dup = 0;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -374,20 +569,17 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			ret = -ENOMEM;
 			goto out;
 		}
+		down_read(&zram->lock);
 		ret = zram_read_before_write(zram, uncmem, index);
+		up_read(&zram->lock);
 		if (ret) {
 			kfree(uncmem);
 			goto out;
 		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
+	/* May sleep until another writer is done with its stream */
+	zstrm = zram_comp_strm_find(zram->comp);
 
 	user_mem = kmap_atomic(page, KM_USER0);
 
@@ -397,19 +589,49 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	else
 		uncmem = user_mem;
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
 		if (is_partial_io(bvec))
 			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
+		zram_comp_strm_release(zram->comp, zstrm);
+
+		down_write(&zram->lock);
+		zram_slot_free_drain(zram);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		if (zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_SAME))
+			zram_free_page(zram, index);
+		if (element)
+			zram_stat_inc(&zram->stats.pages_same);
+		else
+			zram_stat_inc(&zram->stats.pages_zero);
+		zram->table[index].element = element;
+		zram_set_flag(zram, index, ZRAM_SAME);
+		up_write(&zram->lock);
 		ret = 0;
 		goto out;
 	}
 
-	COMPRESS(uncmem, PAGE_SIZE, src, &clen,
-		zram->compress_workmem);
-	ret = 0;
+	if (zram->use_dedup) {
+		/* The stream buffer is free until we compress */
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_find(zram, uncmem, checksum,
+					zstrm->buffer);
+		if (entry) {
+			kunmap_atomic(user_mem, KM_USER0);
+			if (is_partial_io(bvec))
+				kfree(uncmem);
+			zram_comp_strm_release(zram->comp, zstrm);
+			clen = entry->len;
+			dup = 1;
+			goto update_table;
+		}
+	}
+
+	ret = zram_comp_compress(zram->comp, zstrm, uncmem, &clen);
 
 	kunmap_atomic(user_mem, KM_USER0);
 	if (is_partial_io(bvec))
@@ -417,7 +639,7 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	if (unlikely(ret != 0)) {
 		pr_err("Compression failed! err=%d\n", ret);
-		goto out;
+		goto out_release;
 	}
 
 	/*
@@ -432,61 +654,277 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			pr_info("Error allocating memory for "
 				"incompressible page: %u\n", index);
 			ret = -ENOMEM;
-			goto out;
+			goto out_release;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
 		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
-	}
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(src, KM_USER0);
+	} else {
+		handle = zs_malloc(zram->mem_pool, clen,
+				   GFP_NOIO | __GFP_HIGHMEM);
+		if (!handle) {
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%zu\n", index, clen);
+			ret = -ENOMEM;
+			goto out_release;
+		}
 
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
-		ret = -ENOMEM;
-		goto out;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		memcpy(cmem, zstrm->buffer, clen);
+		zs_unmap_object(zram->mem_pool, handle);
+
+		if (zram->use_dedup) {
+			entry = zram_entry_alloc(handle, clen, GFP_NOIO);
+			if (!entry) {
+				zs_free(zram->mem_pool, handle);
+				ret = -ENOMEM;
+				goto out_release;
+			}
+			zram_dedup_insert(zram, entry, checksum);
+		}
 	}
 
-memstore:
-	zram->table[index].offset = store_offset;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	zram_comp_strm_release(zram->comp, zstrm);
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
-#endif
+update_table:
+	/*
+	 * Only the table update is serialized: compression above runs
+	 * in parallel on as many streams as the pool allows.
+	 */
+	down_write(&zram->lock);
+	zram_slot_free_drain(zram);
 
-	memcpy(cmem, src, clen);
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	if (zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME))
+		zram_free_page(zram, index);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	if (unlikely(page_store)) {
+		zram->table[index].page = page_store;
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_inc(&zram->stats.pages_expand);
+	} else {
+		if (entry)
+			zram->table[index].entry = entry;
+		else
+			zram->table[index].handle = handle;
+		zram->table[index].size = clen;
+	}
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+	if (dup)
+		zram_stat64_add(zram, &zram->stats.dup_data_size, clen);
+	else
+		zram_stat64_add(zram, &zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
+	up_write(&zram->lock);
+
 	return 0;
 
+out_release:
+	zram_comp_strm_release(zram->comp, zstrm);
 out:
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
 }
 
+/*
+ * Mark all pages held in memory idle. Any access clears the mark, so
+ * pages still marked at the next writeback were not touched since.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	down_write(&zram->lock);
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		if (!zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
+			continue;
+
+		zram_set_flag(zram, index, ZRAM_IDLE);
+	}
+	up_write(&zram->lock);
+}
+
+/*
+ * Move idle or incompressible pages to the backing device, one page
+ * at a time. The device lock is dropped while a page is written, so
+ * the page may be freed or overwritten meanwhile: both clear its
+ * ZRAM_UNDER_WB flag, in which case the copy on disk is dropped.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int ret = 0;
+	size_t index;
+	unsigned long blk_idx = 0;
+	struct page *page;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		if (!blk_idx) {
+			blk_idx = zram_bd_alloc_block(zram);
+			if (!blk_idx) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+
+		down_write(&zram->lock);
+		if (!zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
+			goto next;
+
+		if (mode == ZRAM_WB_IDLE &&
+		    !zram_test_flag(zram, index, ZRAM_IDLE))
+			goto next;
+
+		if (mode == ZRAM_WB_HUGE &&
+		    !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+			goto next;
+
+		if (zram_read_before_write(zram, page_address(page), index))
+			goto next;
+
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		up_write(&zram->lock);
+
+		ret = zram_bd_rw_page(zram, page, blk_idx, WRITE);
+		if (ret) {
+			pr_err("Backing device write failed! err=%d, "
+				"block=%lu\n", ret, blk_idx);
+			down_write(&zram->lock);
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			up_write(&zram->lock);
+			break;
+		}
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+
+		down_write(&zram->lock);
+		if (!zram_test_flag(zram, index, ZRAM_UNDER_WB))
+			goto next;
+
+		zram_free_page(zram, index);
+		zram->table[index].element = blk_idx;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.bd_count);
+		blk_idx = 0;
+next:
+		up_write(&zram->lock);
+	}
+
+	if (blk_idx)
+		zram_bd_free_block(zram, blk_idx);
+	__free_page(page);
+
+	return ret;
+}
+
+void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	bd_release(zram->bdev);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bd_bitmap);
+	kfree(zram->backing_dev_path);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->bd_bitmap = NULL;
+	zram->nr_bd_pages = 0;
+	zram->backing_dev_path = NULL;
+}
+
+/* Must be called with init_lock held for write, before init */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	size_t len;
+	char *name;
+	struct file *file;
+	struct inode *inode;
+	struct block_device *bdev;
+	unsigned long nr_pages, *bitmap;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	/* ignore trailing newline */
+	len = strlen(name);
+	if (len && name[len - 1] == '\n')
+		name[len - 1] = '\0';
+
+	file = filp_open(name, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		goto out_free_name;
+	}
+
+	inode = file->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		ret = -ENOTBLK;
+		goto out_close;
+	}
+
+	bdev = I_BDEV(inode);
+	ret = bd_claim(bdev, zram);
+	if (ret)
+		goto out_close;
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		ret = -EINVAL;
+		goto out_release;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto out_release;
+	}
+
+	zram_reset_backing_dev(zram);
+
+	zram->backing_dev_path = name;
+	zram->backing_dev = file;
+	zram->bdev = bdev;
+	zram->nr_bd_pages = nr_pages;
+	zram->bd_bitmap = bitmap;
+
+	pr_info("Using backing device %s (%lu pages)\n", name,
+		nr_pages);
+	return 0;
+
+out_release:
+	bd_release(bdev);
+out_close:
+	filp_close(file, NULL);
+out_free_name:
+	kfree(name);
+	return ret;
+}
+
 static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 			int offset, struct bio *bio, int rw)
 {
@@ -497,9 +935,7 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
 		up_read(&zram->lock);
 	} else {
-		down_write(&zram->lock);
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
 	}
 
 	return ret;
@@ -567,6 +1003,74 @@ out:
 	bio_io_error(bio);
 }
 
+static void zram_async_fn(struct work_struct *work)
+{
+	int nr;
+	unsigned int gen;
+	struct bio *bio;
+	struct bio_list batch;
+	struct zram_async_work *aw = container_of(work, struct zram_async_work,
+						  work);
+	struct zram *zram = aw->zram;
+
+	for (;;) {
+		bio_list_init(&batch);
+
+		spin_lock(&zram->async_lock);
+		gen = zram->reset_gen;
+		for (nr = 0; nr < ZRAM_ASYNC_BATCH; nr++) {
+			bio = bio_list_pop(&zram->async_bios);
+			if (!bio)
+				break;
+			bio_list_add(&batch, bio);
+		}
+		spin_unlock(&zram->async_lock);
+
+		if (!nr)
+			break;
+
+		/*
+		 * Device may have been reset, and even initialised again,
+		 * since the bios were taken off the list
+		 */
+		down_read(&zram->init_lock);
+		while ((bio = bio_list_pop(&batch))) {
+			if (unlikely(!zram->init_done ||
+				     gen != zram->reset_gen)) {
+				bio_io_error(bio);
+				continue;
+			}
+			__zram_make_request(zram, bio, WRITE);
+		}
+		up_read(&zram->init_lock);
+
+		zram_stat64_add(zram, &zram->stats.async_bios, nr);
+		zram_stat64_inc(zram, &zram->stats.async_batches);
+	}
+}
+
+/*
+ * Hand a write bio over to the async workers. Workers on all online
+ * cpus are kicked in turn, so compression of a burst of writes runs in
+ * parallel and off the submitting cpu. Each bio is completed by the
+ * worker that stores it, once all of its segments are stored.
+ */
+static void zram_queue_write(struct zram *zram, struct bio *bio)
+{
+	int cpu;
+
+	spin_lock(&zram->async_lock);
+	bio_list_add(&zram->async_bios, bio);
+	cpu = cpumask_next(zram->async_cpu, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_online_mask);
+	zram->async_cpu = cpu;
+	spin_unlock(&zram->async_lock);
+
+	queue_work_on(cpu, zram_async_wq,
+		      &per_cpu_ptr(zram->async_work, cpu)->work);
+}
+
 /*
  * Check if request is within bounds and aligned on zram logical blocks.
  */
@@ -602,7 +1106,10 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto error_unlock;
 	}
 
-	__zram_make_request(zram, bio, bio_data_dir(bio));
+	if (zram->async_writes && bio_data_dir(bio) == WRITE)
+		zram_queue_write(zram, bio);
+	else
+		__zram_make_request(zram, bio, bio_data_dir(bio));
 	up_read(&zram->init_lock);
 
 	return 0;
@@ -617,38 +1124,55 @@ error:
 void __zram_reset_device(struct zram *zram)
 {
 	size_t index;
+	struct bio *bio;
+	struct bio_list stale;
 
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	/* Queued writes were meant for the old contents, fail them */
+	bio_list_init(&stale);
+	spin_lock(&zram->async_lock);
+	zram->reset_gen++;
+	bio_list_merge(&stale, &zram->async_bios);
+	bio_list_init(&zram->async_bios);
+	spin_unlock(&zram->async_lock);
+	while ((bio = bio_list_pop(&stale)))
+		bio_io_error(bio);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Deferred slot frees refer to the table about to go away */
+	flush_work(&zram->free_work);
+
+	/* Free various per-device buffers */
+	if (zram->comp) {
+		zram_comp_destroy(zram->comp);
+		zram->comp = NULL;
+	}
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		unsigned long handle = zram->table[index].handle;
 
-		if (!page)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page(zram->table[index].page);
+		else if (zram->use_dedup)
+			zram_entry_put(zram, zram->table[index].entry);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zs_free(zram->mem_pool, handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
-	zram->mem_pool = NULL;
+	zram_reset_backing_dev(zram);
+
+	if (zram->mem_pool) {
+		zs_destroy_pool(zram->mem_pool);
+		zram->mem_pool = NULL;
+	}
 
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
@@ -675,17 +1199,9 @@ int zram_init_device(struct zram *zram)
 		return 0;
 	}
 
-	zram->compress_workmem = kzalloc(WMSIZE, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zram_comp_create(zram->backend, zram->max_comp_streams);
+	if (!zram->comp) {
+		pr_err("Error allocating compression streams\n");
 		ret = -ENOMEM;
 		goto fail_no_table;
 	}
@@ -701,7 +1217,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -725,14 +1241,50 @@ fail:
 	return ret;
 }
 
+static void zram_slot_free_fn(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, free_work);
+
+	down_write(&zram->lock);
+	zram_slot_free_drain(zram);
+	up_write(&zram->lock);
+}
+
+/*
+ * Called with swap_lock held, so this must not sleep. The slot is freed
+ * under zram->lock like everywhere else: right away if the lock is free,
+ * otherwise from free_work.
+ *
+ * A slot that is being written back (ZRAM_UNDER_WB) may be freed too: its
+ * data was copied out before the lock was dropped, and freeing clears
+ * ZRAM_UNDER_WB, which tells zram_writeback() to drop the copy on disk.
+ */
 static void zram_slot_free_notify(struct block_device *bdev,
 				unsigned long index)
 {
 	struct zram *zram;
+	struct zram_slot_free *free_rq;
 
 	zram = bdev->bd_disk->private_data;
-	zram_free_page(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
+
+	if (down_write_trylock(&zram->lock)) {
+		zram_free_page(zram, index);
+		up_write(&zram->lock);
+		return;
+	}
+
+	/* On failure the page stays stored until the slot is rewritten */
+	free_rq = kmalloc(sizeof(*free_rq), GFP_ATOMIC);
+	if (!free_rq)
+		return;
+
+	free_rq->index = index;
+	spin_lock(&zram->slot_free_lock);
+	free_rq->next = zram->slot_free_rq;
+	zram->slot_free_rq = free_rq;
+	spin_unlock(&zram->slot_free_lock);
+	schedule_work(&zram->free_work);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -743,17 +1295,43 @@ static const struct block_device_operations zram_devops = {
 static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
+	int cpu;
 
 	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	zram_dedup_init(zram);
+	zram->backend = zram_backend_default();
+	zram->max_comp_streams = num_online_cpus();
+
+	spin_lock_init(&zram->slot_free_lock);
+	zram->slot_free_rq = NULL;
+	INIT_WORK(&zram->free_work, zram_slot_free_fn);
+
+	spin_lock_init(&zram->async_lock);
+	bio_list_init(&zram->async_bios);
+	zram->async_cpu = -1;
+	zram->async_work = alloc_percpu(struct zram_async_work);
+	if (!zram->async_work) {
+		pr_err("Error allocating async workers for device %d\n",
+			device_id);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct zram_async_work *aw = per_cpu_ptr(zram->async_work, cpu);
+
+		INIT_WORK(&aw->work, zram_async_fn);
+		aw->zram = zram;
+	}
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
 		pr_err("Error allocating disk queue for device %d\n",
 			device_id);
 		ret = -ENOMEM;
-		goto out;
+		goto out_free_async;
 	}
 
 	blk_queue_make_request(zram->queue, zram_make_request);
@@ -766,7 +1344,7 @@ static int create_device(struct zram *zram, int device_id)
 		pr_warning("Error allocating disk structure for device %d\n",
 			device_id);
 		ret = -ENOMEM;
-		goto out;
+		goto out_free_async;
 	}
 
 	zram->disk->major = zram_major;
@@ -806,6 +1384,10 @@ static int create_device(struct zram *zram, int device_id)
 
 out:
 	return ret;
+
+out_free_async:
+	free_percpu(zram->async_work);
+	return ret;
 }
 
 static void destroy_device(struct zram *zram)
@@ -820,6 +1402,11 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	zram_reset_backing_dev(zram);
+
+	/* Queued writes were completed by the flush in zram_exit() */
+	free_percpu(zram->async_work);
 }
 
 static int __init zram_init(void)
@@ -840,11 +1427,23 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_bd_wq = create_workqueue("zram_bd");
+	if (!zram_bd_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	zram_async_wq = create_workqueue("zram_async");
+	if (!zram_async_wq) {
+		ret = -ENOMEM;
+		goto destroy_bd_wq;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	/* Allocate the device array and initialize each one */
@@ -871,6 +1470,10 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_wq:
+	destroy_workqueue(zram_async_wq);
+destroy_bd_wq:
+	destroy_workqueue(zram_bd_wq);
 out:
 	return ret;
 }
@@ -880,6 +1483,8 @@ static void __exit zram_exit(void)
 	int i;
 	struct zram *zram;
 
+	flush_workqueue(zram_async_wq);
+
 	for (i = 0; i < zram_num_devices; i++) {
 		zram = &zram_devices[i];
 
@@ -889,6 +1494,8 @@ static void __exit zram_exit(void)
 	}
 
 	unregister_blkdev(zram_major, "zram");
+	destroy_workqueue(zram_async_wq);
+	destroy_workqueue(zram_bd_wq);
 
 	kfree(zram_devices);
 	pr_debug("Cleanup done!\n");
@@ -15,10 +15,14 @@
 #ifndef _ZRAM_DRV_H_
 #define _ZRAM_DRV_H_
 
+#include <linux/bio.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zram_comp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +30,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -51,8 +43,8 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -66,13 +58,25 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK  \
         (1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
+/* Max. no. of write bios an async worker takes off the queue at once */
+#define ZRAM_ASYNC_BATCH	16
+
 /* Flags for zram pages (table[page_no].flags) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is filled with one repeated word (table[page_no].element) */
+	ZRAM_SAME,
+
+	/* Page was not accessed since the last 'idle' marking */
+	ZRAM_IDLE,
+
+	/* Page is on the backing device (block no. in table[page_no].element) */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -81,8 +85,13 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;	/* zsmalloc handle of the object */
+		struct zram_entry *entry; /* use_dedup: shared object */
+		struct page *page;	/* ZRAM_UNCOMPRESSED: page as-is */
+		unsigned long element;	/* ZRAM_SAME: word filling the page */
+	};
+	u16 size;	/* compressed object size */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
@@ -95,23 +104,63 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 dup_data_size;	/* compressed bytes saved by dedup */
+	u64 bd_reads;		/* no. of pages read from backing device */
+	u64 bd_writes;		/* no. of pages written back */
+	u64 async_bios;		/* no. of writes done by async workers */
+	u64 async_batches;	/* no. of batches they were done in */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of other same filled pages */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 bd_count;		/* no. of pages now on backing device */
+};
+
+/* A swap slot free deferred because zram->lock was busy */
+struct zram_slot_free {
+	unsigned long index;
+	struct zram_slot_free *next;
+};
+
+/* Per-cpu worker draining zram->async_bios */
+struct zram_async_work {
+	struct work_struct work;
+	struct zram *zram;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	const struct zram_backend *backend;
+	struct zram_comp *comp;
+	int max_comp_streams;
 	struct table *table;
+	int use_dedup;
+	struct rb_root dedup_root;	/* zram_entry's by checksum */
+	spinlock_t dedup_lock;	/* protect dedup_root and refcounts */
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
+	struct rw_semaphore lock; /* protect table and 32-bit stats
 				   * against concurrent read and writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
+	/*
+	 * Async mode: write bios are queued on async_bios and compressed
+	 * by per-cpu workers instead of in the submitter's context.
+	 */
+	int async_writes;
+	spinlock_t async_lock;	/* protect async_bios and async_cpu */
+	struct bio_list async_bios;
+	int async_cpu;		/* cpu whose worker was kicked last */
+	unsigned int reset_gen;	/* bumped by reset, under async_lock */
+	struct zram_async_work *async_work;	/* per-cpu */
+	/*
+	 * Swap slot free notifications come in atomic context and cannot
+	 * wait for zram->lock, busy ones are queued here for free_work.
+	 */
+	spinlock_t slot_free_lock;
+	struct zram_slot_free *slot_free_rq;
+	struct work_struct free_work;
 	/* Prevent concurrent execution of device init and reset */
 	struct rw_semaphore init_lock;
 	/*
@@ -120,6 +169,16 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 
+	/*
+	 * Optional block device that idle or incompressible pages can be
+	 * written back to. Set up before init, like disksize.
+	 */
+	char *backing_dev_path;
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned long nr_bd_pages;
+	unsigned long *bd_bitmap;	/* blocks in use; block 0 is unused */
+
 	struct zram_stats stats;
 };
 
@@ -129,7 +188,17 @@ extern unsigned int zram_num_devices;
 extern struct attribute_group zram_disk_attr_group;
 #endif
 
+/* zram_writeback() modes */
+enum zram_wb_mode {
+	ZRAM_WB_IDLE,	/* pages not accessed since zram_mark_idle() */
+	ZRAM_WB_HUGE,	/* pages stored uncompressed */
+};
+
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_reset_backing_dev(struct zram *zram);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
 
 #endif
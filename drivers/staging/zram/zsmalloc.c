@@ -0,0 +1,848 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2011  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * zsmalloc is a slab-like allocator for compressed pages. Objects are
+ * grouped in size classes ZS_SIZE_CLASS_DELTA bytes apart and packed
+ * into zspages of one to ZS_MAX_PAGES_PER_ZSPAGE pages, so there is
+ * little internal fragmentation. Unlike xvmalloc, callers only get an
+ * opaque handle: objects can then be moved by zs_compact() to release
+ * sparsely used zspages back to the system.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct kmem_cache *handle_cachep;
+static struct kmem_cache *zspage_cachep;
+
+static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
+
+static int get_size_class_index(int size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+/*
+ * Pick the number of pages per zspage (up to ZS_MAX_PAGES_PER_ZSPAGE)
+ * that wastes the least space at the end of the zspage.
+ */
+static int get_pages_per_zspage(int class_size)
+{
+	int i, max_usedpc = 0;
+	/* zspage order which gives maximum used size per KB */
+	int max_usedpc_order = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size;
+		int waste, usedpc;
+
+		zspage_size = i * PAGE_SIZE;
+		waste = zspage_size % class_size;
+		usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_order = i;
+		}
+	}
+
+	return max_usedpc_order;
+}
+
+/* Handles */
+
+static unsigned long cache_alloc_handle(gfp_t flags)
+{
+	return (unsigned long)kmem_cache_alloc(handle_cachep,
+					flags & ~__GFP_HIGHMEM);
+}
+
+static void cache_free_handle(unsigned long handle)
+{
+	kmem_cache_free(handle_cachep, (void *)handle);
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle >> OBJ_TAG_BITS;
+}
+
+/* Point an unpinned handle to @obj */
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj << OBJ_TAG_BITS;
+}
+
+/* Point a pinned handle to @obj, keeping it pinned */
+static void move_obj(unsigned long handle, unsigned long obj)
+{
+	unsigned long *p = (unsigned long *)handle;
+
+	*p = (obj << OBJ_TAG_BITS) | (*p & (1UL << HANDLE_PIN_BIT));
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+/* Object locations */
+
+static unsigned long location_to_obj(struct zspage *zspage, int obj_idx)
+{
+	return (page_to_pfn(zspage->pages[0]) << OBJ_INDEX_BITS) |
+		(obj_idx & OBJ_INDEX_MASK);
+}
+
+static struct zspage *obj_to_location(unsigned long obj, int *obj_idx)
+{
+	struct page *first_page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+
+	*obj_idx = obj & OBJ_INDEX_MASK;
+	return (struct zspage *)page_private(first_page);
+}
+
+/* Page and offset within that page of object @obj_idx */
+static struct page *obj_page(struct size_class *class, struct zspage *zspage,
+			int obj_idx, unsigned long *offset)
+{
+	unsigned long off = (unsigned long)obj_idx * class->size;
+
+	*offset = off & ~PAGE_MASK;
+	return zspage->pages[off >> PAGE_SHIFT];
+}
+
+static unsigned long obj_get_header(struct size_class *class,
+			struct zspage *zspage, int obj_idx)
+{
+	unsigned long off, val;
+	struct page *page;
+	void *addr;
+
+	page = obj_page(class, zspage, obj_idx, &off);
+	addr = kmap_atomic(page, KM_USER1);
+	val = *(unsigned long *)(addr + off);
+	kunmap_atomic(addr, KM_USER1);
+
+	return val;
+}
+
+static void obj_set_header(struct size_class *class, struct zspage *zspage,
+			int obj_idx, unsigned long val)
+{
+	unsigned long off;
+	struct page *page;
+	void *addr;
+
+	page = obj_page(class, zspage, obj_idx, &off);
+	addr = kmap_atomic(page, KM_USER1);
+	*(unsigned long *)(addr + off) = val;
+	kunmap_atomic(addr, KM_USER1);
+}
+
+/* Copy a whole object, handle included, between two zspages */
+static void obj_copy(struct size_class *class, struct zspage *dst,
+			int dst_idx, struct zspage *src, int src_idx)
+{
+	unsigned long s_off, d_off;
+	struct page *s_page, *d_page;
+	int written = 0;
+
+	s_page = obj_page(class, src, src_idx, &s_off);
+	d_page = obj_page(class, dst, dst_idx, &d_off);
+
+	while (written < class->size) {
+		void *s_addr, *d_addr;
+		int size = class->size - written;
+
+		size = min_t(int, size, PAGE_SIZE - s_off);
+		size = min_t(int, size, PAGE_SIZE - d_off);
+
+		s_addr = kmap_atomic(s_page, KM_USER0);
+		d_addr = kmap_atomic(d_page, KM_USER1);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		kunmap_atomic(d_addr, KM_USER1);
+		kunmap_atomic(s_addr, KM_USER0);
+
+		written += size;
+		s_off += size;
+		d_off += size;
+		if (s_off == PAGE_SIZE) {
+			s_page = src->pages[((unsigned long)src_idx *
+					class->size + written) >> PAGE_SHIFT];
+			s_off = 0;
+		}
+		if (d_off == PAGE_SIZE) {
+			d_page = dst->pages[((unsigned long)dst_idx *
+					class->size + written) >> PAGE_SHIFT];
+			d_off = 0;
+		}
+	}
+}
+
+/* Fullness groups */
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+			struct zspage *zspage)
+{
+	int inuse = zspage->inuse;
+	int max_objects = class->objs_per_zspage;
+
+	if (inuse == 0)
+		return ZS_EMPTY;
+	if (inuse == max_objects)
+		return ZS_FULL;
+	if (inuse <= max_objects - max_objects / fullness_threshold_frac)
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+static void insert_zspage(struct size_class *class, struct zspage *zspage,
+			enum fullness_group fullness)
+{
+	zspage->fullness = fullness;
+	if (fullness == ZS_EMPTY)
+		return;
+
+	/* Allocations and compaction look at the head of the list */
+	if (fullness == ZS_ALMOST_EMPTY &&
+	    !list_empty(&class->fullness_list[fullness])) {
+		struct zspage *head;
+
+		head = list_first_entry(&class->fullness_list[fullness],
+					struct zspage, list);
+		if (zspage->inuse < head->inuse) {
+			list_add_tail(&zspage->list,
+				&class->fullness_list[fullness]);
+			return;
+		}
+	}
+	list_add(&zspage->list, &class->fullness_list[fullness]);
+}
+
+static void remove_zspage(struct size_class *class, struct zspage *zspage)
+{
+	if (zspage->fullness == ZS_EMPTY)
+		return;
+
+	list_del_init(&zspage->list);
+	zspage->fullness = ZS_EMPTY;
+}
+
+/*
+ * Move @zspage to the list matching its current use and return its new
+ * fullness group. A zspage left in ZS_EMPTY is on no list and must be
+ * freed by the caller.
+ */
+static enum fullness_group fix_fullness_group(struct size_class *class,
+			struct zspage *zspage)
+{
+	enum fullness_group newfg;
+
+	newfg = get_fullness_group(class, zspage);
+	if (newfg == zspage->fullness)
+		goto out;
+
+	remove_zspage(class, zspage);
+	insert_zspage(class, zspage, newfg);
+out:
+	return newfg;
+}
+
+/* zspage allocation */
+
+static void free_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kmem_cache_free(zspage_cachep, zspage);
+
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+			struct size_class *class, gfp_t flags)
+{
+	int i;
+	struct zspage *zspage;
+
+	zspage = kmem_cache_alloc(zspage_cachep, flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	memset(zspage, 0, sizeof(*zspage));
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class_idx = class->index;
+	zspage->fullness = ZS_EMPTY;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page;
+
+		page = alloc_page(flags);
+		if (!page)
+			goto fail;
+
+		/* Lets objects find their zspage from the page's pfn */
+		set_page_private(page, (unsigned long)zspage);
+		zspage->pages[i] = page;
+	}
+
+	/* Link all objects into the free list */
+	for (i = 0; i < class->objs_per_zspage; i++)
+		obj_set_header(class, zspage, i,
+			(unsigned long)(i + 1) << OBJ_TAG_BITS);
+	zspage->freeobj = 0;
+
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+	return zspage;
+
+fail:
+	while (i--) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kmem_cache_free(zspage_cachep, zspage);
+	return NULL;
+}
+
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	if (!list_empty(&class->fullness_list[ZS_ALMOST_FULL]))
+		return list_first_entry(&class->fullness_list[ZS_ALMOST_FULL],
+					struct zspage, list);
+	if (!list_empty(&class->fullness_list[ZS_ALMOST_EMPTY]))
+		return list_first_entry(&class->fullness_list[ZS_ALMOST_EMPTY],
+					struct zspage, list);
+	return NULL;
+}
+
+/* Take a free object out of @zspage and tag it with @handle */
+static unsigned long obj_malloc(struct size_class *class,
+			struct zspage *zspage, unsigned long handle)
+{
+	int obj_idx = zspage->freeobj;
+	unsigned long next;
+
+	next = obj_get_header(class, zspage, obj_idx);
+	obj_set_header(class, zspage, obj_idx, handle | OBJ_ALLOCATED_TAG);
+
+	zspage->freeobj = next >> OBJ_TAG_BITS;
+	zspage->inuse++;
+	class->objs_inuse++;
+
+	return location_to_obj(zspage, obj_idx);
+}
+
+static void obj_free(struct size_class *class, struct zspage *zspage,
+			int obj_idx)
+{
+	obj_set_header(class, zspage, obj_idx,
+		(unsigned long)zspage->freeobj << OBJ_TAG_BITS);
+
+	zspage->freeobj = obj_idx;
+	zspage->inuse--;
+	class->objs_inuse--;
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ *
+ * Returns NULL on failure.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i, fg;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int size;
+		struct size_class *class = &pool->size_class[i];
+
+		size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		if (size > ZS_MAX_ALLOC_SIZE)
+			size = ZS_MAX_ALLOC_SIZE;
+
+		spin_lock_init(&class->lock);
+		class->index = i;
+		class->size = size;
+		class->pages_per_zspage = get_pages_per_zspage(size);
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / size;
+		for (fg = 0; fg < NR_ZS_FULLNESS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+	}
+
+	atomic_long_set(&pool->pages_allocated, 0);
+	atomic_long_set(&pool->pages_compacted, 0);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, fg;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		for (fg = 0; fg < NR_ZS_FULLNESS; fg++) {
+			struct zspage *zspage, *tmp;
+
+			list_for_each_entry_safe(zspage, tmp,
+					&class->fullness_list[fg], list) {
+				pr_info("Freeing non-empty class %d, "
+					"fullness group %d\n", i, fg);
+				list_del(&zspage->list);
+				free_zspage(pool, class, zspage);
+			}
+		}
+	}
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @flags: flags used to allocate backing pages
+ *
+ * Returns a handle to the allocated object, or 0 on failure. The
+ * object must be mapped with zs_map_object() to be accessed.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	unsigned long handle, obj;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	size += ZS_HANDLE_SIZE;
+	if (unlikely(size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = cache_alloc_handle(flags);
+	if (!handle)
+		return 0;
+
+	class = &pool->size_class[get_size_class_index(size)];
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class, flags);
+		if (unlikely(!zspage)) {
+			cache_free_handle(handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		class->zspages++;
+	}
+
+	obj = obj_malloc(class, zspage, handle);
+	record_obj(handle, obj);
+	fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+
+	return handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	int obj_idx;
+	struct zspage *zspage;
+	struct size_class *class;
+	enum fullness_group fullness;
+
+	if (unlikely(!handle))
+		return;
+
+	/* Keeps compaction from moving the object under us */
+	pin_tag(handle);
+	zspage = obj_to_location(handle_to_obj(handle), &obj_idx);
+	class = &pool->size_class[zspage->class_idx];
+
+	spin_lock(&class->lock);
+	obj_free(class, zspage, obj_idx);
+	fullness = fix_fullness_group(class, zspage);
+	if (fullness == ZS_EMPTY)
+		class->zspages--;
+	spin_unlock(&class->lock);
+	unpin_tag(handle);
+
+	if (fullness == ZS_EMPTY)
+		free_zspage(pool, class, zspage);
+
+	cache_free_handle(handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: mapping mode to use
+ *
+ * The object stays pinned, and preemption disabled, until the matching
+ * zs_unmap_object(). Only KM_USER1 is used to map pages, so callers may
+ * keep a KM_USER0 mapping across the call.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	int obj_idx;
+	unsigned long off;
+	struct page *page;
+	struct zspage *zspage;
+	struct size_class *class;
+	struct mapping_area *area;
+	void *ret;
+
+	BUG_ON(!handle);
+
+	pin_tag(handle);
+	zspage = obj_to_location(handle_to_obj(handle), &obj_idx);
+	class = &pool->size_class[zspage->class_idx];
+	page = obj_page(class, zspage, obj_idx, &off);
+
+	area = &get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
+	if (off + class->size <= PAGE_SIZE) {
+		/* this object is contained entirely within a page */
+		area->vm_addr = kmap_atomic(page, KM_USER1);
+		ret = area->vm_addr + off;
+	} else {
+		/* this object spans two pages, copy it to vm_buf */
+		area->vm_addr = NULL;
+		ret = area->vm_buf;
+		if (mm != ZS_MM_WO) {
+			int size = PAGE_SIZE - off;
+			void *addr;
+
+			addr = kmap_atomic(page, KM_USER1);
+			memcpy(ret, addr + off, size);
+			kunmap_atomic(addr, KM_USER1);
+
+			addr = kmap_atomic(zspage->pages[(obj_idx *
+				class->size >> PAGE_SHIFT) + 1], KM_USER1);
+			memcpy(ret + size, addr, class->size - size);
+			kunmap_atomic(addr, KM_USER1);
+		}
+	}
+
+	return ret + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	int obj_idx;
+	unsigned long off;
+	struct page *page;
+	struct zspage *zspage;
+	struct size_class *class;
+	struct mapping_area *area;
+
+	area = &__get_cpu_var(zs_map_area);
+	if (area->vm_addr) {
+		kunmap_atomic(area->vm_addr, KM_USER1);
+		goto out;
+	}
+
+	if (area->vm_mm != ZS_MM_RO) {
+		int size;
+		void *addr;
+
+		zspage = obj_to_location(handle_to_obj(handle), &obj_idx);
+		class = &pool->size_class[zspage->class_idx];
+		page = obj_page(class, zspage, obj_idx, &off);
+		size = PAGE_SIZE - off;
+
+		/* The handle itself never changes, skip copying it back */
+		addr = kmap_atomic(page, KM_USER1);
+		memcpy(addr + off + ZS_HANDLE_SIZE,
+			area->vm_buf + ZS_HANDLE_SIZE,
+			size - ZS_HANDLE_SIZE);
+		kunmap_atomic(addr, KM_USER1);
+
+		addr = kmap_atomic(zspage->pages[(obj_idx *
+			class->size >> PAGE_SHIFT) + 1], KM_USER1);
+		memcpy(addr, area->vm_buf + size, class->size - size);
+		kunmap_atomic(addr, KM_USER1);
+	}
+
+out:
+	put_cpu_var(zs_map_area);
+	unpin_tag(handle);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/* Compaction */
+
+/*
+ * Isolate a zspage to move objects out of (@source) or into. Sources
+ * are taken from the emptiest zspages, destinations from the fullest.
+ */
+static struct zspage *isolate_zspage(struct size_class *class, int source)
+{
+	int i;
+	struct zspage *zspage;
+	enum fullness_group fg[2] = { ZS_ALMOST_EMPTY, ZS_ALMOST_FULL };
+
+	if (!source) {
+		fg[0] = ZS_ALMOST_FULL;
+		fg[1] = ZS_ALMOST_EMPTY;
+	}
+
+	for (i = 0; i < 2; i++) {
+		struct list_head *head = &class->fullness_list[fg[i]];
+
+		if (list_empty(head))
+			continue;
+
+		if (source)
+			zspage = list_entry(head->prev, struct zspage, list);
+		else
+			zspage = list_first_entry(head, struct zspage, list);
+		remove_zspage(class, zspage);
+		return zspage;
+	}
+
+	return NULL;
+}
+
+/*
+ * Move objects from @src to @dst until one of them is empty or full.
+ * Objects currently pinned (mapped or being freed) are skipped.
+ * Returns -EAGAIN if any object was skipped.
+ */
+static int migrate_zspage(struct size_class *class, struct zspage *src,
+			struct zspage *dst)
+{
+	int obj_idx, ret = 0;
+
+	for (obj_idx = 0; obj_idx < class->objs_per_zspage; obj_idx++) {
+		unsigned long header, handle, obj;
+		int new_idx;
+
+		if (!src->inuse || dst->inuse == class->objs_per_zspage)
+			break;
+
+		header = obj_get_header(class, src, obj_idx);
+		if (!(header & OBJ_ALLOCATED_TAG))
+			continue;
+
+		handle = header & ~OBJ_ALLOCATED_TAG;
+		if (!trypin_tag(handle)) {
+			ret = -EAGAIN;
+			continue;
+		}
+
+		new_idx = dst->freeobj;
+		obj = obj_malloc(class, dst, handle);
+		obj_copy(class, dst, new_idx, src, obj_idx);
+		move_obj(handle, obj);
+		unpin_tag(handle);
+
+		obj_free(class, src, obj_idx);
+	}
+
+	return ret;
+}
+
+/* Number of zspages that could be freed by packing the class tightly */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+
+	obj_wasted = class->zspages * class->objs_per_zspage -
+			class->objs_inuse;
+
+	return obj_wasted / class->objs_per_zspage;
+}
+
+static unsigned long zs_compact_class(struct zs_pool *pool,
+			struct size_class *class)
+{
+	struct zspage *src, *dst;
+	unsigned long freed = 0;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class)) {
+		int busy = 0;
+
+		src = isolate_zspage(class, 1);
+		if (!src)
+			break;
+
+		while (src->inuse) {
+			dst = isolate_zspage(class, 0);
+			if (!dst)
+				break;
+
+			if (migrate_zspage(class, src, dst))
+				busy = 1;
+			fix_fullness_group(class, dst);
+			if (busy)
+				break;
+		}
+
+		if (fix_fullness_group(class, src) != ZS_EMPTY) {
+			/* Could not empty it, nothing else will do better */
+			break;
+		}
+
+		class->zspages--;
+		free_zspage(pool, class, src);
+		freed += class->pages_per_zspage;
+
+		/* Let allocations and frees of this class through */
+		spin_unlock(&class->lock);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Move objects to release sparsely used zspages.
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--)
+		freed += zs_compact_class(pool, &pool->size_class[i]);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+u64 zs_get_compacted_pages(struct zs_pool *pool)
+{
+	return atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_compacted_pages);
+
+static void zs_free_map_areas(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = &per_cpu(zs_map_area, cpu);
+
+		kfree(area->vm_buf);
+		area->vm_buf = NULL;
+	}
+}
+
+static int __init zs_init(void)
+{
+	int cpu;
+
+	handle_cachep = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					0, 0, NULL);
+	zspage_cachep = kmem_cache_create("zspage", sizeof(struct zspage),
+					0, 0, NULL);
+	if (!handle_cachep || !zspage_cachep)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = &per_cpu(zs_map_area, cpu);
+
+		area->vm_buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->vm_buf)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	zs_free_map_areas();
+	if (zspage_cachep)
+		kmem_cache_destroy(zspage_cachep);
+	if (handle_cachep)
+		kmem_cache_destroy(handle_cachep);
+	return -ENOMEM;
+}
+
+static void __exit zs_exit(void)
+{
+	zs_free_map_areas();
+	kmem_cache_destroy(zspage_cachep);
+	kmem_cache_destroy(handle_cachep);
+}
+
+module_init(zs_init);
+module_exit(zs_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_AUTHOR("Nitin Gupta <ngupta@vflare.org>");
@@ -0,0 +1,129 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2011  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <asm/atomic.h>
+
+/*
+ * A zspage is a group of up to ZS_MAX_PAGES_PER_ZSPAGE 0-order pages
+ * holding objects of a single size class back to back; an object may
+ * straddle two of its pages. Grouping pages this way keeps the space
+ * wasted at the end of each zspage small for every class size.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/*
+ * Every object starts with its handle (tagged with OBJ_ALLOCATED_TAG),
+ * which lets compaction find the handle of an object it moves. Free
+ * objects store the index of the next free object there instead.
+ */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+#define OBJ_ALLOCATED_TAG	1
+
+/*
+ * A handle points to a word holding the location of its object, shifted
+ * left by OBJ_TAG_BITS. Bit HANDLE_PIN_BIT is a bit spinlock held while
+ * the object is mapped or being freed, so compaction leaves it alone.
+ */
+#define OBJ_TAG_BITS		1
+#define HANDLE_PIN_BIT		0
+
+#ifndef MAX_PHYSMEM_BITS
+#ifdef CONFIG_HIGHMEM64G
+#define MAX_PHYSMEM_BITS	36
+#else
+#define MAX_PHYSMEM_BITS	BITS_PER_LONG
+#endif
+#endif
+
+/* Object location: pfn of the zspage's first page and object index */
+#define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
+#define OBJ_INDEX_BITS		(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
+#define OBJ_INDEX_MASK		((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
+
+#define ZS_MIN_ALLOC_SIZE \
+	MAX(32, (ZS_MAX_PAGES_PER_ZSPAGE << PAGE_SHIFT >> OBJ_INDEX_BITS))
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are ZS_SIZE_CLASS_DELTA bytes apart. Keeping it a
+ * multiple of ZS_HANDLE_SIZE means an object header never straddles
+ * a page boundary.
+ */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		(DIV_ROUND_UP(ZS_MAX_ALLOC_SIZE - \
+				ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA) + 1)
+
+#define MAX(a, b) ((a) >= (b) ? (a) : (b))
+
+/*
+ * Zspages of a class are kept on lists according to how full they are.
+ * Allocation prefers fuller zspages; compaction moves objects out of
+ * the emptiest ones. Empty zspages are freed right away.
+ */
+enum fullness_group {
+	ZS_EMPTY,
+	ZS_ALMOST_EMPTY,
+	ZS_ALMOST_FULL,
+	ZS_FULL,
+	NR_ZS_FULLNESS,
+};
+
+/* zspages with at most this fraction of objects in use are almost empty */
+static const int fullness_threshold_frac = 4;
+
+struct zspage {
+	struct list_head list;	/* in size_class fullness list */
+	int class_idx;
+	enum fullness_group fullness;
+	int inuse;		/* objects in use */
+	int freeobj;		/* first free object, objs_per_zspage if none */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+struct size_class {
+	spinlock_t lock;	/* protects all fields below and its zspages */
+	int index;
+	int size;		/* object size, including the handle */
+	int pages_per_zspage;
+	int objs_per_zspage;
+	struct list_head fullness_list[NR_ZS_FULLNESS];
+
+	/* stats */
+	unsigned long zspages;
+	unsigned long objs_inuse;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+};
+
+/*
+ * Per-cpu buffer used to map an object straddling two pages: it is
+ * copied in at map time and back out at unmap time.
+ */
+struct mapping_area {
+	char *vm_buf;
+	char *vm_addr;		/* address of kmap_atomic()'ed page */
+	enum zs_mapmode vm_mm;
+};
+
+#endif
@@ -1089,6 +1089,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 	}
 
 	task->signal->oom_adj = oom_adjust;
+	lowmem_index_adj(task);
 
 	unlock_task_sighand(task, &flags);
 	put_task_struct(task);
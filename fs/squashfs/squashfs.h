@@ -36,6 +36,17 @@ static inline struct squashfs_inode_info *squashfs_i(struct inode *inode)
 extern int squashfs_read_data(struct super_block *, void **, u64, int, u64 *,
 				int, int);
 
+/* decompressor.c */
+extern const struct squashfs_decompressor *squashfs_lookup_decompressor(int);
+extern void *squashfs_decompressor_setup(struct super_block *, unsigned short);
+
+/* decompressor_xxx.c */
+extern void *squashfs_decompressor_create(struct squashfs_sb_info *, void *);
+extern void squashfs_decompressor_destroy(struct squashfs_sb_info *);
+extern int squashfs_decompress(struct squashfs_sb_info *, void **,
+				struct buffer_head **, int, int, int, int, int);
+extern int squashfs_max_decompressors(void);
+
 /* cache.c */
 extern struct squashfs_cache *squashfs_cache_init(char *, int, int);
 extern void squashfs_cache_delete(struct squashfs_cache *);
@@ -57,14 +57,14 @@ struct squashfs_sb_info {
 	struct squashfs_cache	*block_cache;
 	struct squashfs_cache	*fragment_cache;
 	struct squashfs_cache	*read_page;
+	const struct squashfs_decompressor *decompressor;
 	int			next_meta_index;
 	__le64			*id_table;
 	__le64			*fragment_index;
 	unsigned int		*fragment_index_2;
-	struct mutex		read_data_mutex;
 	struct mutex		meta_index_mutex;
 	struct meta_index	*meta_index;
-	z_stream		stream;
+	void			*stream;
 	__le64			*inode_lookup_table;
 	u64			inode_table;
 	u64			directory_table;
@@ -35,10 +35,14 @@
 
 #include "yaffs_ecc.h"
 
+#include <linux/ktime.h>
+
 /* Forward declarations */
 
 static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 			     const u8 *buffer, int n_bytes, int use_reserve);
+static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk,
+			     u8 *buffer);
 
 
 
@@ -140,6 +144,7 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev)
 {
 	int i;
 
+	spin_lock(&dev->rd_lock);
 	dev->temp_in_use++;
 	if (dev->temp_in_use > dev->max_temp)
 		dev->max_temp = dev->temp_in_use;
@@ -147,17 +152,19 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev)
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->temp_buffer[i].in_use == 0) {
 			dev->temp_buffer[i].in_use = 1;
+			spin_unlock(&dev->rd_lock);
 			return dev->temp_buffer[i].buffer;
 		}
 	}
 
-	yaffs_trace(YAFFS_TRACE_BUFFERS, "Out of temp buffers");
 	/*
 	 * If we got here then we have to allocate an unmanaged one
 	 * This is not good.
 	 */
-
 	dev->unmanaged_buffer_allocs++;
+	spin_unlock(&dev->rd_lock);
+
+	yaffs_trace(YAFFS_TRACE_BUFFERS, "Out of temp buffers");
 	return kmalloc(dev->data_bytes_per_chunk, GFP_NOFS);
 
 }
@@ -166,20 +173,25 @@ void yaffs_release_temp_buffer(struct yaffs_dev *dev, u8 *buffer)
 {
 	int i;
 
+	spin_lock(&dev->rd_lock);
 	dev->temp_in_use--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->temp_buffer[i].buffer == buffer) {
 			dev->temp_buffer[i].in_use = 0;
+			spin_unlock(&dev->rd_lock);
 			return;
 		}
 	}
 
+	if (buffer)
+		dev->unmanaged_buffer_deallocs++;
+	spin_unlock(&dev->rd_lock);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		yaffs_trace(YAFFS_TRACE_BUFFERS, "Releasing unmanaged temp buffer");
 		kfree(buffer);
-		dev->unmanaged_buffer_deallocs++;
 	}
 
 }
@@ -1364,10 +1376,22 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache
  *   provides write buffering.
  *
- *   There are a small number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   The cache is split into sets of YAFFS_CACHE_WAYS entries. A chunk hashes
+ *   to one set, so a lookup only looks at that set, and each set keeps its
+ *   entries in LRU order. Whole-object operations (flush, invalidate) still
+ *   walk every entry, they are rare next to lookups.
  */
 
+static inline struct list_head *yaffs_cache_set(struct yaffs_dev *dev,
+						const struct yaffs_obj *obj,
+						int chunk_id)
+{
+	/* Consecutive chunks of a file land in consecutive sets */
+	u32 hash = (u32) obj->obj_id * 0x9e370001U + chunk_id;
+
+	return &dev->cache_lru[hash % dev->cache_n_sets];
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
@@ -1454,72 +1478,57 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 
 }
 
-/* Grab us a cache chunk for use.
+/* Grab us a cache chunk for use, in the set the chunk belongs to.
  * First look for an empty one.
  * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Then, if allowed to, flush the object owning the least recently used dirty
+ * one and look again.
  */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
+static struct yaffs_cache *yaffs_grab_chunk_worker(struct list_head *set)
 {
-	int i;
+	struct yaffs_cache *cache;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
+	list_for_each_entry(cache, set, lru) {
+		if (!cache->object)
+			return cache;
 	}
 	return NULL;
 }
 
-static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
+static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_obj *obj,
+						  int chunk_id, int may_flush)
 {
+	struct yaffs_dev *dev = obj->my_dev;
+	struct list_head *set;
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
+	struct yaffs_cache *victim = NULL;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	/* Try find a non-dirty one... */
+	set = yaffs_cache_set(dev, obj, chunk_id);
 
-	cache = yaffs_grab_chunk_worker(dev);
-
-	if (!cache) {
-		/* They were all dirty, find the LRU object and flush
-		 * its cache, then  find again.
-		 * NB what's here is not very accurate,
-		 * we actually flush the object with the LRU chunk.
-		 */
+	cache = yaffs_grab_chunk_worker(set);
+	if (cache)
+		return cache;
 
-		/* With locking we can't assume we can use entry zero,
-		 * Set the_obj to a valid pointer for Coverity. */
-		the_obj = dev->cache[0].object;
-		usage = -1;
-		cache = NULL;
-		pushout = -1;
+	list_for_each_entry_reverse(cache, set, lru) {
+		if (cache->locked)
+			continue;
+		if (!cache->dirty)
+			return cache;
+		if (!victim)
+			victim = cache;
+	}
 
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object &&
-			    !dev->cache[i].locked &&
-			    (dev->cache[i].last_use < usage ||
-			    !cache)) {
-				usage = dev->cache[i].last_use;
-				the_obj = dev->cache[i].object;
-				cache = &dev->cache[i];
-				pushout = i;
-			}
-		}
+	if (!victim || !may_flush)
+		return NULL;
 
-		if (!cache || cache->dirty) {
-			/* Flush and try again */
-			yaffs_flush_file_cache(the_obj);
-			cache = yaffs_grab_chunk_worker(dev);
-		}
-	}
-	return cache;
+	/* Flush and try again.
+	 * NB we flush the whole object that owns the LRU dirty chunk.
+	 */
+	yaffs_flush_file_cache(victim->object);
+	return yaffs_grab_chunk_worker(set);
 }
 
 /* Find a cached chunk */
@@ -1527,41 +1536,27 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct yaffs_cache *cache;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	for (i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].object == obj &&
-		    dev->cache[i].chunk_id == chunk_id) {
-			dev->cache_hits++;
-
-			return &dev->cache[i];
-		}
+	list_for_each_entry(cache, yaffs_cache_set(dev, obj, chunk_id), lru) {
+		if (cache->object == obj && cache->chunk_id == chunk_id)
+			return cache;
 	}
 	return NULL;
 }
 
-/* Mark the chunk for the least recently used algorithym */
+/* Mark the chunk as the most recently used in its set */
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
-	int i;
-
 	if (dev->param.n_caches < 1)
 		return;
 
-	if (dev->cache_last_use < 0 ||
-		dev->cache_last_use > 100000000) {
-		/* Reset the cache usages */
-		for (i = 1; i < dev->param.n_caches; i++)
-			dev->cache[i].last_use = 0;
-
-		dev->cache_last_use = 0;
-	}
-	dev->cache_last_use++;
-	cache->last_use = dev->cache_last_use;
+	list_move(&cache->lru, yaffs_cache_set(dev, cache->object,
+					       cache->chunk_id));
 
 	if (is_write)
 		cache->dirty = 1;
@@ -2709,12 +2704,15 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 			threshold = background ? (dev->gc_not_done + 2) * 2 : 0;
 			if (threshold < YAFFS_GC_PASSIVE_THRESHOLD)
 				threshold = YAFFS_GC_PASSIVE_THRESHOLD;
-			if (threshold > max_threshold)
+			if (threshold > max_threshold || background > 1)
 				threshold = max_threshold;
 
 			iterations = n_blocks / 16 + 1;
 			if (iterations > 100)
 				iterations = 100;
+			if (background > 1)
+				/* Idle, nobody is waiting: look everywhere */
+				iterations = n_blocks;
 		}
 
 		for (i = 0;
@@ -2776,6 +2774,8 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 		dev->n_gc_blocks++;
 		if (background)
 			dev->bg_gcs++;
+		if (background > 1)
+			dev->idle_gcs++;
 
 		dev->gc_dirtiest = 0;
 		dev->gc_pages_in_use = 0;
@@ -2802,6 +2802,10 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
  *
  * The idea is to help clear out space in a more spread-out manner.
  * Dunno if it really does anything useful.
+ *
+ * background is 0 for gc done on behalf of a writer, 1 for the background
+ * thread and 2 for the background thread when the system is idle. Idle gc
+ * is passive but takes whole blocks and looks over the whole array.
  */
 static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 {
@@ -2811,6 +2815,9 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	int min_erased;
 	int erased_chunks;
 	int checkpt_block_adjust;
+	int stalled = 0;
+	ktime_t start = ktime_set(0, 0);
+	u32 stall_us;
 
 	if (dev->param.gc_control && (dev->param.gc_control(dev) & 1) == 0)
 		return YAFFS_OK;
@@ -2878,7 +2885,12 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 				"yaffs: GC n_erased_blocks %d aggressive %d",
 				dev->n_erased_blocks, aggressive);
 
-			gc_ok = yaffs_gc_block(dev, dev->gc_block, aggressive);
+			if (!background && !stalled) {
+				stalled = 1;
+				start = ktime_get();
+			}
+			gc_ok = yaffs_gc_block(dev, dev->gc_block,
+					       aggressive || background > 1);
 		}
 
 		if (dev->n_erased_blocks < (dev->param.n_reserved_blocks) &&
@@ -2891,12 +2903,22 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	} while ((dev->n_erased_blocks < dev->param.n_reserved_blocks) &&
 		 (dev->gc_block > 0) && (max_tries < 2));
 
+	if (stalled) {
+		/* A writer waited for this */
+		stall_us = ktime_us_delta(ktime_get(), start);
+		dev->fg_gc_stalls++;
+		dev->fg_gc_stall_us += stall_us;
+		if (stall_us > dev->fg_gc_stall_max_us)
+			dev->fg_gc_stall_max_us = stall_us;
+	}
+
 	return aggressive ? gc_ok : YAFFS_OK;
 }
 
 /*
  * yaffs_bg_gc()
  * Garbage collects. Intended to be called from a background thread.
+ * An urgency of YAFFS_BG_GC_IDLE collects harder, see yaffs_check_gc().
  * Returns non-zero if at least half the free chunks are erased.
  */
 int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
@@ -2905,7 +2927,7 @@ int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
 
 	yaffs_trace(YAFFS_TRACE_BACKGROUND, "Background gc %u", urgency);
 
-	yaffs_check_gc(dev, 1);
+	yaffs_check_gc(dev, (urgency >= YAFFS_BG_GC_IDLE) ? 2 : 1);
 	return erased_chunks > dev->n_free_chunks / 2;
 }
 
@@ -3032,6 +3054,7 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 	    yaffs_write_new_chunk(dev, buffer, &new_tags, use_reserve);
 
 	if (new_chunk_id > 0) {
+		dev->n_user_writes++;
 		yaffs_put_chunk_in_file(in, inode_chunk, new_chunk_id, 0);
 
 		if (prev_chunk_id > 0)
@@ -3172,11 +3195,18 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 	int result;
 	int alloc_failed = 0;
 
-	if (!in || !in->lazy_loaded || in->hdr_chunk < 1)
+	if (!in || !in->lazy_loaded || in->hdr_chunk < 1) {
+		/* Pairs with the smp_wmb() below for shared readers */
+		smp_rmb();
 		return;
+	}
 
 	dev = in->my_dev;
-	in->lazy_loaded = 0;
+	mutex_lock(&dev->load_lock);
+	if (!in->lazy_loaded) {
+		mutex_unlock(&dev->load_lock);
+		return;
+	}
 	buf = yaffs_get_temp_buffer(dev);
 
 	result = yaffs_rd_chunk_tags_nand(dev, in->hdr_chunk, buf, &tags);
@@ -3193,6 +3223,11 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 			alloc_failed = 1;	/* Not returned */
 	}
 	yaffs_release_temp_buffer(dev, buf);
+
+	/* Only let the details be seen once they are all filled in */
+	smp_wmb();
+	in->lazy_loaded = 0;
+	mutex_unlock(&dev->load_lock);
 }
 
 static void yaffs_load_name_from_oh(struct yaffs_dev *dev, YCHAR *name,
@@ -3391,6 +3426,7 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
 	if (new_chunk_id < 0)
 		return new_chunk_id;
 
+	dev->n_user_writes++;
 	in->hdr_chunk = new_chunk_id;
 
 	if (prev_chunk_id > 0)
@@ -3422,7 +3458,13 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
  * Curve-balls: the first chunk might also be the last chunk.
  */
 
-int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
+/* Readers may run concurrently with each other, but writers must be excluded
+ * by the caller. Readers take turns at the chunk cache, since they fill it
+ * as well as read it. cache_hits and cache_misses count the chunks read,
+ * whether they then go through the cache or not.
+ */
+int yaffs_file_rd_shared(struct yaffs_obj *in, u8 * buffer, loff_t offset,
+			 int n_bytes)
 {
 	int chunk;
 	u32 start;
@@ -3446,22 +3488,31 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 		else
 			n_copy = dev->data_bytes_per_chunk - start;
 
+		mutex_lock(&dev->cache_lock);
 		cache = yaffs_find_chunk_cache(in, chunk);
+		if (cache)
+			dev->cache_hits++;
+		else
+			dev->cache_misses++;
 
 		/* If the chunk is already in the cache or it is less than
 		 * a whole chunk or we're using inband tags then use the cache
 		 * (if there is caching) else bypass the cache.
 		 */
-		if (cache || n_copy != dev->data_bytes_per_chunk ||
-		    dev->param.inband_tags) {
-			if (dev->param.n_caches > 0) {
-
-				/* If we can't find the data in the cache,
-				 * then load it up. */
+		if (!cache && (n_copy == dev->data_bytes_per_chunk &&
+			       !dev->param.inband_tags)) {
+			mutex_unlock(&dev->cache_lock);
 
-				if (!cache) {
-					cache =
-					    yaffs_grab_chunk_cache(in->my_dev);
+			/* A full chunk. Read directly into the buffer. */
+			yaffs_rd_data_obj(in, chunk, buffer);
+		} else {
+			/* If we can't find the data in the cache, then load
+			 * it up. Readers cannot write, so they never flush a
+			 * dirty chunk to make room.
+			 */
+			if (!cache) {
+				cache = yaffs_grab_chunk_cache(in, chunk, 0);
+				if (cache) {
 					cache->object = in;
 					cache->chunk_id = chunk;
 					cache->dirty = 0;
@@ -3470,29 +3521,28 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 							  cache->data);
 					cache->n_bytes = 0;
 				}
+			}
 
+			if (cache) {
 				yaffs_use_cache(dev, cache, 0);
-
-				cache->locked = 1;
-
 				memcpy(buffer, &cache->data[start], n_copy);
-
-				cache->locked = 0;
+				mutex_unlock(&dev->cache_lock);
 			} else {
 				/* Read into the local buffer then copy.. */
 
-				u8 *local_buffer =
-				    yaffs_get_temp_buffer(dev);
+				u8 *local_buffer;
+
+				mutex_unlock(&dev->cache_lock);
+
+				local_buffer = yaffs_get_temp_buffer(dev);
 				yaffs_rd_data_obj(in, chunk, local_buffer);
 
 				memcpy(buffer, &local_buffer[start], n_copy);
 
 				yaffs_release_temp_buffer(dev, local_buffer);
 			}
-		} else {
-			/* A full chunk. Read directly into the buffer. */
-			yaffs_rd_data_obj(in, chunk, buffer);
 		}
+
 		n -= n_copy;
 		offset += n_copy;
 		buffer += n_copy;
@@ -3583,13 +3633,16 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 
 				if (!cache &&
 				    yaffs_check_alloc_available(dev, 1)) {
-					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
+					cache = yaffs_grab_chunk_cache(in,
+								chunk, 1);
+					if (cache) {
+						cache->object = in;
+						cache->chunk_id = chunk;
+						cache->dirty = 0;
+						cache->locked = 0;
+						yaffs_rd_data_obj(in, chunk,
+								  cache->data);
+					}
 				} else if (cache &&
 					   !cache->dirty &&
 					   !yaffs_check_alloc_available(dev,
@@ -4596,6 +4649,11 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		return YAFFS_FAIL;
 	}
 
+	spin_lock_init(&dev->rd_lock);
+	mutex_init(&dev->nand_lock);
+	mutex_init(&dev->cache_lock);
+	mutex_init(&dev->load_lock);
+
 	dev->internal_start_block = dev->param.start_block;
 	dev->internal_end_block = dev->param.end_block;
 	dev->block_offset = 0;
@@ -4731,6 +4789,11 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->passive_gc_count = 0;
 	dev->oldest_dirty_gc_count = 0;
 	dev->bg_gcs = 0;
+	dev->idle_gcs = 0;
+	dev->n_user_writes = 0;
+	dev->fg_gc_stalls = 0;
+	dev->fg_gc_stall_us = 0;
+	dev->fg_gc_stall_max_us = 0;
 	dev->gc_block_finder = 0;
 	dev->buffered_block = -1;
 	dev->doing_buffered_block_rewrite = 0;
@@ -4755,38 +4818,52 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_lru = NULL;
 	dev->gc_cleanup_list = NULL;
 
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		/* Whole sets only */
+		dev->cache_n_sets =
+		    (dev->param.n_caches + YAFFS_CACHE_WAYS - 1) /
+		    YAFFS_CACHE_WAYS;
+		dev->param.n_caches = dev->cache_n_sets * YAFFS_CACHE_WAYS;
+
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
+		dev->cache_lru = kmalloc(dev->cache_n_sets *
+					 sizeof(struct list_head), GFP_NOFS);
 
 		buf = (u8 *) dev->cache;
+		if (!dev->cache_lru)
+			buf = NULL;
 
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
 
+		for (i = 0; i < dev->cache_n_sets && buf; i++)
+			INIT_LIST_HEAD(&dev->cache_lru[i]);
+
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			list_add_tail(&dev->cache[i].lru,
+				      &dev->cache_lru[i / YAFFS_CACHE_WAYS]);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -4908,6 +4985,8 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 
 			kfree(dev->cache);
 			dev->cache = NULL;
+			kfree(dev->cache_lru);
+			dev->cache_lru = NULL;
 		}
 
 		kfree(dev->gc_cleanup_list);
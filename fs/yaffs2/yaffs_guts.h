@@ -85,7 +85,12 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA	0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	256
+
+/* The short op cache is set-associative: a chunk can only be cached in the
+ * YAFFS_CACHE_WAYS entries of the set its object and chunk id hash to.
+ */
+#define YAFFS_CACHE_WAYS		4
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -112,7 +117,7 @@
 struct yaffs_cache {
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
+	struct list_head lru;	/* In its set's LRU list, most recent first */
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -587,6 +592,9 @@ struct yaffs_param {
 	int always_check_erased;	/* Force chunk erased check always on */
 
 	int disable_summary;
+
+	int scan_threads;	/* Threads reading ahead during a mount scan,
+				 * 0 to read inline. */
 };
 
 struct yaffs_dev {
@@ -696,7 +704,8 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head *cache_lru;	/* Per set, most recently used first */
+	int cache_n_sets;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted
@@ -709,6 +718,15 @@ struct yaffs_dev {
 	int n_unlinked_files;	/* Count of unlinked files. */
 	int n_bg_deletions;	/* Count of background deletions. */
 
+	/* Readers may run concurrently with each other (but never with a
+	 * writer), see yaffs_file_rd_shared(). These cover the state that
+	 * read paths modify.
+	 */
+	spinlock_t rd_lock;		/* temp buffers */
+	struct mutex nand_lock;		/* chunk reads and ECC handling */
+	struct mutex cache_lock;	/* chunk cache lookups and fills */
+	struct mutex load_lock;		/* lazy loading of object details */
+
 	/* Temporary buffer management */
 	struct yaffs_buffer temp_buffer[YAFFS_N_TEMP_BUFFERS];
 	int max_temp;
@@ -744,6 +762,11 @@ struct yaffs_dev {
 	u32 oldest_dirty_gc_count;
 	u32 n_gc_blocks;
 	u32 bg_gcs;
+	u32 idle_gcs;
+	u32 n_user_writes;	/* Chunks written for users, not by gc */
+	u32 fg_gc_stalls;	/* Foreground writes that had to gc a block */
+	u32 fg_gc_stall_us;
+	u32 fg_gc_stall_max_us;
 	u32 n_retired_writes;
 	u32 n_retired_blocks;
 	u32 n_ecc_fixed;
@@ -754,9 +777,20 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
 	u32 tags_used;
 	u32 summary_used;
 
+	/* Breakdown of the last mount scan, times in microseconds */
+	u32 scan_threads;
+	u32 scan_summary_blocks;
+	u32 scan_tags_blocks;
+	u32 scan_query_us;
+	u32 scan_sort_us;
+	u32 scan_merge_us;
+	u32 scan_wait_us;
+	u32 scan_fixup_us;
+
 };
 
 /* The CheckpointDevice structure holds the device information that changes
@@ -822,8 +856,8 @@ unsigned yaffs_get_obj_type(struct yaffs_obj *obj);
 int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 
 /* File operations */
-int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
-		  int n_bytes);
+int yaffs_file_rd_shared(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
+			 int n_bytes);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
@@ -879,6 +913,11 @@ void yaffs_handle_defered_free(struct yaffs_obj *obj);
 
 void yaffs_update_dirty_dirs(struct yaffs_dev *dev);
 
+/* Background gc urgency used when the system is idle: gc harder, whole
+ * blocks at a time, while nobody is waiting on the device.
+ */
+#define YAFFS_BG_GC_IDLE 3
+
 int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency);
 
 /* Debug dump  */
@@ -24,11 +24,14 @@ struct yaffs_linux_context {
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	u32 bg_last_writes;	/* n_user_writes when last seen to change */
+	unsigned long bg_last_active;	/* and the jiffies it was seen then */
+	struct rw_semaphore gross_lock;	/* Gross lock, shared by readers */
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the buffer size
 				 * at compile time so we have to allocate it.
 				 */
 	struct list_head search_contexts;
+	spinlock_t search_lock;	/* search_contexts, for shared holders */
 	void (*put_super_fn) (struct super_block *sb);
 
 	struct task_struct *readdir_process;
@@ -24,12 +24,13 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	struct yaffs_ext_tags local_tags;
 	int flash_chunk = nand_chunk - dev->chunk_offset;
 
-	dev->n_page_reads++;
-
 	/* If there are no tags provided use local tags. */
 	if (!tags)
 		tags = &local_tags;
 
+	mutex_lock(&dev->nand_lock);
+	dev->n_page_reads++;
+
 	if (dev->param.read_chunk_tags_fn)
 		result =
 		    dev->param.read_chunk_tags_fn(dev, flash_chunk, buffer,
@@ -45,6 +46,7 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 					  dev->param.chunks_per_block);
 		yaffs_handle_chunk_error(dev, bi);
 	}
+	mutex_unlock(&dev->nand_lock);
 	return result;
 }
 
@@ -79,6 +79,15 @@ void yaffs_summary_deinit(struct yaffs_dev *dev)
 	dev->chunks_per_summary = 0;
 }
 
+/* A buffer for yaffs_summary_read() other than dev->sum_tags, free with
+ * kfree().
+ */
+struct yaffs_summary_tags *yaffs_summary_alloc(struct yaffs_dev *dev)
+{
+	return kmalloc(sizeof(struct yaffs_summary_tags) *
+			dev->chunks_per_summary, GFP_NOFS);
+}
+
 static int yaffs_summary_write(struct yaffs_dev *dev, int blk)
 {
 	struct yaffs_ext_tags tags;
@@ -217,22 +226,40 @@ int yaffs_summary_add(struct yaffs_dev *dev,
 }
 
 int yaffs_summary_fetch(struct yaffs_dev *dev,
+			struct yaffs_summary_tags *st,
 			struct yaffs_ext_tags *tags,
 			int chunk_in_block)
 {
 	struct yaffs_packed_tags2_tags_only tags_only;
 	struct yaffs_summary_tags *sum_tags;
 	if(chunk_in_block >= 0 && chunk_in_block < dev->chunks_per_summary) {
-		sum_tags = &dev->sum_tags[chunk_in_block];
+		sum_tags = &st[chunk_in_block];
 		tags_only.chunk_id = sum_tags->chunk_id;
 		tags_only.n_bytes = sum_tags->n_bytes;
 		tags_only.obj_id = sum_tags->obj_id;
+		/* Not stored, the caller fills it in from the block info */
+		tags_only.seq_number = 0;
 		yaffs_unpack_tags2_tags_only(tags, &tags_only);
 		return YAFFS_OK;
 	}
 	return YAFFS_FAIL;
 }
 
+/* Account for the chunks holding a summary that was read into a buffer other
+ * than dev->sum_tags, as yaffs_summary_read() does for dev->sum_tags.
+ */
+void yaffs_summary_claim(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	int i;
+
+	for (i = dev->chunks_per_summary; i < dev->param.chunks_per_block; i++) {
+		yaffs_set_chunk_bit(dev, blk, i);
+		bi->pages_in_use++;
+	}
+	bi->has_summary = 1;
+}
+
 void yaffs_summary_gc(struct yaffs_dev *dev, int blk)
 {
 	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
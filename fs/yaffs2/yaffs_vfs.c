@@ -91,6 +91,7 @@
 #ifdef YAFFS_COMPILE_BACKGROUND
 #include <linux/kthread.h>
 #include <linux/delay.h>
+#include <linux/earlysuspend.h>
 #endif
 #ifdef YAFFS_COMPILE_FREEZER
 #include <linux/freezer.h>
@@ -177,7 +178,9 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_bg_idle_secs = 5;
 unsigned int yaffs_auto_select = 1;
+unsigned int yaffs_scan_threads = 4;
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_trace_mask, uint, 0644);
@@ -185,6 +188,8 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_idle_secs, uint, 0644);
+module_param(yaffs_scan_threads, uint, 0644);
 #else
 MODULE_PARM(yaffs_trace_mask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
@@ -502,14 +507,34 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	down_write(&(yaffs_dev_to_lc(dev)->gross_lock));
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	up_write(&(yaffs_dev_to_lc(dev)->gross_lock));
+}
+
+/*
+ * The shared gross lock is for operations that only read: lookups, readdir,
+ * symlinks and page reads. They may run alongside each other but never
+ * alongside anything holding the lock exclusively. The guts serialise what
+ * readers still modify (temp buffers, NAND reads, lazy loading, the chunk
+ * cache) themselves, see yaffs_file_rd_shared().
+ */
+static void yaffs_gross_lock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking shared %p", current);
+	down_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked shared %p", current);
+}
+
+static void yaffs_gross_unlock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking shared %p", current);
+	up_read(&(yaffs_dev_to_lc(dev)->gross_lock));
 }
 
 #ifdef YAFFS_COMPILE_EXPORTFS
@@ -597,7 +622,8 @@ static struct export_operations yaffs_export_ops = {
  *
  * A seach context lives for the duration of a readdir.
  *
- * All these functions must be called while yaffs is locked.
+ * All these functions must be called while yaffs is locked. Readdir only
+ * holds the lock shared, so the context list itself has its own lock.
  */
 
 struct yaffs_search_context {
@@ -628,7 +654,9 @@ static struct yaffs_search_context *yaffs_new_search(struct yaffs_obj *dir)
 			    list_entry(dir->variant.dir_variant.children.next,
 				       struct yaffs_obj, siblings);
 		INIT_LIST_HEAD(&sc->others);
+		spin_lock(&yaffs_dev_to_lc(dev)->search_lock);
 		list_add(&sc->others, &(yaffs_dev_to_lc(dev)->search_contexts));
+		spin_unlock(&yaffs_dev_to_lc(dev)->search_lock);
 	}
 	return sc;
 }
@@ -639,7 +667,9 @@ static struct yaffs_search_context *yaffs_new_search(struct yaffs_obj *dir)
 static void yaffs_search_end(struct yaffs_search_context *sc)
 {
 	if (sc) {
+		spin_lock(&yaffs_dev_to_lc(sc->dev)->search_lock);
 		list_del(&sc->others);
+		spin_unlock(&yaffs_dev_to_lc(sc->dev)->search_lock);
 		kfree(sc);
 	}
 }
@@ -703,11 +733,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user * buffer,
 
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -730,10 +760,10 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	int ret_int = 0;
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	if (!alias) {
 		ret_int = -ENOMEM;
@@ -783,7 +813,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 	struct yaffs_dev *dev = yaffs_inode_to_obj(dir)->my_dev;
 
 	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_lock(dev);
+		yaffs_gross_lock_shared(dev);
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_lookup for %d:%s",
 		yaffs_inode_to_obj(dir)->obj_id, dentry->d_name.name);
@@ -794,7 +824,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
 	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_unlock(dev);
+		yaffs_gross_unlock_shared(dev);
 
 	if (obj) {
 		yaffs_trace(YAFFS_TRACE_OS,
@@ -993,12 +1023,13 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
-	ret = yaffs_file_rd(obj, pg_buf,
-			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
+	ret = yaffs_file_rd_shared(obj, pg_buf,
+				   pg->index << PAGE_CACHE_SHIFT,
+				   PAGE_CACHE_SIZE);
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	if (ret >= 0)
 		ret = 0;
@@ -1518,7 +1549,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_dentry_to_obj(f->f_dentry);
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	yaffs_dev_to_lc(dev)->readdir_process = current;
 
@@ -1537,12 +1568,12 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry . ino %d",
 			(int)inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_gross_unlock_shared(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_gross_lock_shared(dev);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_gross_lock_shared(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1550,14 +1581,14 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry .. ino %d",
 			(int)f->f_dentry->d_parent->d_inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_gross_unlock_shared(dev);
 		if (filldir(dirent, "..", 2, offset,
 			    f->f_dentry->d_parent->d_inode->i_ino,
 			    DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_gross_lock_shared(dev);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_gross_lock_shared(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1584,17 +1615,17 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 				"yaffs_readdir: %s inode %d",
 				name, yaffs_get_obj_inode(l));
 
-			yaffs_gross_unlock(dev);
+			yaffs_gross_unlock_shared(dev);
 
 			if (filldir(dirent,
 				    name,
 				    strlen(name),
 				    offset, this_inode, this_type) < 0) {
-				yaffs_gross_lock(dev);
+				yaffs_gross_lock_shared(dev);
 				goto out;
 			}
 
-			yaffs_gross_lock(dev);
+			yaffs_gross_lock_shared(dev);
 
 			offset++;
 			f->f_pos++;
@@ -1605,7 +1636,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 out:
 	yaffs_search_end(sc);
 	yaffs_dev_to_lc(dev)->readdir_process = NULL;
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	return ret_val;
 }
@@ -2187,7 +2218,11 @@ static void yaffs_flush_super(struct super_block *sb, int do_checkpoint)
 		yaffs_checkpoint_save(dev);
 }
 
-static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
+/*
+ * The background gc urgency. If the device is idle and there is space worth
+ * reclaiming, YAFFS_BG_GC_IDLE lets gc get on with it while nobody waits.
+ */
+static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev, int idle)
 {
 	unsigned erased_chunks =
 	    dev->n_erased_blocks * dev->param.chunks_per_block;
@@ -2201,6 +2236,8 @@ static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
 		return 0;
 	else if (scattered < (dev->param.chunks_per_block * 2))
 		return 0;
+	else if (idle)
+		return YAFFS_BG_GC_IDLE;
 	else if (erased_chunks > dev->n_free_chunks / 2)
 		return 0;
 	else if (erased_chunks > dev->n_free_chunks / 4)
@@ -2214,7 +2251,7 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 
 	struct yaffs_dev *dev = yaffs_super_to_dev(sb);
 	unsigned int oneshot_checkpoint = (yaffs_auto_checkpoint & 4);
-	unsigned gc_urgent = yaffs_bg_gc_urgency(dev);
+	unsigned gc_urgent = yaffs_bg_gc_urgency(dev, 0);
 	int do_checkpoint;
 
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_SYNC | YAFFS_TRACE_BACKGROUND,
@@ -2253,11 +2290,51 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 
 #ifdef YAFFS_COMPILE_BACKGROUND
 
+static int yaffs_screen_off;
+
 void yaffs_background_waker(unsigned long data)
 {
 	wake_up_process((struct task_struct *)data);
 }
 
+/*
+ * The device counts as idle while the screen is off or when nothing has
+ * been written to it for yaffs_bg_idle_secs (0 disables the latter).
+ */
+static int yaffs_bg_idle(struct yaffs_dev *dev, unsigned long now)
+{
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+
+	if (dev->n_user_writes != context->bg_last_writes) {
+		context->bg_last_writes = dev->n_user_writes;
+		context->bg_last_active = now;
+		return 0;
+	}
+
+	return yaffs_screen_off ||
+	    (yaffs_bg_idle_secs &&
+	     time_after(now, context->bg_last_active +
+			yaffs_bg_idle_secs * HZ));
+}
+
+#ifdef CONFIG_HAS_EARLYSUSPEND
+static void yaffs_early_suspend(struct early_suspend *h)
+{
+	yaffs_screen_off = 1;
+}
+
+static void yaffs_late_resume(struct early_suspend *h)
+{
+	yaffs_screen_off = 0;
+}
+
+static struct early_suspend yaffs_early_suspend_handler = {
+	.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN,
+	.suspend = yaffs_early_suspend,
+	.resume = yaffs_late_resume,
+};
+#endif
+
 static int yaffs_bg_thread_fn(void *data)
 {
 	struct yaffs_dev *dev = (struct yaffs_dev *)data;
@@ -2298,7 +2375,8 @@ static int yaffs_bg_thread_fn(void *data)
 
 		if (time_after(now, next_gc) && yaffs_bg_enable) {
 			if (!dev->is_checkpointed) {
-				urgency = yaffs_bg_gc_urgency(dev);
+				urgency = yaffs_bg_gc_urgency(dev,
+						yaffs_bg_idle(dev, now));
 				gc_result = yaffs_bg_gc(dev, urgency);
 				if (urgency > 1)
 					next_gc = now + HZ / 20 + 1;
@@ -2348,6 +2426,8 @@ static int yaffs_bg_start(struct yaffs_dev *dev)
 		return -1;
 
 	context->bg_running = 1;
+	context->bg_last_writes = dev->n_user_writes;
+	context->bg_last_active = jiffies;
 
 	context->bg_thread = kthread_run(yaffs_bg_thread_fn,
 					 (void *)dev, "yaffs-bg-%d",
@@ -2546,6 +2626,7 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int cache_size;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -2555,6 +2636,9 @@ struct yaffs_options {
 	int disable_summary;
 };
 
+/* Short op cache entries per mount, unless set with "cache-size=N" */
+#define YAFFS_DEFAULT_N_CACHES	32
+
 #define MAX_OPT_LEN 30
 static int yaffs_parse_options(struct yaffs_options *options,
 			       const char *options_str)
@@ -2604,6 +2688,15 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "cache-size=", 11)) {
+			options->cache_size =
+			    simple_strtoul(cur_opt + 11, NULL, 0);
+			if (options->cache_size < 1) {
+				printk(KERN_INFO
+				       "yaffs: Bad cache size \"%s\"\n",
+				       cur_opt);
+				error = 1;
+			}
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -2854,7 +2947,12 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	if (options.no_cache)
+		param->n_caches = 0;
+	else if (options.cache_size)
+		param->n_caches = options.cache_size;
+	else
+		param->n_caches = YAFFS_DEFAULT_N_CACHES;
 	param->inband_tags = options.inband_tags;
 
 	param->enable_xattr = 1;
@@ -2871,6 +2969,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->empty_lost_n_found = 1;
 	param->refresh_period = 500;
 	param->disable_summary = options.disable_summary;
+	param->scan_threads = yaffs_scan_threads;
 
 	if (options.empty_lost_and_found_overridden)
 		param->empty_lost_n_found = options.empty_lost_and_found;
@@ -2945,9 +3044,10 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	/* Directory search handling... */
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
+	spin_lock_init(&(yaffs_dev_to_lc(dev)->search_lock));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->gross_lock));
 
 	yaffs_gross_lock(dev);
 
@@ -3143,6 +3243,21 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 				dev->oldest_dirty_gc_count);
 	buf += sprintf(buf, "n_gc_blocks.......... %u\n", dev->n_gc_blocks);
 	buf += sprintf(buf, "bg_gcs............... %u\n", dev->bg_gcs);
+	buf += sprintf(buf, "idle_gcs............. %u\n", dev->idle_gcs);
+	buf += sprintf(buf, "n_user_writes........ %u\n", dev->n_user_writes);
+	buf += sprintf(buf, "fg_gc_stalls......... %u\n", dev->fg_gc_stalls);
+	buf += sprintf(buf, "fg_gc_stall_us....... %u\n", dev->fg_gc_stall_us);
+	buf += sprintf(buf, "fg_gc_stall_max_us... %u\n",
+				dev->fg_gc_stall_max_us);
+	if (dev->n_user_writes) {
+		/* Chunks written to flash per chunk written for users */
+		u32 wa = (u32) div_u64((u64) (dev->n_user_writes +
+					      dev->n_gc_copies) * 100,
+				       dev->n_user_writes);
+
+		buf += sprintf(buf, "write_amplification.. %u.%02u\n",
+			       wa / 100, wa % 100);
+	}
 	buf += sprintf(buf, "n_retired_writes..... %u\n",
 				dev->n_retired_writes);
 	buf += sprintf(buf, "n_retired_blocks..... %u\n",
@@ -3154,6 +3269,7 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_tags_ecc_unfixed... %u\n",
 				dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits........... %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_misses......... %u\n", dev->cache_misses);
 	buf += sprintf(buf, "n_deleted_files...... %u\n", dev->n_deleted_files);
 	buf += sprintf(buf, "n_unlinked_files..... %u\n",
 				dev->n_unlinked_files);
@@ -3161,6 +3277,17 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_bg_deletions....... %u\n", dev->n_bg_deletions);
 	buf += sprintf(buf, "tags_used............ %u\n", dev->tags_used);
 	buf += sprintf(buf, "summary_used......... %u\n", dev->summary_used);
+	buf += sprintf(buf, "\n");
+	buf += sprintf(buf, "scan_threads......... %u\n", dev->scan_threads);
+	buf += sprintf(buf, "scan_summary_blocks.. %u\n",
+				dev->scan_summary_blocks);
+	buf += sprintf(buf, "scan_tags_blocks..... %u\n",
+				dev->scan_tags_blocks);
+	buf += sprintf(buf, "scan_query_us........ %u\n", dev->scan_query_us);
+	buf += sprintf(buf, "scan_sort_us......... %u\n", dev->scan_sort_us);
+	buf += sprintf(buf, "scan_merge_us........ %u\n", dev->scan_merge_us);
+	buf += sprintf(buf, "scan_wait_us......... %u\n", dev->scan_wait_us);
+	buf += sprintf(buf, "scan_fixup_us........ %u\n", dev->scan_fixup_us);
 
 	return buf;
 }
@@ -3425,6 +3552,11 @@ static int __init init_yaffs_fs(void)
 		}
 	}
 
+#if defined(YAFFS_COMPILE_BACKGROUND) && defined(CONFIG_HAS_EARLYSUSPEND)
+	if (!error)
+		register_early_suspend(&yaffs_early_suspend_handler);
+#endif
+
 	return error;
 }
 
@@ -3438,6 +3570,10 @@ static void __exit exit_yaffs_fs(void)
 
 	remove_proc_entry("yaffs", YPROC_ROOT);
 
+#if defined(YAFFS_COMPILE_BACKGROUND) && defined(CONFIG_HAS_EARLYSUSPEND)
+	unregister_early_suspend(&yaffs_early_suspend_handler);
+#endif
+
 	fsinst = fs_to_install;
 
 	while (fsinst->fst) {
@@ -22,6 +22,11 @@
 #include "yaffs_attribs.h"
 #include "yaffs_summary.h"
 
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+
 /*
  * Checkpoints are really no benefit on very small partitions.
  *
@@ -930,13 +935,231 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 	return aseq - bseq;
 }
 
+/*
+ * Mount scan read-ahead.
+ *
+ * The backwards scan has to merge blocks into the object tree newest first,
+ * but reading a block's tags (or its summary) does not depend on the merge.
+ * So worker threads read blocks ahead of the merge into a ring of slots and
+ * the merge takes them in order, only waiting when the readers fall behind.
+ * Slot n holds the scan positions n, n + YAFFS_SCAN_SLOTS, ...
+ */
+#define YAFFS_SCAN_SLOTS	8
+#define YAFFS_SCAN_MAX_THREADS	4
+
+struct yaffs_scan_slot {
+	int free_for;		/* Position the slot may be filled with next */
+	int ready;		/* Position the slot holds, once read */
+	int summary_available;
+	int n_tags_read;	/* Chunks whose tags came from NAND */
+	struct yaffs_summary_tags *sum;
+	struct yaffs_ext_tags *tags;	/* One per chunk in the block */
+};
+
+struct yaffs_scan_ctx {
+	struct yaffs_dev *dev;
+	struct yaffs_block_index *block_index;
+	int n_to_scan;
+	int abort;
+	atomic_t next;		/* Next position for a worker to read */
+	atomic_t running;
+	struct completion done;
+	wait_queue_head_t wait;
+	struct yaffs_scan_slot slot[YAFFS_SCAN_SLOTS];
+};
+
+/* Block to scan at position k: the blocks are sorted oldest first. */
+static inline int yaffs2_scan_pos_block(struct yaffs_scan_ctx *ctx, int k)
+{
+	return ctx->block_index[ctx->n_to_scan - 1 - k].block;
+}
+
+/*
+ * Read the tags for every chunk of a block into a slot, from its summary
+ * where there is one. This only touches the slot, so it may run in a worker
+ * while the merge carries on.
+ */
+static void yaffs2_scan_read_block(struct yaffs_dev *dev, int blk,
+				   struct yaffs_scan_slot *s)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	struct yaffs_ext_tags *tags;
+	int n_chunks;
+	int c;
+
+	s->summary_available = dev->sum_tags &&
+				yaffs_summary_read(dev, s->sum, blk);
+	s->n_tags_read = 0;
+
+	if (s->summary_available)
+		n_chunks = dev->chunks_per_summary;
+	else
+		n_chunks = dev->param.chunks_per_block;
+
+	for (c = 0; c < n_chunks; c++) {
+		tags = &s->tags[c];
+		if (s->summary_available) {
+			yaffs_summary_fetch(dev, s->sum, tags, c);
+			tags->seq_number = bi->seq_number;
+			if (tags->obj_id != 0)
+				continue;
+		}
+		yaffs_rd_chunk_tags_nand(dev,
+				blk * dev->param.chunks_per_block + c,
+				NULL, tags);
+		s->n_tags_read++;
+	}
+}
+
+static int yaffs2_scan_thread(void *data)
+{
+	struct yaffs_scan_ctx *ctx = data;
+	struct yaffs_scan_slot *s;
+	int k;
+
+	while (!ctx->abort) {
+		k = atomic_inc_return(&ctx->next) - 1;
+		if (k >= ctx->n_to_scan)
+			break;
+
+		s = &ctx->slot[k % YAFFS_SCAN_SLOTS];
+		wait_event(ctx->wait, s->free_for == k || ctx->abort);
+		if (ctx->abort)
+			break;
+
+		yaffs2_scan_read_block(ctx->dev,
+				       yaffs2_scan_pos_block(ctx, k), s);
+
+		/* Publish the slot contents before the position */
+		smp_wmb();
+		s->ready = k;
+		wake_up_all(&ctx->wait);
+	}
+
+	if (atomic_dec_and_test(&ctx->running))
+		complete(&ctx->done);
+	return 0;
+}
+
+static struct yaffs_scan_ctx *yaffs2_scan_start(struct yaffs_dev *dev,
+				struct yaffs_block_index *block_index,
+				int n_to_scan)
+{
+	struct yaffs_scan_ctx *ctx;
+	struct task_struct *t;
+	int n_threads;
+	int i;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_NOFS);
+	if (!ctx)
+		return NULL;
+
+	ctx->dev = dev;
+	ctx->block_index = block_index;
+	ctx->n_to_scan = n_to_scan;
+	atomic_set(&ctx->next, 0);
+	atomic_set(&ctx->running, 1);	/* Held by the merge */
+	init_completion(&ctx->done);
+	init_waitqueue_head(&ctx->wait);
+
+	for (i = 0; i < YAFFS_SCAN_SLOTS; i++) {
+		ctx->slot[i].free_for = i;
+		ctx->slot[i].ready = -1;
+		ctx->slot[i].tags = vmalloc(dev->param.chunks_per_block *
+					    sizeof(struct yaffs_ext_tags));
+		if (dev->sum_tags)
+			ctx->slot[i].sum = yaffs_summary_alloc(dev);
+		if (!ctx->slot[i].tags || (dev->sum_tags && !ctx->slot[i].sum))
+			goto fail;
+	}
+
+	/* Reading ahead is pointless for a handful of blocks */
+	n_threads = min_t(int, dev->param.scan_threads, num_online_cpus());
+	n_threads = min(n_threads, YAFFS_SCAN_MAX_THREADS);
+	if (n_to_scan < YAFFS_SCAN_SLOTS)
+		n_threads = 0;
+
+	dev->scan_threads = 0;
+	for (i = 0; i < n_threads; i++) {
+		atomic_inc(&ctx->running);
+		t = kthread_run(yaffs2_scan_thread, ctx, "yaffs-scan/%d", i);
+		if (IS_ERR(t)) {
+			atomic_dec(&ctx->running);
+			break;
+		}
+		dev->scan_threads++;
+	}
+
+	return ctx;
+
+fail:
+	for (i = 0; i < YAFFS_SCAN_SLOTS; i++) {
+		vfree(ctx->slot[i].tags);
+		kfree(ctx->slot[i].sum);
+	}
+	kfree(ctx);
+	return NULL;
+}
+
+/*
+ * Get the slot for scan position k, reading the block now if there are no
+ * workers. Returns the time spent waiting for the workers in *wait.
+ */
+static struct yaffs_scan_slot *yaffs2_scan_get(struct yaffs_scan_ctx *ctx,
+					       int k, s64 *wait)
+{
+	struct yaffs_scan_slot *s = &ctx->slot[k % YAFFS_SCAN_SLOTS];
+	ktime_t start;
+
+	if (!ctx->dev->scan_threads) {
+		yaffs2_scan_read_block(ctx->dev, yaffs2_scan_pos_block(ctx, k),
+				       s);
+		return s;
+	}
+
+	if (s->ready != k) {
+		start = ktime_get();
+		wait_event(ctx->wait, s->ready == k);
+		*wait += ktime_us_delta(ktime_get(), start);
+	}
+	smp_rmb();
+	return s;
+}
+
+static void yaffs2_scan_put(struct yaffs_scan_ctx *ctx, int k)
+{
+	struct yaffs_scan_slot *s = &ctx->slot[k % YAFFS_SCAN_SLOTS];
+
+	if (!ctx->dev->scan_threads)
+		return;
+
+	s->free_for = k + YAFFS_SCAN_SLOTS;
+	wake_up_all(&ctx->wait);
+}
+
+static void yaffs2_scan_stop(struct yaffs_scan_ctx *ctx)
+{
+	int i;
+
+	ctx->abort = 1;
+	wake_up_all(&ctx->wait);
+	if (!atomic_dec_and_test(&ctx->running))
+		wait_for_completion(&ctx->done);
+
+	for (i = 0; i < YAFFS_SCAN_SLOTS; i++) {
+		vfree(ctx->slot[i].tags);
+		kfree(ctx->slot[i].sum);
+	}
+	kfree(ctx);
+}
+
 static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 		struct yaffs_block_info *bi,
 		int blk, int chunk_in_block,
 		int *found_chunks,
 		u8 *chunk_data,
 		struct list_head *hard_list,
-		int summary_available)
+		const struct yaffs_ext_tags *read_tags)
 {
 	struct yaffs_obj_hdr *oh;
 	struct yaffs_obj *in;
@@ -945,7 +1168,7 @@ static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 	int file_size;
 	int is_shrink;
 	int is_unlinked;
-	struct yaffs_ext_tags tags;
+	struct yaffs_ext_tags tags = *read_tags;
 	int result;
 	int alloc_failed = 0;
 	int chunk = blk * dev->param.chunks_per_block + chunk_in_block;
@@ -953,18 +1176,6 @@ static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 	struct yaffs_hardlink_var *hl_var;
 	struct yaffs_symlink_var *sl_var;
 
-	if (summary_available) {
-		result = yaffs_summary_fetch(dev, &tags, chunk_in_block);
-		tags.seq_number = bi->seq_number;
-	}
-
-	if (!summary_available || tags.obj_id == 0) {
-		result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL, &tags);
-		dev->tags_used++;
-	} else {
-		dev->summary_used++;
-	}
-
 	/* Let's have a good look at this chunk... */
 
 	if (!tags.chunk_used) {
@@ -1359,7 +1570,11 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	int alloc_failed = 0;
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
-	int summary_available;
+	struct yaffs_scan_ctx *ctx;
+	struct yaffs_scan_slot *slot;
+	ktime_t start;
+	ktime_t phase;
+	s64 wait_us = 0;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
@@ -1384,9 +1599,13 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	}
 
 	dev->blocks_in_checkpt = 0;
+	dev->scan_summary_blocks = 0;
+	dev->scan_tags_blocks = 0;
 
 	chunk_data = yaffs_get_temp_buffer(dev);
 
+	start = ktime_get();
+
 	/* Scan all the blocks to determine their state */
 	bi = dev->block_info;
 	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
@@ -1441,6 +1660,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_trace(YAFFS_TRACE_SCAN, "%d blocks to be sorted...", n_to_scan);
 
+	phase = ktime_get();
+	dev->scan_query_us = ktime_us_delta(phase, start);
+	start = phase;
+
 	cond_resched();
 
 	/* Sort the blocks by sequence number */
@@ -1451,6 +1674,18 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_trace(YAFFS_TRACE_SCAN, "...done");
 
+	phase = ktime_get();
+	dev->scan_sort_us = ktime_us_delta(phase, start);
+	start = phase;
+
+	ctx = yaffs2_scan_start(dev, block_index, n_to_scan);
+	if (!ctx) {
+		yaffs_trace(YAFFS_TRACE_SCAN,
+			"yaffs2_scan_backwards() could not allocate scan slots!"
+			);
+		alloc_failed = 1;
+	}
+
 	/* Now scan the blocks looking at the data. */
 	start_iter = 0;
 	end_iter = n_to_scan - 1;
@@ -1469,11 +1704,21 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		bi = yaffs_get_block_info(dev, blk);
 		deleted = 0;
 
-		summary_available = yaffs_summary_read(dev, dev->sum_tags, blk);
+		slot = yaffs2_scan_get(ctx, end_iter - block_iter, &wait_us);
+
+		if (slot->summary_available) {
+			yaffs_summary_claim(dev, blk);
+			dev->scan_summary_blocks++;
+			dev->summary_used +=
+				dev->chunks_per_summary - slot->n_tags_read;
+		} else {
+			dev->scan_tags_blocks++;
+		}
+		dev->tags_used += slot->n_tags_read;
 
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
-		if(summary_available)
+		if (slot->summary_available)
 			c = dev->chunks_per_summary - 1;
 		else
 			c = dev->param.chunks_per_block - 1;
@@ -1488,11 +1733,13 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			 */
 			if (yaffs2_scan_chunk(dev, bi, blk, c,
 					&found_chunks, chunk_data,
-					&hard_list, summary_available) ==
+					&hard_list, &slot->tags[c]) ==
 					YAFFS_FAIL)
 				alloc_failed = 1;
 		}
 
+		yaffs2_scan_put(ctx, end_iter - block_iter);
+
 		if (bi->block_state == YAFFS_BLOCK_STATE_NEEDS_SCAN) {
 			/* If we got this far while scanning, then the block
 			 * is fully allocated. */
@@ -1507,6 +1754,14 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		}
 	}
 
+	if (ctx)
+		yaffs2_scan_stop(ctx);
+
+	phase = ktime_get();
+	dev->scan_merge_us = ktime_us_delta(phase, start);
+	dev->scan_wait_us = wait_us;
+	start = phase;
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
@@ -1523,9 +1778,17 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_release_temp_buffer(dev, chunk_data);
 
+	dev->scan_fixup_us = ktime_us_delta(ktime_get(), start);
+
 	if (alloc_failed)
 		return YAFFS_FAIL;
 
+	yaffs_trace(YAFFS_TRACE_ALWAYS,
+		"yaffs: scanned %d blocks (%u by summary) with %u readers: query %uus sort %uus merge %uus (waiting %uus) fixup %uus",
+		n_to_scan, dev->scan_summary_blocks, dev->scan_threads,
+		dev->scan_query_us, dev->scan_sort_us, dev->scan_merge_us,
+		dev->scan_wait_us, dev->scan_fixup_us);
+
 	yaffs_trace(YAFFS_TRACE_SCAN, "yaffs2_scan_backwards ends");
 
 	return YAFFS_OK;
@@ -1,7 +1,7 @@
 #ifndef __LZ4_H__
 #define __LZ4_H__
 /*
- * LZ4 Decompressor Kernel Interface
+ * LZ4 Kernel Interface
  *
  * Copyright (C) 2013, LG Electronics, Kyungsik Lee <kyungsik.lee@lge.com>
  * Based on LZ4 implementation by Yann Collet.
@@ -39,6 +39,9 @@
  */
 
 
+#define LZ4_MEM_COMPRESS	(4096 * sizeof(unsigned char *))
+#define LZ4HC_MEM_COMPRESS	(256 * 1024 + 2 * sizeof(unsigned char *))
+
 /*
  * LZ4_COMPRESSBOUND()
  * Provides the maximum size that LZ4 may output in a "worst case" scenario
@@ -46,6 +49,45 @@
  */
 #define LZ4_COMPRESSBOUND(isize) (isize + ((isize)/255) + 16)
 
+static inline size_t lz4_compressbound(size_t isize)
+{
+	return LZ4_COMPRESSBOUND(isize);
+}
+
+/*
+ * lz4_compress()
+ *	src     : source address of the original data
+ *	src_len : size of the original data
+ *	dst	: output buffer address of the compressed data
+ *		This requires 'dst' of size LZ4_COMPRESSBOUND.
+ *	dst_len : is the output size, which is returned after compress done
+ *	workmem : address of the working memory.
+ *		This requires 'workmem' of size LZ4_MEM_COMPRESS.
+ *	return  : Success if return 0
+ *		  Error if return (< 0)
+ *	note :  Destination buffer and workmem must be already allocated with
+ *		the defined size.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/*
+ * lz4hc_compress()
+ *	src     : source address of the original data
+ *	src_len : size of the original data
+ *	dst	: output buffer address of the compressed data
+ *		This requires 'dst' of size LZ4_COMPRESSBOUND.
+ *	dst_len : is the output size, which is returned after compress done
+ *	workmem : address of the working memory.
+ *		This requires 'workmem' of size LZ4HC_MEM_COMPRESS.
+ *	return  : Success if return 0
+ *		  Error if return (< 0)
+ *	note :  Slower than lz4_compress() but produces smaller output in
+ *		the same format, so lz4_decompress() reads it as is.
+ */
+int lz4hc_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem);
+
 /*
  * lz4_decompress()
  *	src     : source address of the compressed data
@@ -13,6 +13,8 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
+struct signal_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -41,5 +43,30 @@ static inline void oom_killer_enable(void)
 {
 	oom_killer_disabled = false;
 }
+
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_index_add(struct task_struct *tsk);
+extern void lowmem_index_del(struct signal_struct *sig);
+extern void lowmem_index_adj(struct task_struct *tsk);
+extern void lowmem_vmpressure(gfp_t gfp_mask, unsigned long scanned,
+			      unsigned long reclaimed);
+#else
+static inline void lowmem_index_add(struct task_struct *tsk)
+{
+}
+
+static inline void lowmem_index_del(struct signal_struct *sig)
+{
+}
+
+static inline void lowmem_index_adj(struct task_struct *tsk)
+{
+}
+
+static inline void lowmem_vmpressure(gfp_t gfp_mask, unsigned long scanned,
+				     unsigned long reclaimed)
+{
+}
+#endif
 #endif /* __KERNEL__*/
 #endif /* _INCLUDE_LINUX_OOM_H */
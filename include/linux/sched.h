@@ -677,6 +677,9 @@ struct signal_struct {
 #endif
 
 	int oom_adj;	/* OOM kill score adjustment (bit shift) */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct list_head lmk_adj_node;	/* lowmemorykiller index, by oom_adj */
+#endif
 };
 
 /* Context switch must be unlocked if interrupts are to be enabled */
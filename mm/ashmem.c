@@ -29,6 +29,14 @@
 #include <linux/mutex.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/radix-tree.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/lzo.h>
 #include <asm/cacheflush.h>
 
 #define ASHMEM_NAME_PREFIX "dev/ashmem/"
@@ -38,10 +46,11 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
+	struct mutex mutex;		/* protects the area and its ranges */
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
 	struct list_head unpinned_list;	/* list of all ashmem areas */
 	struct file *file;		/* the shmem-based backing file */
@@ -49,12 +58,16 @@ struct ashmem_area {
 	unsigned long vm_start;		/* Start address of vm_area
 					 * which maps this ashmem */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+#ifdef CONFIG_ASHMEM_COMPRESS
+	struct radix_tree_root zpages;	/* compressed purged pages */
+#endif
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex', the `lru' entry by
+ * `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -65,18 +78,25 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and count
+ *
+ * Lock Ordering: asma->mutex -> i_mutex -> i_alloc_sem
+ *                asma->mutex -> ashmem_lru_lock
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * The shrinker finds areas through the LRU, so it only ever trylocks an
+ * area's mutex under ashmem_lru_lock.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* max. number of LRU entries looked at for ranges of one area to purge */
+#define ASHMEM_SHRINK_BATCH	32
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -107,16 +127,26 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+/* Caller must hold ashmem_lru_lock. */
+static inline void __lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	__lru_del(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
@@ -126,7 +156,7 @@ static inline void lru_del(struct ashmem_range *range)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
@@ -162,7 +192,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold the range's asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -172,10 +202,356 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
+}
+
+#ifdef CONFIG_ASHMEM_COMPRESS
+/*
+ * Instead of being discarded outright, the pages of unpinned ranges the
+ * shrinker purges can be kept lzo-compressed in a pool, up to
+ * compress_pool_kb. ashmem_pin() puts them back when memory allows, so
+ * callers see ASHMEM_NOT_PURGED and need not regenerate their contents.
+ *
+ * A range is only kept if all of its pages make it into the pool; pages of
+ * a range that was not, or that cannot be restored, are purged as usual.
+ */
+static int ashmem_compress = 1;
+module_param_named(compress, ashmem_compress, bool, S_IRUGO | S_IWUSR);
+static unsigned long ashmem_compress_pool_kb = 8192;
+module_param_named(compress_pool_kb, ashmem_compress_pool_kb, ulong,
+		   S_IRUGO | S_IWUSR);
+
+/*
+ * a compressed page, in its area's `zpages' tree and, by when it was stored,
+ * on ashmem_zpool_lru
+ */
+struct ashmem_zpage {
+	struct list_head lru;
+	struct ashmem_area *asma;
+	pgoff_t index;
+	size_t len;
+	unsigned char data[0];
+};
+
+/* protects the scratch buffers below, nests inside asma->mutex */
+static DEFINE_MUTEX(ashmem_compress_mutex);
+static void *ashmem_zwrkmem;
+static unsigned char *ashmem_zbuf;
+
+/* pool LRU, size and statistics, protected by ashmem_zpool_lock */
+static DEFINE_SPINLOCK(ashmem_zpool_lock);
+static LIST_HEAD(ashmem_zpool_lru);
+static u64 ashmem_zpool_bytes;
+static u64 ashmem_zpool_pages;
+static u64 ashmem_zstat_stored;		/* ranges kept compressed */
+static u64 ashmem_zstat_rejected;	/* ranges purged as usual instead */
+static u64 ashmem_zstat_hits;		/* pins restoring all their pages */
+static u64 ashmem_zstat_misses;		/* pins of purged, unrestored pages */
+
+static void ashmem_zpage_free(struct ashmem_zpage *zpage)
+{
+	spin_lock(&ashmem_zpool_lock);
+	list_del(&zpage->lru);
+	ashmem_zpool_bytes -= zpage->len;
+	ashmem_zpool_pages--;
+	spin_unlock(&ashmem_zpool_lock);
+	kfree(zpage);
+}
+
+/*
+ * ashmem_drop_zpages - frees the compressed pages of 'asma' from 'start' to
+ * 'end', inclusive, returning how many there were.
+ *
+ * Caller must hold asma->mutex.
+ */
+static size_t ashmem_drop_zpages(struct ashmem_area *asma, pgoff_t start,
+				 pgoff_t end)
+{
+	struct ashmem_zpage *zpages[16];
+	size_t dropped = 0;
+	int i, n;
+
+	while (start <= end) {
+		n = radix_tree_gang_lookup(&asma->zpages, (void **) zpages,
+					   start, ARRAY_SIZE(zpages));
+		if (!n)
+			break;
+		for (i = 0; i < n && zpages[i]->index <= end; i++) {
+			radix_tree_delete(&asma->zpages, zpages[i]->index);
+			start = zpages[i]->index + 1;
+			ashmem_zpage_free(zpages[i]);
+			dropped++;
+		}
+		if (i < n || !start)
+			break;
+	}
+
+	return dropped;
+}
+
+/* ashmem_zpool_count - how many pages worth of memory the pool takes up */
+static unsigned long ashmem_zpool_count(void)
+{
+	unsigned long nr;
+
+	spin_lock(&ashmem_zpool_lock);
+	nr = ashmem_zpool_bytes >> PAGE_SHIFT;
+	spin_unlock(&ashmem_zpool_lock);
+
+	return nr;
+}
+
+/*
+ * ashmem_zpool_shrink - frees the least recently stored compressed pages
+ * until 'nr' pages worth of memory went back, returning how many did.
+ *
+ * The pages of a range are stored one after the other, so they mostly go
+ * together; a range left with only some of them is purged on pin. Like the
+ * range LRU, areas whose mutex is busy are rotated rather than waited for.
+ */
+static int ashmem_zpool_shrink(int nr)
+{
+	size_t goal = (size_t) nr << PAGE_SHIFT, freed = 0;
+	struct ashmem_zpage *zpage;
+	struct ashmem_area *asma;
+	unsigned long busy = 0;
+
+	spin_lock(&ashmem_zpool_lock);
+	while (freed < goal && !list_empty(&ashmem_zpool_lru)) {
+		zpage = list_first_entry(&ashmem_zpool_lru,
+					 struct ashmem_zpage, lru);
+		asma = zpage->asma;
+
+		/* a zpage is only freed under its area's mutex */
+		if (unlikely(!mutex_trylock(&asma->mutex))) {
+			list_move_tail(&zpage->lru, &ashmem_zpool_lru);
+			if (++busy > ASHMEM_SHRINK_BATCH)
+				break;
+			continue;
+		}
+		spin_unlock(&ashmem_zpool_lock);
+
+		freed += zpage->len;
+		radix_tree_delete(&asma->zpages, zpage->index);
+		ashmem_zpage_free(zpage);
+		mutex_unlock(&asma->mutex);
+
+		spin_lock(&ashmem_zpool_lock);
+	}
+	spin_unlock(&ashmem_zpool_lock);
+
+	return freed >> PAGE_SHIFT;
+}
+
+/*
+ * ashmem_compress_range - stores the pages of 'range', about to be purged,
+ * in the pool. Returns nonzero if they all were.
+ *
+ * Called from the shrinker, so nothing here may wait for memory.
+ * Caller must hold asma->mutex.
+ */
+static int ashmem_compress_range(struct ashmem_area *asma,
+				 struct ashmem_range *range)
+{
+	struct address_space *mapping = asma->file->f_mapping;
+	unsigned long limit = ashmem_compress_pool_kb << 10;
+	struct ashmem_zpage *zpage;
+	struct page *page;
+	unsigned char *src;
+	size_t clen;
+	pgoff_t pgoff;
+	int ret = 0;
+
+	if (!ashmem_compress || !ashmem_zwrkmem)
+		return 0;
+
+	mutex_lock(&ashmem_compress_mutex);
+	for (pgoff = range->pgstart; pgoff <= range->pgend; pgoff++) {
+		/* pages not in the page cache cannot be told from holes */
+		page = find_get_page(mapping, pgoff);
+		if (!page)
+			goto out;
+
+		src = kmap_atomic(page, KM_USER0);
+		lzo1x_1_compress(src, PAGE_SIZE, ashmem_zbuf, &clen,
+				 ashmem_zwrkmem);
+		kunmap_atomic(src, KM_USER0);
+		page_cache_release(page);
+
+		if (clen >= PAGE_SIZE || ashmem_zpool_bytes + clen > limit)
+			goto out;
+
+		zpage = kmalloc(sizeof(*zpage) + clen,
+				GFP_NOWAIT | __GFP_NOWARN);
+		if (!zpage)
+			goto out;
+		zpage->asma = asma;
+		zpage->index = pgoff;
+		zpage->len = clen;
+		memcpy(zpage->data, ashmem_zbuf, clen);
+		if (radix_tree_insert(&asma->zpages, pgoff, zpage)) {
+			kfree(zpage);
+			goto out;
+		}
+
+		spin_lock(&ashmem_zpool_lock);
+		list_add_tail(&zpage->lru, &ashmem_zpool_lru);
+		ashmem_zpool_bytes += clen;
+		ashmem_zpool_pages++;
+		spin_unlock(&ashmem_zpool_lock);
+	}
+	ret = 1;
+
+out:
+	mutex_unlock(&ashmem_compress_mutex);
+
+	if (!ret)
+		ashmem_drop_zpages(asma, range->pgstart, range->pgend);
+
+	spin_lock(&ashmem_zpool_lock);
+	if (ret)
+		ashmem_zstat_stored++;
+	else
+		ashmem_zstat_rejected++;
+	spin_unlock(&ashmem_zpool_lock);
+
+	return ret;
+}
+
+/*
+ * ashmem_uncompress_range - writes the compressed pages of 'asma' from
+ * 'start' to 'end', inclusive, back to its file. Returns ASHMEM_NOT_PURGED
+ * if all of them were restored and ASHMEM_WAS_PURGED otherwise; either way
+ * none are left in the pool.
+ *
+ * Caller must hold asma->mutex.
+ */
+static unsigned int ashmem_uncompress_range(struct ashmem_area *asma,
+					    pgoff_t start, pgoff_t end)
+{
+	struct address_space *mapping = asma->file->f_mapping;
+	unsigned long nr = end - start + 1;
+	struct ashmem_zpage *zpage;
+	struct page *page;
+	unsigned char *dst;
+	void *fsdata;
+	size_t len;
+	pgoff_t pgoff;
+	int ret;
+
+	if (!ashmem_zpool_pages)
+		goto miss;
+
+	/* does the pool have all of them, and is there memory for them? */
+	for (pgoff = start; pgoff <= end; pgoff++)
+		if (!radix_tree_lookup(&asma->zpages, pgoff))
+			goto miss;
+	if (global_page_state(NR_FREE_PAGES) < totalreserve_pages + nr)
+		goto miss;
+
+	for (pgoff = start; pgoff <= end; pgoff++) {
+		zpage = radix_tree_delete(&asma->zpages, pgoff);
+
+		ret = pagecache_write_begin(asma->file, mapping,
+					    (loff_t) pgoff << PAGE_SHIFT,
+					    PAGE_SIZE, 0, &page, &fsdata);
+		if (ret) {
+			ashmem_zpage_free(zpage);
+			goto miss;
+		}
+
+		len = PAGE_SIZE;
+		dst = kmap_atomic(page, KM_USER0);
+		ret = lzo1x_decompress_safe(zpage->data, zpage->len, dst,
+					    &len);
+		kunmap_atomic(dst, KM_USER0);
+		flush_dcache_page(page);
+		pagecache_write_end(asma->file, mapping,
+				    (loff_t) pgoff << PAGE_SHIFT, PAGE_SIZE,
+				    PAGE_SIZE, page, fsdata);
+		ashmem_zpage_free(zpage);
+
+		if (ret != LZO_E_OK || len != PAGE_SIZE)
+			goto miss;
+	}
+
+	spin_lock(&ashmem_zpool_lock);
+	ashmem_zstat_hits++;
+	spin_unlock(&ashmem_zpool_lock);
+	return ASHMEM_NOT_PURGED;
+
+miss:
+	ashmem_drop_zpages(asma, start, end);
+	spin_lock(&ashmem_zpool_lock);
+	ashmem_zstat_misses++;
+	spin_unlock(&ashmem_zpool_lock);
+	return ASHMEM_WAS_PURGED;
 }
 
+static void __init ashmem_compress_init(void)
+{
+	struct dentry *dir;
+
+	ashmem_zwrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	ashmem_zbuf = kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+	if (!ashmem_zwrkmem || !ashmem_zbuf) {
+		printk(KERN_ERR "ashmem: no memory for compression\n");
+		vfree(ashmem_zwrkmem);
+		kfree(ashmem_zbuf);
+		ashmem_zwrkmem = NULL;
+		return;
+	}
+
+	dir = debugfs_create_dir("ashmem", NULL);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+	debugfs_create_u64("pool_bytes", S_IRUGO, dir, &ashmem_zpool_bytes);
+	debugfs_create_u64("pool_pages", S_IRUGO, dir, &ashmem_zpool_pages);
+	debugfs_create_u64("ranges_stored", S_IRUGO, dir,
+			   &ashmem_zstat_stored);
+	debugfs_create_u64("ranges_rejected", S_IRUGO, dir,
+			   &ashmem_zstat_rejected);
+	debugfs_create_u64("pin_hits", S_IRUGO, dir, &ashmem_zstat_hits);
+	debugfs_create_u64("pin_misses", S_IRUGO, dir, &ashmem_zstat_misses);
+}
+#else
+static inline unsigned long ashmem_zpool_count(void)
+{
+	return 0;
+}
+
+static inline int ashmem_zpool_shrink(int nr)
+{
+	return 0;
+}
+
+static inline size_t ashmem_drop_zpages(struct ashmem_area *asma,
+					pgoff_t start, pgoff_t end)
+{
+	return 0;
+}
+
+static inline int ashmem_compress_range(struct ashmem_area *asma,
+					struct ashmem_range *range)
+{
+	return 0;
+}
+
+static inline unsigned int ashmem_uncompress_range(struct ashmem_area *asma,
+						   pgoff_t start, pgoff_t end)
+{
+	return ASHMEM_WAS_PURGED;
+}
+
+static inline void ashmem_compress_init(void)
+{
+}
+#endif
+
 static int ashmem_open(struct inode *inode, struct file *file)
 {
 	struct ashmem_area *asma;
@@ -189,7 +565,11 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
+	mutex_init(&asma->mutex);
 	INIT_LIST_HEAD(&asma->unpinned_list);
+#ifdef CONFIG_ASHMEM_COMPRESS
+	INIT_RADIX_TREE(&asma->zpages, GFP_NOWAIT | __GFP_NOWARN);
+#endif
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -202,10 +582,11 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	ashmem_drop_zpages(asma, 0, ULONG_MAX);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -220,7 +601,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -241,7 +622,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -250,7 +631,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -271,7 +652,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -288,7 +669,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -332,7 +713,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	asma->vm_start = vma->vm_start;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -348,39 +729,77 @@ out:
  * proceed without risk of deadlock (due to gfp_mask).
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * chunks of ashmem regions LRU-wise until we hit 'nr_to_scan' pages freed.
+ *
+ * Purging is batched per area: with the area at the head of the LRU locked,
+ * its other ranges among the next ASHMEM_SHRINK_BATCH LRU entries go as
+ * well. Only that area's mutex is held while its pages are truncated, so
+ * pin and unpin on all other areas go on. Areas whose mutex is busy are
+ * rotated to the tail of the LRU instead of waited for.
+ *
+ * Compressed pages kept from earlier purges are the cheapest to lose, so the
+ * oldest of those go before any unpinned range is purged.
  */
 static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
 	struct ashmem_range *range, *next;
+	struct ashmem_area *asma;
+	LIST_HEAD(batch);
+	unsigned long busy = 0;
+	int scan;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
 		return -1;
 	if (!nr_to_scan)
-		return lru_count;
+		return lru_count + ashmem_zpool_count();
+
+	nr_to_scan -= ashmem_zpool_shrink(nr_to_scan);
+
+	spin_lock(&ashmem_lru_lock);
+	while (nr_to_scan > 0 && !list_empty(&ashmem_lru_list)) {
+		range = list_first_entry(&ashmem_lru_list, struct ashmem_range,
+					 lru);
+		asma = range->asma;
+
+		/* Avoid deadlock caused by recursive locking  */
+		if (unlikely(!mutex_trylock(&asma->mutex))) {
+			list_move_tail(&range->lru, &ashmem_lru_list);
+			if (++busy > ASHMEM_SHRINK_BATCH)
+				break;
+			continue;
+		}
 
-	/* Avoid deadlock caused by recursive locking  */
-	if (unlikely(!mutex_trylock(&ashmem_mutex)))
-		return -1;
+		scan = 0;
+		list_for_each_entry_safe_from(range, next, &ashmem_lru_list,
+					      lru) {
+			if (nr_to_scan <= 0 || scan++ == ASHMEM_SHRINK_BATCH)
+				break;
+			if (range->asma != asma)
+				continue;
+			__lru_del(range);
+			list_add_tail(&range->lru, &batch);
+			nr_to_scan -= range_size(range);
+		}
+		spin_unlock(&ashmem_lru_lock);
 
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+		list_for_each_entry_safe(range, next, &batch, lru) {
+			struct inode *inode = asma->file->f_dentry->d_inode;
+			loff_t start = range->pgstart * PAGE_SIZE;
+			loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+			list_del(&range->lru);
+			ashmem_compress_range(asma, range);
+			vmtruncate_range(inode, start, end);
+			range->purged = ASHMEM_WAS_PURGED;
+		}
+		mutex_unlock(&asma->mutex);
 
-		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
+		spin_lock(&ashmem_lru_lock);
 	}
-	mutex_unlock(&ashmem_mutex);
+	spin_unlock(&ashmem_lru_lock);
 
-	return lru_count;
+	return lru_count + ashmem_zpool_count();
 }
 
 static struct shrinker ashmem_shrinker = {
@@ -392,7 +811,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -407,7 +826,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -415,7 +834,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -429,7 +848,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -438,7 +857,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -455,7 +874,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -464,7 +883,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -492,7 +911,10 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 		 *    create a new range for the other side.
 		 */
 		if (page_range_in_range(range, pgstart, pgend)) {
-			ret |= range->purged;
+			if (range->purged == ASHMEM_WAS_PURGED)
+				ret |= ashmem_uncompress_range(asma,
+					max_t(size_t, range->pgstart, pgstart),
+					min_t(size_t, range->pgend, pgend));
 
 			/* Case #1: Easy. Just nuke the whole thing. */
 			if (page_range_subsumes_range(range, pgstart, pgend)) {
@@ -530,7 +952,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -565,7 +987,7 @@ restart:
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -614,7 +1036,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -628,7 +1050,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -679,7 +1101,7 @@ static int ashmem_cache_op(struct ashmem_area *asma,
 #ifdef CONFIG_OUTER_CACHE
 	unsigned long vaddr;
 #endif
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 #ifndef CONFIG_OUTER_CACHE
 	cache_func(asma->vm_start, asma->size, 0);
 #else
@@ -694,7 +1116,7 @@ static int ashmem_cache_op(struct ashmem_area *asma,
 	}
 
 #endif
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return 0;
 }
 
@@ -849,6 +1271,7 @@ static int __init ashmem_init(void)
 	}
 
 	register_shrinker(&ashmem_shrinker);
+	ashmem_compress_init();
 
 	printk(KERN_INFO "ashmem: initialized\n");
 